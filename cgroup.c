@@ -0,0 +1,689 @@
+// SPDX-License-Identifier: MIT
+
+/* Whole-cgroup kills on the cgroup v2 hierarchy (--cgroup-kill).
+ *
+ * On container hosts and systemd machines, a service or container is a
+ * leaf cgroup, and killing a single process of it often leaves the rest
+ * broken. Here we find the leaf cgroup that uses the most memory and swap
+ * (memory.current + memory.swap.current) and kill it through cgroup.kill
+ * (Linux v5.14+), which also gets processes that fork while we kill.
+ * cgroup.events says "populated 0" once all of them are gone.
+ *
+ * With --cgroup-hints, we also look at what the cgroups say about
+ * themselves: the user.oomd_omit and user.oomd_avoid xattrs that systemd
+ * sets from ManagedOOMPreference=, and the memory.min and memory.low
+ * protection. These are cached per cgroup directory, so a scan over
+ * thousands of processes in a few cgroups only looks at the few cgroups. */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "meminfo.h"
+#include "msg.h"
+
+// A cgroup with a process that has this oom_score_adj is never killed,
+// like the kernel does with memory.oom.group
+#define OOM_SCORE_ADJ_MIN -1000
+
+// Read up to len-1 bytes from dir/name and null-terminate them.
+// Returns the number of bytes read or -errno.
+static ssize_t read_file(const char* dir, const char* name, char* buf, size_t len)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    ssize_t n = read(fd, buf, len - 1);
+    int read_errno = errno;
+    close(fd);
+    if (n < 0) {
+        return -read_errno;
+    }
+    buf[n] = 0;
+    return n;
+}
+
+// Check that `root` is a directory in a cgroup v2 hierarchy.
+// Returns 0 or -errno.
+int cgroup_check_root(const char* root)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/cgroup.procs", root);
+    struct stat st = { 0 };
+    if (stat(path, &st) != 0) {
+        return -errno;
+    }
+    // The cgroup v1 hierarchies have "tasks" next to it
+    snprintf(path, sizeof(path), "%s/tasks", root);
+    if (stat(path, &st) == 0) {
+        return -EPROTONOSUPPORT;
+    }
+    return 0;
+}
+
+// Path of the cgroup below the root, like "/system.slice/foo.service"
+const char* cgroup_name(const cgroup_info_t* cg)
+{
+    const char* name = cg->dir + cg->root_len;
+    return strlen(name) ? name : "/";
+}
+
+// Read the memory value in bytes from dir/name, like memory.current, in KiB.
+// "max" is returned as LLONG_MAX.
+// Returns 0 or -errno.
+int cgroup_read_kib(const char* dir, const char* name, long long* out)
+{
+    char buf[32];
+    ssize_t n = read_file(dir, name, buf, sizeof(buf));
+    if (n < 0) {
+        return (int)n;
+    }
+    return cgroup_parse_kib(buf, out);
+}
+
+// Parse the contents of a memory file like memory.max, see cgroup_read_kib().
+// Returns 0 or -errno.
+int cgroup_parse_kib(const char* buf, long long* out)
+{
+    if (strncmp(buf, "max", 3) == 0) {
+        *out = LLONG_MAX;
+        return 0;
+    }
+    char* end = NULL;
+    long long bytes = strtoll(buf, &end, 10);
+    if (end == buf) {
+        return -ENODATA;
+    }
+    *out = bytes / 1024;
+    return 0;
+}
+
+// List the processes in dir/cgroup.procs into a malloc'ed array.
+// Returns the number of processes or -errno.
+int cgroup_read_procs(const char* dir, int** out)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+    FILE* f = fopen(path, "re");
+    if (f == NULL) {
+        return -errno;
+    }
+    int* pids = NULL;
+    int n = 0, cap = 0, pid = 0;
+    while (fscanf(f, "%d", &pid) == 1) {
+        if (n == cap) {
+            cap = cap ? 2 * cap : 16;
+            int* fresh = realloc(pids, (size_t)cap * sizeof(*fresh));
+            if (fresh == NULL) {
+                free(pids);
+                fclose(f);
+                return -ENOMEM;
+            }
+            pids = fresh;
+        }
+        pids[n++] = pid;
+    }
+    fclose(f);
+    *out = pids;
+    return n;
+}
+
+static bool is_dir(DIR* d, const struct dirent* e)
+{
+    if (e->d_type != DT_UNKNOWN) {
+        return e->d_type == DT_DIR;
+    }
+    struct stat st = { 0 };
+    return fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Append the processes in `path` and the cgroups below it to `*pids`.
+// `path` is a buffer of PATH_MAX bytes that is used for the walk.
+// Returns 0 or -errno.
+static int collect_procs(char* path, int depth, int** pids, int* n)
+{
+    int* cur = NULL;
+    int k = cgroup_read_procs(path, &cur);
+    if (k < 0) {
+        return k;
+    }
+    if (k > 0) {
+        int* fresh = realloc(*pids, (size_t)(*n + k) * sizeof(*fresh));
+        if (fresh == NULL) {
+            free(cur);
+            return -ENOMEM;
+        }
+        memcpy(&fresh[*n], cur, (size_t)k * sizeof(*cur));
+        *pids = fresh;
+        *n += k;
+    }
+    free(cur);
+    if (depth >= CGROUP_DEPTH_MAX) {
+        return 0;
+    }
+    DIR* d = opendir(path);
+    if (d == NULL) {
+        return -errno;
+    }
+    const size_t len = strlen(path);
+    int res = 0;
+    struct dirent* e = NULL;
+    while (res == 0 && (e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0 || !is_dir(d, e)) {
+            continue;
+        }
+        if ((size_t)snprintf(path + len, PATH_MAX - len, "/%s", e->d_name) >= PATH_MAX - len) {
+            path[len] = 0;
+            continue;
+        }
+        res = collect_procs(path, depth + 1, pids, n);
+        // The cgroup may have been removed in the meantime
+        if (res == -ENOENT) {
+            res = 0;
+        }
+        path[len] = 0;
+    }
+    closedir(d);
+    return res;
+}
+
+// List the processes in the cgroup `dir` and all cgroups below it into a
+// malloc'ed array. Returns the number of processes or -errno.
+int cgroup_read_procs_below(const char* dir, int** out)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", dir);
+    int* pids = NULL;
+    int n = 0;
+    int res = collect_procs(path, 0, &pids, &n);
+    if (res < 0) {
+        free(pids);
+        return res;
+    }
+    *out = pids;
+    return n;
+}
+
+// Read the "populated" line of dir/cgroup.events.
+// Returns 1 if there are processes in the cgroup or below, 0 if not, or -errno.
+int cgroup_populated(const char* dir)
+{
+    char buf[256];
+    ssize_t n = read_file(dir, "cgroup.events", buf, sizeof(buf));
+    if (n < 0) {
+        return (int)n;
+    }
+    const char* p = strstr(buf, "populated ");
+    if (p == NULL) {
+        return -ENODATA;
+    }
+    return p[strlen("populated ")] != '0';
+}
+
+// Open dir/cgroup.events, which wakes up poll() with POLLPRI when it changes.
+// Returns the fd or -errno.
+int cgroup_events_open(const char* dir)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, "cgroup.events");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    return fd;
+}
+
+// Find where the cgroup v2 hierarchy is mounted, like "/sys/fs/cgroup".
+// Returns 0 or -errno. -ENOENT means that it is not mounted.
+int cgroup_find_mount(char* out, size_t outlen)
+{
+    FILE* f = fopen("/proc/self/mounts", "re");
+    if (f == NULL) {
+        return -errno;
+    }
+    char line[PATH_MAX];
+    int res = -ENOENT;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        // cgroup2 /sys/fs/cgroup cgroup2 rw,nosuid,nodev,noexec,relatime 0 0
+        char dir[PATH_MAX], type[32];
+        if (sscanf(line, "%*s %4095s %31s", dir, type) == 2 && strcmp(type, "cgroup2") == 0) {
+            snprintf(out, outlen, "%s", dir);
+            res = 0;
+            break;
+        }
+    }
+    fclose(f);
+    return res;
+}
+
+// The hint cache. Entries are never moved or removed until
+// cgroup_hints_init(), so their index + 1 is a stable id.
+typedef struct {
+    // Path below the mount, like "/system.slice/foo.service". Key.
+    char* path;
+    cgroup_hints_t hints;
+    // CLOCK_MONOTONIC time in ms when `hints` were read. 0 = never.
+    long long loaded_ms;
+} hint_entry_t;
+
+static pthread_mutex_t hints_lock = PTHREAD_MUTEX_INITIALIZER;
+static char hints_mount[PATH_MAX];
+static hint_entry_t* hint_entries;
+static int n_hint_entries;
+static int cap_hint_entries;
+// Open-addressing hash table of ids, 0 = empty slot. Size is a power of two.
+static int* hint_slots;
+static unsigned n_hint_slots;
+
+static long long now_ms(void)
+{
+    struct timespec now = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// FNV-1a
+static uint32_t hash_path(const char* path)
+{
+    uint32_t h = 2166136261u;
+    for (const char* p = path; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    }
+    return h;
+}
+
+static void insert_slot(int id)
+{
+    unsigned i = hash_path(hint_entries[id - 1].path) & (n_hint_slots - 1);
+    while (hint_slots[i] != 0) {
+        i = (i + 1) & (n_hint_slots - 1);
+    }
+    hint_slots[i] = id;
+}
+
+static void hints_flush_locked(void)
+{
+    for (int i = 0; i < n_hint_entries; i++) {
+        free(hint_entries[i].path);
+    }
+    free(hint_entries);
+    free(hint_slots);
+    hint_entries = NULL;
+    hint_slots = NULL;
+    n_hint_entries = cap_hint_entries = 0;
+    n_hint_slots = 0;
+}
+
+/* Use the cgroup v2 hierarchy mounted at `mount` for the hints
+ * (--cgroup-hints), and forget everything we know about it. The paths
+ * passed to cgroup_hints_id() are below `mount`. */
+void cgroup_hints_init(const char* mount)
+{
+    pthread_mutex_lock(&hints_lock);
+    hints_flush_locked();
+    snprintf(hints_mount, sizeof(hints_mount), "%s", mount);
+    // "/sys/fs/cgroup/" -> "/sys/fs/cgroup"
+    size_t len = strlen(hints_mount);
+    while (len > 1 && hints_mount[len - 1] == '/') {
+        hints_mount[--len] = 0;
+    }
+    pthread_mutex_unlock(&hints_lock);
+}
+
+/* Get the id of the cgroup `path` (below the mount, like in
+ * /proc/[pid]/cgroup) for cgroup_hints_get(), adding it if it is new.
+ * Returns the id (> 0) or -errno. */
+int cgroup_hints_id(const char* path)
+{
+    pthread_mutex_lock(&hints_lock);
+    int res = -ENOSPC;
+    if (n_hint_slots > 0) {
+        unsigned i = hash_path(path) & (n_hint_slots - 1);
+        while (hint_slots[i] != 0) {
+            if (strcmp(hint_entries[hint_slots[i] - 1].path, path) == 0) {
+                res = hint_slots[i];
+                goto out;
+            }
+            i = (i + 1) & (n_hint_slots - 1);
+        }
+    }
+    if (n_hint_entries >= CGROUP_HINTS_MAX) {
+        goto out;
+    }
+    if (n_hint_entries == cap_hint_entries) {
+        int cap = cap_hint_entries ? 2 * cap_hint_entries : 64;
+        hint_entry_t* fresh = realloc(hint_entries, (size_t)cap * sizeof(*fresh));
+        if (fresh == NULL) {
+            res = -ENOMEM;
+            goto out;
+        }
+        hint_entries = fresh;
+        cap_hint_entries = cap;
+    }
+    // Keep the load factor below 1/2
+    if ((unsigned)(n_hint_entries + 1) * 2 > n_hint_slots) {
+        unsigned want = n_hint_slots ? 2 * n_hint_slots : 128;
+        int* fresh = calloc(want, sizeof(*fresh));
+        if (fresh == NULL) {
+            res = -ENOMEM;
+            goto out;
+        }
+        free(hint_slots);
+        hint_slots = fresh;
+        n_hint_slots = want;
+        for (int id = 1; id <= n_hint_entries; id++) {
+            insert_slot(id);
+        }
+    }
+    char* copy = strdup(path);
+    if (copy == NULL) {
+        res = -ENOMEM;
+        goto out;
+    }
+    hint_entries[n_hint_entries] = (hint_entry_t) { .path = copy };
+    res = ++n_hint_entries;
+    insert_slot(res);
+out:
+    pthread_mutex_unlock(&hints_lock);
+    return res;
+}
+
+// Is the xattr `name` of `dir` set to something other than "0"?
+static bool xattr_set(const char* dir, const char* name)
+{
+    char value[8] = { 0 };
+    ssize_t n = getxattr(dir, name, value, sizeof(value) - 1);
+    return n > 0 && value[0] != '0';
+}
+
+// Read the hints of `path` from cgroupfs. The xattrs of the parent cgroups
+// are inherited, like systemd does for the units in a slice.
+static cgroup_hints_t load_hints(const char* mount, const char* path)
+{
+    char dir[PATH_MAX];
+    cgroup_hints_t h = { 0 };
+    int len = snprintf(dir, sizeof(dir), "%s%s", mount, path);
+    if (len < 0 || (size_t)len >= sizeof(dir)) {
+        // Too long to look at, no hints
+        return h;
+    }
+    if (xattr_set(dir, "user.oomd_omit")) {
+        h.flags |= CGROUP_HINT_OMIT;
+    }
+    if (xattr_set(dir, "user.oomd_avoid")) {
+        h.flags |= CGROUP_HINT_AVOID;
+    }
+    // Not set is the same as 0. The root cgroup has neither.
+    cgroup_read_kib(dir, "memory.min", &h.min_kib);
+    cgroup_read_kib(dir, "memory.low", &h.low_kib);
+    long long mem_kib = 0;
+    if (cgroup_read_kib(dir, "memory.current", &mem_kib) == 0) {
+        if (h.min_kib > 0 && mem_kib <= h.min_kib) {
+            h.flags |= CGROUP_HINT_MIN;
+        }
+        if (h.low_kib > 0 && mem_kib <= h.low_kib) {
+            h.flags |= CGROUP_HINT_LOW;
+        }
+    }
+    const char* slash = strrchr(path, '/');
+    if (slash != NULL) {
+        char parent[PATH_MAX];
+        snprintf(parent, sizeof(parent), "%.*s", (int)(slash - path), path);
+        cgroup_hints_t p = { 0 };
+        int id = cgroup_hints_id(parent);
+        if (id > 0 && cgroup_hints_get(id, &p)) {
+            h.flags |= p.flags & (CGROUP_HINT_OMIT | CGROUP_HINT_AVOID);
+        }
+    }
+    return h;
+}
+
+/* Get the hints for the cgroup `id` (see cgroup_hints_id()). They are read
+ * again when they are older than CGROUP_HINTS_MAX_AGE_MS.
+ * Returns false if there is no such id. */
+bool cgroup_hints_get(int id, cgroup_hints_t* out)
+{
+    const long long now = now_ms();
+    char path[PATH_MAX];
+    char mount[PATH_MAX];
+    pthread_mutex_lock(&hints_lock);
+    if (id <= 0 || id > n_hint_entries) {
+        pthread_mutex_unlock(&hints_lock);
+        return false;
+    }
+    hint_entry_t* e = &hint_entries[id - 1];
+    if (e->loaded_ms > 0 && now - e->loaded_ms <= CGROUP_HINTS_MAX_AGE_MS) {
+        *out = e->hints;
+        pthread_mutex_unlock(&hints_lock);
+        return true;
+    }
+    snprintf(path, sizeof(path), "%s", e->path);
+    snprintf(mount, sizeof(mount), "%s", hints_mount);
+    pthread_mutex_unlock(&hints_lock);
+
+    // No lock while we do I/O. When two threads load the same cgroup,
+    // both get the same result.
+    cgroup_hints_t h = load_hints(mount, path);
+    pthread_mutex_lock(&hints_lock);
+    // The cache may have been flushed in the meantime
+    if (id <= n_hint_entries) {
+        hint_entries[id - 1].hints = h;
+        hint_entries[id - 1].loaded_ms = now;
+    }
+    pthread_mutex_unlock(&hints_lock);
+    *out = h;
+    return true;
+}
+
+// Path of the cgroup directory `dir` below the mount given to
+// cgroup_hints_init(), or NULL if it is not in there
+static const char* hints_path(const char* dir)
+{
+    size_t len = strlen(hints_mount);
+    if (len == 0 || strncmp(dir, hints_mount, len) != 0 || (dir[len] != 0 && dir[len] != '/')) {
+        return NULL;
+    }
+    return dir + len;
+}
+
+typedef struct {
+    // The directory we are looking at
+    char path[PATH_MAX];
+    int root_len;
+    int self;
+    // Use the hints (--cgroup-hints)
+    bool hints;
+    cgroup_info_t* best;
+    // `best` is only there because there is nothing better than
+    // cgroups that want to be avoided
+    bool best_avoided;
+    bool found;
+    int leaves;
+} cgroup_walk_t;
+
+// Can we kill all of `pids`?
+static bool eligible(const cgroup_walk_t* w, const int* pids, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (pids[i] == w->self) {
+            debug("%s: %s: contains earlyoom\n", __func__, w->path);
+            return false;
+        }
+        int adj = 0;
+        if (get_oom_score_adj(pids[i], &adj) == 0 && adj == OOM_SCORE_ADJ_MIN) {
+            debug("%s: %s: pid %d has oom_score_adj %d\n", __func__, w->path, pids[i], adj);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void consider_leaf(cgroup_walk_t* w)
+{
+    long long mem_kib = 0, swap_kib = 0;
+    // Without the memory controller, there is nothing to compare
+    if (cgroup_read_kib(w->path, "memory.current", &mem_kib) < 0) {
+        return;
+    }
+    // No swap accounting is the same as no swap
+    if (cgroup_read_kib(w->path, "memory.swap.current", &swap_kib) < 0) {
+        swap_kib = 0;
+    }
+    w->leaves++;
+    bool avoided = false;
+    if (w->hints) {
+        cgroup_hints_t h = { 0 };
+        const char* rel = hints_path(w->path);
+        int id = rel ? cgroup_hints_id(rel) : 0;
+        if (id > 0 && cgroup_hints_get(id, &h)) {
+            if (h.flags & (CGROUP_HINT_OMIT | CGROUP_HINT_MIN)) {
+                debug("%s: %s: protected (hints 0x%x)\n", __func__, w->path, h.flags);
+                return;
+            }
+            avoided = h.flags & (CGROUP_HINT_AVOID | CGROUP_HINT_LOW);
+        }
+    }
+    // Cgroups that want to be avoided only win against each other
+    if (w->found && avoided && !w->best_avoided) {
+        return;
+    }
+    bool better_tier = w->found && !avoided && w->best_avoided;
+    if (w->found && !better_tier && mem_kib + swap_kib <= w->best->mem_kib + w->best->swap_kib) {
+        return;
+    }
+    // Only look at the processes of cgroups that would win
+    int* pids = NULL;
+    int n = cgroup_read_procs(w->path, &pids);
+    if (n > 0 && eligible(w, pids, n)) {
+        cgroup_info_t* best = w->best;
+        snprintf(best->dir, sizeof(best->dir), "%s", w->path);
+        best->root_len = w->root_len;
+        best->mem_kib = mem_kib;
+        best->swap_kib = swap_kib;
+        best->nprocs = n;
+        best->pid = pids[0];
+        w->best_avoided = avoided;
+        w->found = true;
+    }
+    free(pids);
+}
+
+static void walk(cgroup_walk_t* w, int depth)
+{
+    DIR* d = opendir(w->path);
+    if (d == NULL) {
+        debug("%s: %s: %s\n", __func__, w->path, strerror(errno));
+        return;
+    }
+    const size_t len = strlen(w->path);
+    int children = 0;
+    struct dirent* e = NULL;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0 || !is_dir(d, e)) {
+            continue;
+        }
+        children++;
+        if (depth >= CGROUP_DEPTH_MAX) {
+            continue;
+        }
+        size_t room = sizeof(w->path) - len;
+        if ((size_t)snprintf(w->path + len, room, "/%s", e->d_name) >= room) {
+            w->path[len] = 0;
+            continue;
+        }
+        walk(w, depth + 1);
+        w->path[len] = 0;
+    }
+    closedir(d);
+    // Processes only live in the leaves (and in the root)
+    if (children == 0) {
+        consider_leaf(w);
+    }
+}
+
+/* Find the leaf cgroup below `root` with the largest memory.current plus
+ * memory.swap.current. Cgroups that contain earlyoom or a process with
+ * oom_score_adj -1000 are skipped, and so are empty ones.
+ * With `hints`, cgroups with user.oomd_omit or within memory.min are skipped
+ * too, and cgroups with user.oomd_avoid or within memory.low are only
+ * selected if there is nothing else. cgroup_hints_init() must have been
+ * called with `root` or a directory above it.
+ * Returns 0 or -errno. -ESRCH means that there is no such cgroup.
+ */
+int cgroup_find_largest(const char* root, bool hints, cgroup_info_t* out)
+{
+    cgroup_walk_t w = { .self = getpid(), .hints = hints, .best = out };
+    snprintf(w.path, sizeof(w.path), "%s", root);
+    // "/sys/fs/cgroup/" -> "/sys/fs/cgroup"
+    size_t len = strlen(w.path);
+    while (len > 1 && w.path[len - 1] == '/') {
+        w.path[--len] = 0;
+    }
+    w.root_len = (int)len;
+    walk(&w, 0);
+    debug("%s: looked at %d leaf cgroups\n", __func__, w.leaves);
+    if (!w.found) {
+        return -ESRCH;
+    }
+    return 0;
+}
+
+/* Send `sig` to all processes in the cgroup `dir`. SIGKILL goes through
+ * cgroup.kill, and `*atomic` is set, when the kernel has it (Linux v5.14+).
+ * Otherwise, the processes in cgroup.procs get the signal one by one.
+ * Returns 0 if the signal was sent, or -errno.
+ */
+int cgroup_signal(const char* dir, int sig, bool* atomic)
+{
+    *atomic = false;
+    if (sig == SIGKILL) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/cgroup.kill", dir);
+        int fd = open(path, O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            ssize_t res = write(fd, "1", 1);
+            int write_errno = errno;
+            close(fd);
+            if (res < 0) {
+                return -write_errno;
+            }
+            *atomic = true;
+            return 0;
+        }
+        if (errno != ENOENT) {
+            return -errno;
+        }
+    }
+    int* pids = NULL;
+    int n = cgroup_read_procs(dir, &pids);
+    if (n < 0) {
+        return n;
+    }
+    int sent = 0, err = ESRCH;
+    for (int i = 0; i < n; i++) {
+        if (kill(pids[i], sig) == 0) {
+            sent++;
+        } else if (errno != ESRCH) {
+            err = errno;
+        }
+    }
+    free(pids);
+    if (sent == 0) {
+        return -err;
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Do not descend deeper than this below the --cgroup-kill root
+#define CGROUP_DEPTH_MAX 32
+// Read the hints of a cgroup again after this long (--cgroup-hints)
+#define CGROUP_HINTS_MAX_AGE_MS 2000
+// Remember the hints of at most this many cgroups
+#define CGROUP_HINTS_MAX 65536
+
+// Flag bits for cgroup_hints_t.flags
+enum {
+    // user.oomd_omit xattr, here or on a parent: never kill
+    CGROUP_HINT_OMIT = 1 << 0,
+    // user.oomd_avoid xattr, here or on a parent: kill only if there is
+    // nothing else
+    CGROUP_HINT_AVOID = 1 << 1,
+    // memory.current is within memory.min
+    CGROUP_HINT_MIN = 1 << 2,
+    // memory.current is within memory.low
+    CGROUP_HINT_LOW = 1 << 3,
+};
+
+// What a cgroup says about itself (--cgroup-hints)
+typedef struct {
+    unsigned flags;
+    // memory.min and memory.low in KiB, 0 if not set
+    long long min_kib;
+    long long low_kib;
+} cgroup_hints_t;
+
+// A leaf cgroup that can be killed as a whole (--cgroup-kill)
+typedef struct {
+    // Directory in cgroupfs, like "/sys/fs/cgroup/system.slice/foo.service"
+    char dir[PATH_MAX];
+    // Length of the root prefix in `dir`, see cgroup_name()
+    int root_len;
+    // memory.current and memory.swap.current, in KiB
+    long long mem_kib;
+    long long swap_kib;
+    // Number of processes in cgroup.procs
+    int nprocs;
+    // The first process in cgroup.procs. Stands in for the cgroup in the
+    // hooks and notifications.
+    int pid;
+} cgroup_info_t;
+
+int cgroup_check_root(const char* root);
+const char* cgroup_name(const cgroup_info_t* cg);
+int cgroup_read_kib(const char* dir, const char* name, long long* out);
+int cgroup_parse_kib(const char* buf, long long* out);
+int cgroup_read_procs(const char* dir, int** out);
+int cgroup_read_procs_below(const char* dir, int** out);
+int cgroup_populated(const char* dir);
+int cgroup_events_open(const char* dir);
+int cgroup_find_largest(const char* root, bool hints, cgroup_info_t* out);
+int cgroup_signal(const char* dir, int sig, bool* atomic);
+int cgroup_find_mount(char* out, size_t outlen);
+void cgroup_hints_init(const char* mount);
+int cgroup_hints_id(const char* path);
+bool cgroup_hints_get(int id, cgroup_hints_t* out);
+
+#endif
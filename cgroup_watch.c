@@ -0,0 +1,457 @@
+// SPDX-License-Identifier: MIT
+
+/* Per-cgroup memory limits (--cgroup-limit).
+ *
+ * Every watched cgroup has its own SIGTERM and SIGKILL percentages. They
+ * are compared with how much of its memory.max or memory.high (the lower
+ * of the two) is still available: the limit minus memory.current, plus
+ * what memory.stat says can be reclaimed.
+ *
+ * This has to scale to hundreds of containers, so the files of every
+ * cgroup are opened once and read again with pread(), and the cgroups are
+ * not all read on every tick. Each one has its own deadline, planned from
+ * its headroom and fill rate like the adaptive sleep of the main loop.
+ * In between, one inotify instance watches the memory.events files, which
+ * the kernel touches when a cgroup runs into memory.high or memory.max,
+ * and that cgroup is looked at right away. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "cgroup_watch.h"
+#include "fill_rate.h"
+#include "msg.h"
+
+typedef struct {
+    char dir[PATH_MAX];
+    double term_percent;
+    double kill_percent;
+    // memory.current, memory.max, memory.high and memory.stat. -1 if the
+    // file does not exist (the root cgroup has no limits).
+    int current_fd;
+    int max_fd;
+    int high_fd;
+    int stat_fd;
+    // inotify watch of memory.events, or -1
+    int wd;
+    // The files could not be read. We try to open them again at every
+    // check, as the cgroup may be created again (container restart).
+    bool gone;
+    fill_rate_t fill_rate;
+    // CLOCK_MONOTONIC time in ms of the next check
+    long long next_ms;
+} watched_cgroup_t;
+
+static watched_cgroup_t* cgroups;
+static int n_cgroups;
+static int inotify_fd = -1;
+// memory.stat is about 2 KiB on Linux v6.x
+static char stat_buf[8192];
+
+static long long monotonic_ms(void)
+{
+    struct timespec now = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Raise the soft limit of open files to the hard limit.
+// Returns true if it was raised.
+static bool raise_nofile(void)
+{
+    struct rlimit rl = { 0 };
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur >= rl.rlim_max) {
+        return false;
+    }
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+        return false;
+    }
+    debug("%s: raised the limit of open files to %lu\n", __func__, (unsigned long)rl.rlim_cur);
+    return true;
+}
+
+// Open dir/name. Returns the fd or -errno.
+static int open_file(const char* dir, const char* name)
+{
+    char path[PATH_MAX];
+    int len = snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (len < 0 || (size_t)len >= sizeof(path)) {
+        return -ENAMETOOLONG;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    // Every watched cgroup keeps four files open
+    if (fd < 0 && errno == EMFILE && raise_nofile()) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        return -errno;
+    }
+    return fd;
+}
+
+static const char* const watched_files[] = { "memory.current", "memory.max", "memory.high", "memory.stat" };
+
+static void close_cgroup(watched_cgroup_t* c)
+{
+    int* fds[] = { &c->current_fd, &c->max_fd, &c->high_fd, &c->stat_fd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+        }
+        *fds[i] = -1;
+    }
+    if (c->wd >= 0) {
+        inotify_rm_watch(inotify_fd, c->wd);
+        c->wd = -1;
+    }
+}
+
+// Open the files of `c`. Returns 0 or -errno.
+static int open_cgroup(watched_cgroup_t* c)
+{
+    char events[PATH_MAX];
+    if ((size_t)snprintf(events, sizeof(events), "%s/memory.events", c->dir) >= sizeof(events)) {
+        return -ENAMETOOLONG;
+    }
+    int* fds[] = { &c->current_fd, &c->max_fd, &c->high_fd, &c->stat_fd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        int fd = open_file(c->dir, watched_files[i]);
+        // Only memory.current is a must. Without it, there is no memory
+        // controller. The root cgroup has no limits.
+        if (fd == -ENOENT && i > 0) {
+            continue;
+        }
+        if (fd < 0) {
+            close_cgroup(c);
+            return fd;
+        }
+        *fds[i] = fd;
+    }
+    c->wd = inotify_add_watch(inotify_fd, events, IN_MODIFY);
+    if (c->wd < 0) {
+        debug("%s: %s: %s. Relying on the fill rate only\n", __func__, events, strerror(errno));
+    }
+    return 0;
+}
+
+/* Watch the cgroup `dir`: kill in it when less than `term_percent` of its
+ * memory.max or memory.high is available (SIGTERM), or less than
+ * `kill_percent` (SIGKILL).
+ * Returns the index of the cgroup or -errno.
+ */
+int cgroup_watch_add(const char* dir, double term_percent, double kill_percent)
+{
+    if (inotify_fd < 0) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0) {
+            return -errno;
+        }
+    }
+    watched_cgroup_t* fresh = realloc(cgroups, (size_t)(n_cgroups + 1) * sizeof(*fresh));
+    if (fresh == NULL) {
+        return -ENOMEM;
+    }
+    cgroups = fresh;
+    watched_cgroup_t* c = &cgroups[n_cgroups];
+    *c = (watched_cgroup_t) {
+        .term_percent = term_percent,
+        .kill_percent = kill_percent,
+        .current_fd = -1,
+        .max_fd = -1,
+        .high_fd = -1,
+        .stat_fd = -1,
+        .wd = -1,
+    };
+    snprintf(c->dir, sizeof(c->dir), "%s", dir);
+    // "/sys/fs/cgroup/foo/" -> "/sys/fs/cgroup/foo"
+    size_t len = strlen(c->dir);
+    while (len > 1 && c->dir[len - 1] == '/') {
+        c->dir[--len] = 0;
+    }
+    int res = open_cgroup(c);
+    if (res < 0) {
+        return res;
+    }
+    return n_cgroups++;
+}
+
+bool cgroup_watch_active(void)
+{
+    return n_cgroups > 0;
+}
+
+// The inotify fd that becomes readable when a watched cgroup runs into its
+// limits, or -1
+int cgroup_watch_fd(void)
+{
+    return inotify_fd;
+}
+
+// Milliseconds until the next cgroup has to be checked, 0 if one is due,
+// or -1 if there are no watched cgroups
+int cgroup_watch_timeout_ms(long long now_ms)
+{
+    if (n_cgroups == 0) {
+        return -1;
+    }
+    long long next_ms = cgroups[0].next_ms;
+    for (int i = 1; i < n_cgroups; i++) {
+        if (cgroups[i].next_ms < next_ms) {
+            next_ms = cgroups[i].next_ms;
+        }
+    }
+    if (next_ms <= now_ms) {
+        return 0;
+    }
+    if (next_ms - now_ms > CGROUP_WATCH_MAX_SLEEP_MS) {
+        return CGROUP_WATCH_MAX_SLEEP_MS;
+    }
+    return (int)(next_ms - now_ms);
+}
+
+/* Read the pending inotify events and make the cgroups they are about due
+ * at `now_ms`. Returns the number of cgroups that were made due.
+ */
+int cgroup_watch_drain(long long now_ms)
+{
+    if (inotify_fd < 0) {
+        return 0;
+    }
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int woken = 0;
+    while (1) {
+        ssize_t len = read(inotify_fd, buf, sizeof(buf));
+        if (len <= 0) {
+            // EAGAIN: all read
+            break;
+        }
+        for (char* p = buf; p < buf + len;) {
+            const struct inotify_event* ev = (const struct inotify_event*)(void*)p;
+            p += sizeof(*ev) + ev->len;
+            for (int i = 0; i < n_cgroups; i++) {
+                watched_cgroup_t* c = &cgroups[i];
+                if (c->wd != ev->wd) {
+                    continue;
+                }
+                // IN_IGNORED: the cgroup has been removed
+                if (ev->mask & IN_IGNORED) {
+                    c->wd = -1;
+                }
+                if (c->next_ms > now_ms) {
+                    debug("%s: %s: memory.events changed\n", __func__, c->dir);
+                    c->next_ms = now_ms;
+                    woken++;
+                }
+                break;
+            }
+        }
+    }
+    return woken;
+}
+
+// Read the value in bytes from `fd`, in KiB. "max" and fd -1 are LLONG_MAX.
+// Returns 0 or -errno.
+static int pread_kib(int fd, long long* out)
+{
+    if (fd < 0) {
+        *out = LLONG_MAX;
+        return 0;
+    }
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n < 0) {
+        return -errno;
+    }
+    buf[n] = 0;
+    return cgroup_parse_kib(buf, out);
+}
+
+// Value of the field `name` in the memory.stat contents `buf`, in KiB, or 0
+static long long stat_kib(const char* buf, const char* name)
+{
+    size_t len = strlen(name);
+    const char* line = buf;
+    while (*line) {
+        if (strncmp(line, name, len) == 0 && line[len] == ' ') {
+            return strtoll(line + len + 1, NULL, 10) / 1024;
+        }
+        const char* nl = strchr(line, '\n');
+        if (nl == NULL) {
+            break;
+        }
+        line = nl + 1;
+    }
+    return 0;
+}
+
+static int read_usage(const watched_cgroup_t* c, cgroup_usage_t* u)
+{
+    long long max_kib = 0, high_kib = 0;
+    int res = pread_kib(c->current_fd, &u->current_kib);
+    if (res == 0) {
+        res = pread_kib(c->max_fd, &max_kib);
+    }
+    if (res == 0) {
+        res = pread_kib(c->high_fd, &high_kib);
+    }
+    if (res < 0) {
+        return res;
+    }
+    u->limit_kib = max_kib < high_kib ? max_kib : high_kib;
+    u->reclaimable_kib = 0;
+    if (c->stat_fd >= 0) {
+        ssize_t n = pread(c->stat_fd, stat_buf, sizeof(stat_buf) - 1, 0);
+        if (n < 0) {
+            return -errno;
+        }
+        stat_buf[n] = 0;
+        u->reclaimable_kib = stat_kib(stat_buf, "inactive_file") + stat_kib(stat_buf, "slab_reclaimable");
+    }
+    if (u->limit_kib == LLONG_MAX) {
+        u->avail_kib = LLONG_MAX;
+        u->avail_percent = 100;
+        return 0;
+    }
+    u->avail_kib = u->limit_kib - u->current_kib + u->reclaimable_kib;
+    if (u->avail_kib < 0) {
+        u->avail_kib = 0;
+    } else if (u->avail_kib > u->limit_kib) {
+        u->avail_kib = u->limit_kib;
+    }
+    u->avail_percent = u->limit_kib > 0 ? (double)u->avail_kib * 100 / (double)u->limit_kib : 0;
+    return 0;
+}
+
+// How long until `c` has to be checked again: the headroom to the SIGTERM
+// limit divided by how fast the cgroup fills up.
+static long long sleep_time_ms(const watched_cgroup_t* c, const cgroup_usage_t* u)
+{
+    if (u->limit_kib == LLONG_MAX) {
+        // No limit (yet). There is nothing to run out of.
+        return CGROUP_WATCH_MAX_SLEEP_MS;
+    }
+    long long headroom_kib = u->avail_kib - (long long)(c->term_percent * (double)u->limit_kib / 100);
+    if (headroom_kib < 0) {
+        headroom_kib = 0;
+    }
+    double rate = CGROUP_WATCH_FILL_RATE_MAX;
+    fill_rate_estimate_t est;
+    if (fill_rate_estimate(&c->fill_rate, 100, &est)) {
+        rate = est.mem_rate;
+    }
+    long long ms = (long long)((double)headroom_kib / rate);
+    if (ms < CGROUP_WATCH_MIN_SLEEP_MS) {
+        return CGROUP_WATCH_MIN_SLEEP_MS;
+    }
+    if (ms > CGROUP_WATCH_MAX_SLEEP_MS) {
+        return CGROUP_WATCH_MAX_SLEEP_MS;
+    }
+    return ms;
+}
+
+/* Read the memory situation of cgroup `idx` into `out` and plan its next
+ * check. If the cgroup is gone, it is looked for again at every check.
+ * Returns 0 or -errno.
+ */
+int cgroup_watch_sample(int idx, cgroup_usage_t* out)
+{
+    watched_cgroup_t* c = &cgroups[idx];
+    long long now = monotonic_ms();
+    c->next_ms = now + CGROUP_WATCH_MAX_SLEEP_MS;
+    if (c->gone) {
+        if (open_cgroup(c) < 0) {
+            return -ENOENT;
+        }
+        warn("cgroup %s is back, watching it again\n", c->dir);
+        c->gone = false;
+        c->fill_rate = (fill_rate_t) { 0 };
+    }
+    int res = read_usage(c, out);
+    if (res < 0) {
+        // ENODEV: the cgroup has been removed
+        warn("cgroup %s: %s. Looking for it again every %d s\n", c->dir, strerror(-res), CGROUP_WATCH_MAX_SLEEP_MS / 1000);
+        close_cgroup(c);
+        c->gone = true;
+        return res;
+    }
+    if (out->limit_kib != LLONG_MAX) {
+        fill_rate_sample(&c->fill_rate, now, out->avail_kib, 0);
+    }
+    c->next_ms = now + sleep_time_ms(c, out);
+    return 0;
+}
+
+// Which signal (SIGKILL, SIGTERM, 0) the usage `u` of cgroup `idx` calls for
+int cgroup_watch_sig(int idx, const cgroup_usage_t* u)
+{
+    const watched_cgroup_t* c = &cgroups[idx];
+    if (u->limit_kib == LLONG_MAX) {
+        return 0;
+    }
+    if (u->avail_percent <= c->kill_percent) {
+        return SIGKILL;
+    }
+    if (u->avail_percent <= c->term_percent) {
+        return SIGTERM;
+    }
+    return 0;
+}
+
+/* Check the cgroups that are due at `now_ms` and return the next one that
+ * is at or below its limits in `out`. Every checked cgroup is due again
+ * after `now_ms`, so calling this until it returns false with the same
+ * `now_ms` looks at every cgroup at most once.
+ */
+bool cgroup_watch_next(long long now_ms, cgroup_watch_hit_t* out)
+{
+    for (int i = 0; i < n_cgroups; i++) {
+        watched_cgroup_t* c = &cgroups[i];
+        if (c->next_ms > now_ms) {
+            continue;
+        }
+        cgroup_usage_t u = { 0 };
+        if (cgroup_watch_sample(i, &u) < 0) {
+            continue;
+        }
+        int sig = cgroup_watch_sig(i, &u);
+        debug("%s: %s: avail %lld of %lld MiB (%.1f%%), next check in %lld ms\n", __func__, c->dir,
+            u.avail_kib / 1024, u.limit_kib == LLONG_MAX ? -1 : u.limit_kib / 1024, u.avail_percent,
+            c->next_ms - now_ms);
+        if (sig) {
+            *out = (cgroup_watch_hit_t) {
+                .dir = c->dir,
+                .sig = sig,
+                .term_percent = c->term_percent,
+                .kill_percent = c->kill_percent,
+                .usage = u,
+            };
+            return true;
+        }
+    }
+    return false;
+}
+
+// Only used by the testsuite
+void cgroup_watch_reset(void)
+{
+    for (int i = 0; i < n_cgroups; i++) {
+        close_cgroup(&cgroups[i]);
+    }
+    free(cgroups);
+    cgroups = NULL;
+    n_cgroups = 0;
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+}
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef CGROUP_WATCH_H
+#define CGROUP_WATCH_H
+
+#include <limits.h>
+#include <stdbool.h>
+
+// Check every watched cgroup at most this often ...
+#define CGROUP_WATCH_MIN_SLEEP_MS 100
+// ... and at least this often (milliseconds)
+#define CGROUP_WATCH_MAX_SLEEP_MS 10000
+// Fill rate we assume until we have measured one, in KiB/ms (=~ MiB/s)
+#define CGROUP_WATCH_FILL_RATE_MAX 6000
+
+// The memory situation of a watched cgroup (--cgroup-limit)
+typedef struct {
+    // The lower of memory.max and memory.high, in KiB. LLONG_MAX if
+    // neither is set.
+    long long limit_kib;
+    // memory.current in KiB
+    long long current_kib;
+    // inactive_file + slab_reclaimable from memory.stat, in KiB
+    long long reclaimable_kib;
+    // How much can still be used before the limit is reached, in KiB and
+    // in percent of the limit
+    long long avail_kib;
+    double avail_percent;
+} cgroup_usage_t;
+
+// A watched cgroup that is at or below its limits
+typedef struct {
+    const char* dir;
+    // SIGTERM or SIGKILL
+    int sig;
+    double term_percent;
+    double kill_percent;
+    cgroup_usage_t usage;
+} cgroup_watch_hit_t;
+
+int cgroup_watch_add(const char* dir, double term_percent, double kill_percent);
+bool cgroup_watch_active(void);
+int cgroup_watch_fd(void);
+int cgroup_watch_timeout_ms(long long now_ms);
+int cgroup_watch_drain(long long now_ms);
+int cgroup_watch_sample(int idx, cgroup_usage_t* out);
+int cgroup_watch_sig(int idx, const cgroup_usage_t* u);
+bool cgroup_watch_next(long long now_ms, cgroup_watch_hit_t* out);
+void cgroup_watch_reset(void);
+
+#endif
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: MIT
+
+/* Estimate how fast memory and swap are filling up.
+ *
+ * poll_loop() feeds us every MemAvailable / SwapFree sample it reads.
+ * From the difference between successive samples we keep a moving average
+ * of the fill rate, which follows sustained allocation, and the maximum of
+ * the last few intervals, which catches bursts that the average smooths
+ * away. sleep_time_ms() plans with the larger of the two.
+ *
+ * For --predict, we also fit a line to the last two seconds of
+ * MemAvailable + SwapFree and extrapolate when the headroom to the
+ * SIGTERM limits will be used up. */
+
+#include <string.h>
+
+#include "fill_rate.h"
+
+static double max_of(const double* v, int n)
+{
+    double ret = 0;
+    for (int i = 0; i < n; i++) {
+        if (v[i] > ret) {
+            ret = v[i];
+        }
+    }
+    return ret;
+}
+
+// Add a sample taken at `now_ms` (CLOCK_MONOTONIC, in milliseconds).
+void fill_rate_sample(fill_rate_t* fr, long long now_ms, long long mem_avail_kib, long long swap_free_kib)
+{
+    if (fr->n_samples > 0) {
+        long long dt = now_ms - fr->last_ms;
+        if (dt <= 0) {
+            // Nothing to learn from two samples taken at the same time
+            return;
+        }
+        // Positive = available memory is shrinking
+        double mem_rate = (double)(fr->last_mem_kib - mem_avail_kib) / (double)dt;
+        double swap_rate = (double)(fr->last_swap_kib - swap_free_kib) / (double)dt;
+        // The weight of the new sample grows with the time it covers, so
+        // irregular sleep times do not skew the average
+        double alpha = (double)dt / (double)(FILL_RATE_EWMA_MS + dt);
+        if (fr->n_samples == 1) {
+            alpha = 1;
+        }
+        fr->mem_ewma += alpha * (mem_rate - fr->mem_ewma);
+        fr->swap_ewma += alpha * (swap_rate - fr->swap_ewma);
+        fr->mem_hist[fr->hist_next] = mem_rate > 0 ? mem_rate : 0;
+        fr->swap_hist[fr->hist_next] = swap_rate > 0 ? swap_rate : 0;
+        fr->hist_next = (fr->hist_next + 1) % FILL_RATE_HISTORY;
+    }
+    fr->trend_ms[fr->trend_next] = now_ms;
+    fr->trend_kib[fr->trend_next] = mem_avail_kib + swap_free_kib;
+    fr->trend_next = (fr->trend_next + 1) % FILL_RATE_TREND_SAMPLES;
+    if (fr->trend_n < FILL_RATE_TREND_SAMPLES) {
+        fr->trend_n++;
+    }
+
+    fr->last_ms = now_ms;
+    fr->last_mem_kib = mem_avail_kib;
+    fr->last_swap_kib = swap_free_kib;
+    fr->n_samples++;
+}
+
+// Get the fill rates to plan with. `margin_percent` scales the measured
+// rates (200 = assume twice as fast as measured).
+// Returns false if we do not have enough samples yet.
+bool fill_rate_estimate(const fill_rate_t* fr, int margin_percent, fill_rate_estimate_t* out)
+{
+    memset(out, 0, sizeof(*out));
+    if (fr->n_samples < FILL_RATE_WARMUP) {
+        return false;
+    }
+    int n = fr->n_samples - 1;
+    if (n > FILL_RATE_HISTORY) {
+        n = FILL_RATE_HISTORY;
+    }
+    out->mem_ewma = fr->mem_ewma;
+    out->swap_ewma = fr->swap_ewma;
+    out->mem_max = max_of(fr->mem_hist, n);
+    out->swap_max = max_of(fr->swap_hist, n);
+
+    double margin = margin_percent / 100.0;
+    out->mem_rate = (out->mem_ewma > out->mem_max ? out->mem_ewma : out->mem_max) * margin;
+    out->swap_rate = (out->swap_ewma > out->swap_max ? out->swap_ewma : out->swap_max) * margin;
+    if (out->mem_rate < FILL_RATE_MIN) {
+        out->mem_rate = FILL_RATE_MIN;
+    }
+    if (out->swap_rate < FILL_RATE_MIN) {
+        out->swap_rate = FILL_RATE_MIN;
+    }
+    return true;
+}
+
+/* Forecast in how many milliseconds the remaining `headroom_kib` will be
+ * used up, using the least-squares slope of MemAvailable + SwapFree over the
+ * recent samples.
+ * Returns -1 if we do not have enough samples, or if memory is not shrinking.
+ */
+long long fill_rate_eta_ms(const fill_rate_t* fr, long long headroom_kib)
+{
+    if (fr->n_samples == 0) {
+        return -1;
+    }
+    // Relative to the newest sample, to keep the sums small
+    long long newest_kib = fr->last_mem_kib + fr->last_swap_kib;
+    double sum_t = 0, sum_v = 0, sum_tt = 0, sum_tv = 0;
+    int n = 0;
+    for (int i = 0; i < fr->trend_n; i++) {
+        double t = (double)(fr->trend_ms[i] - fr->last_ms);
+        if (t < -FILL_RATE_TREND_MS) {
+            continue;
+        }
+        double v = (double)(fr->trend_kib[i] - newest_kib);
+        sum_t += t;
+        sum_v += v;
+        sum_tt += t * t;
+        sum_tv += t * v;
+        n++;
+    }
+    if (n < FILL_RATE_TREND_MIN_SAMPLES) {
+        return -1;
+    }
+    double denom = n * sum_tt - sum_t * sum_t;
+    if (denom <= 0) {
+        return -1;
+    }
+    // KiB per millisecond. Negative = shrinking.
+    double slope = (n * sum_tv - sum_t * sum_v) / denom;
+    if (slope >= 0) {
+        return -1;
+    }
+    if (headroom_kib <= 0) {
+        return 0;
+    }
+    return (long long)((double)headroom_kib / -slope);
+}
+
+/* Should we act because the headroom will be used up in less than
+ * `limit_ms`? To not act on a short spike, the forecast must be below the
+ * limit FILL_RATE_PREDICT_HITS times in a row while memory keeps shrinking.
+ * Once firing, we only stop when the forecast is 1.5 times the limit or more
+ * (hysteresis).
+ * The forecast is returned in `*eta_ms`.
+ */
+bool fill_rate_predict(fill_rate_t* fr, long long headroom_kib, int limit_ms, long long* eta_ms)
+{
+    long long eta = fill_rate_eta_ms(fr, headroom_kib);
+    *eta_ms = eta;
+    // A burst that has stopped still tilts the fitted line for a while.
+    // Only count forecasts while memory is still shrinking.
+    bool shrinking = false;
+    if (fr->trend_n >= 2) {
+        int newest = (fr->trend_next + FILL_RATE_TREND_SAMPLES - 1) % FILL_RATE_TREND_SAMPLES;
+        int prev = (fr->trend_next + FILL_RATE_TREND_SAMPLES - 2) % FILL_RATE_TREND_SAMPLES;
+        shrinking = fr->trend_kib[newest] < fr->trend_kib[prev];
+    }
+    if (eta >= 0 && eta < limit_ms && shrinking) {
+        if (fr->predict_hits < FILL_RATE_PREDICT_HITS) {
+            fr->predict_hits++;
+        }
+        if (fr->predict_hits >= FILL_RATE_PREDICT_HITS) {
+            fr->predict_firing = true;
+        }
+    } else {
+        fr->predict_hits = 0;
+        if (eta < 0 || eta >= (long long)limit_ms * 3 / 2) {
+            fr->predict_firing = false;
+        }
+    }
+    return fr->predict_firing;
+}
+
+// Forget the samples the forecast is based on. Used after killing a
+// process, which changes the trend.
+void fill_rate_trend_reset(fill_rate_t* fr)
+{
+    fr->trend_n = 0;
+    fr->trend_next = 0;
+    fr->predict_hits = 0;
+    fr->predict_firing = false;
+}
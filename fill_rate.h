@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef FILL_RATE_H
+#define FILL_RATE_H
+
+#include <stdbool.h>
+
+// Number of intervals the recent maximum is taken over
+#define FILL_RATE_HISTORY 32
+// Time constant of the moving average, in milliseconds
+#define FILL_RATE_EWMA_MS 5000
+// Number of samples before the estimate is used
+#define FILL_RATE_WARMUP 4
+// The exhaustion forecast is fitted to at most this many samples ...
+#define FILL_RATE_TREND_SAMPLES 16
+// ... no older than this (milliseconds) ...
+#define FILL_RATE_TREND_MS 2000
+// ... and needs at least this many
+#define FILL_RATE_TREND_MIN_SAMPLES 3
+// Number of consecutive forecasts below the limit before fill_rate_predict() fires
+#define FILL_RATE_PREDICT_HITS 3
+
+// Longest sleep between memory checks with a measured fill rate
+// (--fill-rate-margin), in milliseconds. The fixed rates allow 1 second.
+#define FILL_RATE_MAX_SLEEP_MS 5000
+// Sleeping longer than 1 second needs a full FILL_RATE_HISTORY window of
+// samples, and is planned with at least 1/FILL_RATE_LONG_SLEEP_DIVISOR of
+// the fixed rates (1000 MiB/s for memory), because a burst can start at any
+// time.
+#define FILL_RATE_LONG_SLEEP_DIVISOR 6
+
+// Lowest fill rate we ever assume, in KiB per millisecond (=~ MiB/s).
+// Protects against a process that starts allocating on an idle box.
+#define FILL_RATE_MIN 100
+
+typedef struct {
+    int n_samples;
+    // The last sample. Time in milliseconds (CLOCK_MONOTONIC), values in KiB.
+    long long last_ms;
+    long long last_mem_kib;
+    long long last_swap_kib;
+    // Exponentially weighted moving average of the fill rates, in KiB/ms
+    double mem_ewma;
+    double swap_ewma;
+    // Fill rates of the last FILL_RATE_HISTORY intervals (ring buffer).
+    // Memory being freed counts as 0.
+    double mem_hist[FILL_RATE_HISTORY];
+    double swap_hist[FILL_RATE_HISTORY];
+    int hist_next;
+    // Recent samples of MemAvailable + SwapFree for the exhaustion forecast
+    // (ring buffer). Time in milliseconds, values in KiB.
+    long long trend_ms[FILL_RATE_TREND_SAMPLES];
+    long long trend_kib[FILL_RATE_TREND_SAMPLES];
+    int trend_n;
+    int trend_next;
+    // Consecutive forecasts below the limit, and if fill_rate_predict() is firing
+    int predict_hits;
+    bool predict_firing;
+} fill_rate_t;
+
+typedef struct {
+    // Fill rates to plan with, in KiB/ms: the larger of the moving average
+    // and the recent maximum, times the safety margin, and at least FILL_RATE_MIN
+    double mem_rate;
+    double swap_rate;
+    // The inputs, for debug output
+    double mem_ewma;
+    double mem_max;
+    double swap_ewma;
+    double swap_max;
+} fill_rate_estimate_t;
+
+void fill_rate_sample(fill_rate_t* fr, long long now_ms, long long mem_avail_kib, long long swap_free_kib);
+bool fill_rate_estimate(const fill_rate_t* fr, int margin_percent, fill_rate_estimate_t* out);
+long long fill_rate_eta_ms(const fill_rate_t* fr, long long headroom_kib);
+bool fill_rate_predict(fill_rate_t* fr, long long headroom_kib, int limit_ms, long long* eta_ms);
+void fill_rate_trend_reset(fill_rate_t* fr);
+
+#endif
@@ -2,25 +2,35 @@
 
 /* Kill the most memory-hungy process */
 
-#include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/syscall.h> /* Definition of SYS_* constants */
+#include <sys/timerfd.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "cgroup.h"
 #include "globals.h"
 #include "kill.h"
 #include "meminfo.h"
+#include "monitor.h"
 #include "msg.h"
+#include "oom_score.h"
+#include "proc_cache.h"
+#include "proc_events.h"
+#include "procfs.h"
+#include "proc_pid.h"
+#include "procfs_uring.h"
+#include "scan_pool.h"
 
 // Processes matching "--prefer REGEX" get OOM_SCORE_PREFER added to their oom_score
 #define OOM_SCORE_PREFER 300
@@ -41,25 +51,6 @@
 // when the pre-hook gets spawned, it doesn't have time to act)
 #define PREHOOK_STARTUP_SLEEP_MS 200
 
-static bool isnumeric(char* str)
-{
-    int i = 0;
-
-    // Empty string is not numeric
-    if (str[0] == 0)
-        return false;
-
-    while (1) {
-        if (str[i] == 0) // End of string
-            return true;
-
-        if (isdigit(str[i]) == 0)
-            return false;
-
-        i++;
-    }
-}
-
 #ifndef SYS_pidfd_open
 // It's 434 on all architectures except Alpha. Sorry, Alpha users.
 #warning SYS_pidfd_open is not defined. Assuming 434.
@@ -71,6 +62,17 @@ static int pidfd_open(pid_t pid, unsigned int flags)
     return (int)syscall(SYS_pidfd_open, pid, flags);
 }
 
+#ifndef SYS_pidfd_send_signal
+// It's 424 on all architectures except Alpha. Sorry, Alpha users.
+#warning SYS_pidfd_send_signal is not defined. Assuming 424.
+#define SYS_pidfd_send_signal 424
+#endif
+
+static int pidfd_send_signal(int pidfd, int sig, siginfo_t* info, unsigned int flags)
+{
+    return (int)syscall(SYS_pidfd_send_signal, pidfd, sig, info, flags);
+}
+
 #ifndef SYS_process_mrelease
 // It's 448 on all architectures except Alpha. Sorry, Alpha users.
 #warning SYS_process_mrelease is not defined. Assuming 448.
@@ -82,6 +84,13 @@ static int process_mrelease(int pidfd, unsigned int flags)
     return (int)syscall(SYS_process_mrelease, pidfd, flags);
 }
 
+static long long elapsed_us(const struct timespec* since)
+{
+    struct timespec now = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000LL + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
 static void notify_spawn_subprocess(const char* script, char* const argv[], const procinfo_t* victim, int timeout_ms)
 {
     // Prevent our SIGCHLD handler from reaping
@@ -150,6 +159,9 @@ static void notify_spawn_subprocess(const char* script, char* const argv[], cons
         setenv("EARLYOOM_UID", uid_str, 1);
         setenv("EARLYOOM_NAME", victim->name, 1);
         setenv("EARLYOOM_CMDLINE", victim->cmdline, 1);
+        if (strlen(victim->cgroup)) {
+            setenv("EARLYOOM_CGROUP", victim->cgroup, 1);
+        }
     }
 
     debug("%s: exec %s\n", __func__, script);
@@ -282,18 +294,27 @@ int trigger_kernel_oom(const poll_loop_args_t* args)
     return 0;
 }
 
-// kill_release kills a process and calls process_mrelease to
+// kill_release kills a process and, for SIGKILL, calls process_mrelease to
 // release the memory as quickly as possible.
+// If we have a pidfd, the signal is sent through it, so it cannot hit a
+// different process that has been given the same pid.
 //
 // See https://lwn.net/Articles/864184/ for details on process_mrelease.
 int kill_release(const pid_t pid, const int pidfd, const int sig)
 {
-    int res = kill(pid, sig);
+    int res;
+    if (pidfd >= 0) {
+        res = pidfd_send_signal(pidfd, sig, NULL, 0);
+    } else {
+        res = kill(pid, sig);
+    }
     if (res != 0) {
         return res;
     }
-    // Can't do process_mrelease without a pidfd.
-    if (pidfd < 0) {
+    // Can't do process_mrelease without a pidfd. The kernel only accepts
+    // it for processes that are already exiting, which, as far as we know,
+    // only SIGKILL guarantees (sig 0 is the startup self-test).
+    if (pidfd < 0 || sig != SIGKILL) {
         return 0;
     }
 
@@ -308,14 +329,381 @@ int kill_release(const pid_t pid, const int pidfd, const int sig)
     return 0;
 }
 
+// Victims we have stopped waiting for although they have not exited yet,
+// because the monitor thread asked for another kill (--monitor-thread),
+// and victims we are waiting for (--pipeline).
+// The scan skips them, they are about to go away.
+#define EXITING_MAX 8
+static struct {
+    int pid;
+    unsigned long long starttime;
+    // CLOCK_MONOTONIC time in ms after which we don't skip it anymore
+    long long until_ms;
+} exiting[EXITING_MAX];
+static int exiting_next;
+
+static void add_exiting(const procinfo_t* victim)
+{
+    for (int i = 0; i < EXITING_MAX; i++) {
+        if (exiting[i].pid == victim->pid && exiting[i].starttime == victim->stat.starttime) {
+            exiting[i].until_ms = monitor_now_ms() + KILL_WAIT_TIMEOUT_MS;
+            return;
+        }
+    }
+    exiting[exiting_next].pid = victim->pid;
+    exiting[exiting_next].starttime = victim->stat.starttime;
+    exiting[exiting_next].until_ms = monitor_now_ms() + KILL_WAIT_TIMEOUT_MS;
+    exiting_next = (exiting_next + 1) % EXITING_MAX;
+}
+
+// Only changes between scans, so the scan threads can call it.
+static bool is_exiting(const procinfo_t* cur)
+{
+    for (int i = 0; i < EXITING_MAX; i++) {
+        if (exiting[i].pid == cur->pid && exiting[i].starttime == cur->stat.starttime) {
+            return monitor_now_ms() < exiting[i].until_ms;
+        }
+    }
+    return false;
+}
+
+// Has the process behind `pidfd` exited? Does not block.
+static bool pidfd_exited(int pidfd)
+{
+    struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// Are we at or below the SIGKILL limits?
+static bool at_sigkill_limits(const poll_loop_args_t* args)
+{
+    if (monitor_active()) {
+        return monitor_sample().sig == SIGKILL;
+    }
+    meminfo_t m = parse_meminfo();
+    print_mem_stats(debug, m);
+    return m.MemAvailablePercent <= args->mem_kill_percent && m.SwapFreePercent <= args->swap_kill_percent;
+}
+
+// A set of victims we wait for together, like the members of a process
+// group (-g) or a batch (--batch-kill). Every member gets its own pidfd,
+// and all pidfds are registered in one epoll instance.
+typedef struct {
+    int pid;
+    // -1 if we could not open one. Then we look at /proc.
+    int pidfd;
+    // Error of the signal, or 0
+    int err;
+    bool exited;
+    // Time from the first signal to the exit, in microseconds
+    long long exit_us;
+} victim_member_t;
+
+typedef struct {
+    int epfd;
+    victim_member_t* members;
+    int n;
+    int cap;
+    // Members that have been signalled and have not exited yet
+    int waiting;
+    // Members without pidfd
+    int no_pidfd;
+    // When the first signal was sent
+    struct timespec t0;
+} victim_set_t;
+
+// Returns 0 or -errno
+static int victim_set_open(victim_set_t* set)
+{
+    *set = (victim_set_t) { .epfd = epoll_create1(EPOLL_CLOEXEC) };
+    if (set->epfd < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static void victim_set_close(victim_set_t* set)
+{
+    for (int i = 0; i < set->n; i++) {
+        if (set->members[i].pidfd >= 0) {
+            close(set->members[i].pidfd);
+        }
+    }
+    free(set->members);
+    close(set->epfd);
+    *set = (victim_set_t) { .epfd = -1 };
+}
+
+// Add process `pid`. If the caller has a pidfd that pinned it, pass it in
+// `pidfd` (it is duplicated), otherwise -1.
+// Returns the index of the new member or -errno.
+static int victim_set_add(victim_set_t* set, int pid, int pidfd)
+{
+    if (set->n == set->cap) {
+        int cap = set->cap ? 2 * set->cap : 16;
+        victim_member_t* fresh = realloc(set->members, (size_t)cap * sizeof(*fresh));
+        if (fresh == NULL) {
+            return -ENOMEM;
+        }
+        set->members = fresh;
+        set->cap = cap;
+    }
+    victim_member_t* m = &set->members[set->n];
+    *m = (victim_member_t) { .pid = pid };
+    m->pidfd = pidfd >= 0 ? fcntl(pidfd, F_DUPFD_CLOEXEC, 0) : pidfd_open(pid, 0);
+    if (m->pidfd < 0 && errno == ESRCH) {
+        // Already gone
+        m->err = ESRCH;
+        m->exited = true;
+    } else if (m->pidfd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)set->n };
+        if (epoll_ctl(set->epfd, EPOLL_CTL_ADD, m->pidfd, &ev) != 0) {
+            int err = errno;
+            close(m->pidfd);
+            return -err;
+        }
+    } else {
+        set->no_pidfd++;
+    }
+    return set->n++;
+}
+
+static bool victim_set_contains(const victim_set_t* set, int pid)
+{
+    for (int i = 0; i < set->n; i++) {
+        if (set->members[i].pid == pid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Add all processes of process group `pgid` that are not members yet.
+// Returns the number of processes added or -errno.
+static int victim_set_add_group(victim_set_t* set, int pgid)
+{
+    int* pids = NULL;
+    int n = procfs_list_pids(&pids);
+    if (n < 0) {
+        return n;
+    }
+    int added = 0;
+    for (int i = 0; i < n; i++) {
+        pid_stat_t stat = { 0 };
+        if (!parse_proc_pid_stat(&stat, pids[i]) || stat.pgrp != pgid || victim_set_contains(set, pids[i])) {
+            continue;
+        }
+        int res = victim_set_add(set, pids[i], -1);
+        if (res < 0) {
+            return res;
+        }
+        added++;
+    }
+    return added;
+}
+
+// Send `sig` to all members that have not exited. With `pgid` > 0, the
+// signal goes to the whole process group at once, which also reaches
+// processes that joined the group after we have listed it.
+// After SIGKILL, process_mrelease() is called for every member, so their
+// memory is released right away, not when the kernel gets to it.
+// Returns the number of members the signal was sent to.
+static int victim_set_signal(victim_set_t* set, int sig, int pgid)
+{
+    if (set->t0.tv_sec == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &set->t0);
+    }
+    int group_err = 0;
+    if (pgid > 0 && kill(-pgid, sig) != 0) {
+        group_err = errno;
+    }
+    int sent = 0;
+    for (int i = 0; i < set->n; i++) {
+        victim_member_t* m = &set->members[i];
+        if (m->exited) {
+            continue;
+        }
+        int res = 0;
+        if (pgid > 0) {
+            errno = group_err;
+            res = group_err ? -1 : 0;
+        } else if (m->pidfd >= 0) {
+            res = pidfd_send_signal(m->pidfd, sig, NULL, 0);
+        } else {
+            res = kill(m->pid, sig);
+        }
+        if (res != 0) {
+            m->err = errno;
+            m->exited = true;
+            if (m->pidfd < 0) {
+                set->no_pidfd--;
+            }
+            continue;
+        }
+        sent++;
+    }
+    // Signal everybody first, so they all start exiting
+    if (sig == SIGKILL) {
+        for (int i = 0; i < set->n; i++) {
+            victim_member_t* m = &set->members[i];
+            if (!m->exited && m->pidfd >= 0 && process_mrelease(m->pidfd, 0) != 0) {
+                debug("%s: pid=%d: process_mrelease failed: %s\n", __func__, m->pid, strerror(errno));
+            }
+        }
+    }
+    set->waiting = 0;
+    for (int i = 0; i < set->n; i++) {
+        set->waiting += !set->members[i].exited;
+    }
+    return sent;
+}
+
+static void victim_set_exited(victim_set_t* set, int i)
+{
+    victim_member_t* m = &set->members[i];
+    m->exited = true;
+    m->exit_us = elapsed_us(&set->t0);
+    set->waiting--;
+    if (m->pidfd >= 0) {
+        epoll_ctl(set->epfd, EPOLL_CTL_DEL, m->pidfd, NULL);
+    } else {
+        set->no_pidfd--;
+    }
+}
+
+// Wait until members exit, or `timeout_ms` has passed.
+// Returns the number of members that have exited, or -errno.
+static int victim_set_wait(victim_set_t* set, int timeout_ms)
+{
+    struct epoll_event events[64];
+    // Without pidfd, we have to look again after a while
+    if (set->no_pidfd > 0 && timeout_ms > KILL_CHECK_MS_DEFAULT) {
+        timeout_ms = KILL_CHECK_MS_DEFAULT;
+    }
+    int ready = epoll_wait(set->epfd, events, 64, timeout_ms);
+    if (ready < 0) {
+        return errno == EINTR ? 0 : -errno;
+    }
+    int exited = 0;
+    for (int i = 0; i < ready; i++) {
+        int idx = (int)events[i].data.u32;
+        if (!set->members[idx].exited) {
+            victim_set_exited(set, idx);
+            exited++;
+        }
+    }
+    for (int i = 0; set->no_pidfd > 0 && i < set->n; i++) {
+        victim_member_t* m = &set->members[i];
+        if (!m->exited && m->pidfd < 0 && !is_alive(m->pid)) {
+            victim_set_exited(set, i);
+            exited++;
+        }
+    }
+    return exited;
+}
+
+// Wait until all members have exited. Escalates to SIGKILL (through
+// `*sig`) when we reach the SIGKILL limits.
+// Returns 0 or -1 and sets errno (ETIME when they did not exit in time).
+static int victim_set_wait_all(const poll_loop_args_t* args, victim_set_t* set, int* sig, int pgid)
+{
+    const int check_ms = args->kill_check_ms > 0 ? args->kill_check_ms : KILL_CHECK_MS_DEFAULT;
+    while (set->waiting > 0) {
+        long long elapsed_ms = elapsed_us(&set->t0) / 1000;
+        if (elapsed_ms >= KILL_WAIT_TIMEOUT_MS) {
+            warn("%d processes did not exit\n", set->waiting);
+            errno = ETIME;
+            return -1;
+        }
+        if (*sig != SIGKILL && at_sigkill_limits(args)) {
+            *sig = SIGKILL;
+            warn("escalating to SIGKILL after %.3f seconds\n", (float)elapsed_ms / 1000);
+            victim_set_signal(set, *sig, pgid);
+        }
+        int res = victim_set_wait(set, check_ms);
+        if (res < 0) {
+            warn("%s: epoll_wait: %s\n", __func__, strerror(-res));
+            errno = -res;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// kill_wait_group sends `sig` to the process group of `victim` (-g) and
+// waits for all of its members to exit.
+static int kill_wait_group(const poll_loop_args_t* args, const procinfo_t* victim, int sig)
+{
+    int pgid = getpgid(victim->pid);
+    if (pgid < 0) {
+        return pgid;
+    }
+    warn("killing whole process group %d (-g flag is active)\n", pgid);
+    if (sig == 0) {
+        return kill(-pgid, 0);
+    }
+
+    victim_set_t set;
+    int res = victim_set_open(&set);
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    res = victim_set_add_group(&set, pgid);
+    if (res < 0) {
+        errno = -res;
+        res = -1;
+        goto out;
+    }
+    if (victim_set_signal(&set, sig, pgid) == 0) {
+        errno = set.n > 0 ? set.members[0].err : ESRCH;
+        res = -1;
+        goto out;
+    }
+    if (monitor_active()) {
+        monitor_set_victim(victim->pid, sig);
+    }
+    while (1) {
+        res = victim_set_wait_all(args, &set, &sig, pgid);
+        if (res != 0) {
+            goto out;
+        }
+        // Processes that joined the group after we have listed it got the
+        // signal too. Wait for them as well.
+        if (victim_set_add_group(&set, pgid) <= 0) {
+            break;
+        }
+        victim_set_signal(&set, sig, pgid);
+    }
+    long long us = elapsed_us(&set.t0);
+    warn("process group %d: %d processes exited after %lld.%06lld seconds\n", pgid, set.n, us / 1000000, us % 1000000);
+    for (int i = 0; i < set.n; i++) {
+        debug("process %d exited after %lld us\n", set.members[i].pid, set.members[i].exit_us);
+    }
+
+out:
+    if (monitor_active()) {
+        int saved_errno = errno;
+        monitor_set_victim(0, 0);
+        errno = saved_errno;
+    }
+    victim_set_close(&set);
+    return res;
+}
+
 /*
- * Send the selected signal to "pid" and wait for the process to exit
- * (max 10 seconds)
+ * Send the selected signal to the victim and wait for the process to exit
+ * (max 10 seconds). With a pidfd, we sleep in poll() on the pidfd and a
+ * timerfd that wakes us every --kill-check-interval ms to see if we have to
+ * escalate to SIGKILL. Without one, we look at /proc at the same interval.
  */
-int kill_wait(const poll_loop_args_t* args, pid_t pid, int sig)
+int kill_wait(const poll_loop_args_t* args, const procinfo_t* victim, int sig)
 {
-    const unsigned poll_ms = 100;
-    int pidfd = -1;
+    // How often we check if we have to escalate to SIGKILL
+    const int check_ms = args->kill_check_ms > 0 ? args->kill_check_ms : KILL_CHECK_MS_DEFAULT;
+    pid_t pid = victim->pid;
+    int timerfd = -1;
+    bool own_pidfd = false;
 
     if (args->dryrun && sig != 0) {
         warn("dryrun, not actually sending any signal\n");
@@ -323,22 +711,25 @@ int kill_wait(const poll_loop_args_t* args, pid_t pid, int sig)
     }
 
     if (args->kill_process_group) {
-        int res = getpgid(pid);
-        if (res < 0) {
-            return res;
-        }
-        pid = -res;
-        warn("killing whole process group %d (-g flag is active)\n", res);
+        return kill_wait_group(args, victim, sig);
     }
 
+    // Use the pidfd that pinned the victim during the scan, if we have one.
+    int pidfd = procinfo_pidfd(victim);
     // Open the pidfd *before* calling kill().
-    if (!args->kill_process_group && sig != 0) {
+    if (sig != 0 && pidfd < 0) {
         pidfd = pidfd_open(pid, 0);
         if (pidfd < 0) {
             warn("%s pid %d: error opening pidfd: %s\n", __func__, pid, strerror(errno));
+        } else {
+            own_pidfd = true;
         }
     }
 
+    // With --monitor-thread, a new kill request means that we should stop
+    // waiting and kill the next process
+    unsigned long requests = monitor_requests();
+
     int res = kill_release(pid, pidfd, sig);
     if (res != 0) {
         goto out_close;
@@ -348,38 +739,132 @@ int kill_wait(const poll_loop_args_t* args, pid_t pid, int sig)
     if (sig == 0) {
         goto out_close;
     }
+    if (monitor_active()) {
+        monitor_set_victim(pid, sig);
+    }
+    if (args->pipeline) {
+        // Look for the next victim while this one exits (see prerank_step()).
+        // The scan skips this one.
+        add_exiting(victim);
+        prerank_reset();
+    }
 
     struct timespec t0 = { 0 };
     clock_gettime(CLOCK_MONOTONIC, &t0);
 
-    for (unsigned i = 0; i < 100; i++) {
-        struct timespec t1 = { 0 };
-        clock_gettime(CLOCK_MONOTONIC, &t1);
-        float secs = (float)(t1.tv_sec - t0.tv_sec) + (float)(t1.tv_nsec - t0.tv_nsec) / (float)1e9;
+    // With a pidfd, we sleep in poll() until either the process exits, or
+    // the timerfd tells us to check the memory situation again.
+    if (pidfd >= 0) {
+        timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (timerfd < 0) {
+            warn("%s: timerfd_create: %s\n", __func__, strerror(errno));
+        } else {
+            struct itimerspec its = {
+                .it_interval = { .tv_sec = check_ms / 1000, .tv_nsec = (check_ms % 1000) * 1000000L },
+            };
+            its.it_value = its.it_interval;
+            if (timerfd_settime(timerfd, 0, &its, NULL) != 0) {
+                warn("%s: timerfd_settime: %s\n", __func__, strerror(errno));
+                close(timerfd);
+                timerfd = -1;
+            }
+        }
+    }
+
+    // When we sent SIGKILL, in ms after t0
+    long long sigkill_ms = 0;
+    while (1) {
+        long long elapsed_ms = elapsed_us(&t0) / 1000;
+        float secs = (float)elapsed_ms / 1000;
+        if (elapsed_ms >= KILL_WAIT_TIMEOUT_MS) {
+            break;
+        }
+
+        if (monitor_active() && monitor_requests() != requests) {
+            warn("process %d has not exited after %.3f seconds, moving on to the next one\n", pid, secs);
+            add_exiting(victim);
+            res = -1;
+            errno = EINPROGRESS;
+            goto out_close;
+        }
+
+        // The victim may be stuck in the kernel. If memory keeps running
+        // out, don't wait for it and kill the next victim (--pipeline).
+        if (args->pipeline && sig == SIGKILL && elapsed_ms - sigkill_ms >= KILL_PIPELINE_DEADLINE_MS
+            && prerank_ready() && at_sigkill_limits(args)) {
+            warn("process %d has not exited after %.3f seconds, moving on to the next one\n", pid, secs);
+            res = -1;
+            errno = EINPROGRESS;
+            goto out_close;
+        }
 
         // We have sent SIGTERM but now have dropped below SIGKILL limits.
         // Escalate to SIGKILL.
         if (sig != SIGKILL) {
-            meminfo_t m = parse_meminfo();
-            print_mem_stats(debug, m);
-            if (m.MemAvailablePercent <= args->mem_kill_percent && m.SwapFreePercent <= args->swap_kill_percent) {
+            if (at_sigkill_limits(args)) {
                 sig = SIGKILL;
+                sigkill_ms = elapsed_ms;
                 warn("escalating to SIGKILL after %.3f seconds\n", secs);
                 res = kill_release(pid, pidfd, sig);
                 if (res != 0) {
                     goto out_close;
                 }
+                if (monitor_active()) {
+                    monitor_set_victim(pid, sig);
+                }
             }
-        } else if (enable_debug) {
+        } else if (enable_debug && !monitor_active()) {
             meminfo_t m = parse_meminfo();
             print_mem_stats(info, m);
         }
-        if (!is_alive(pid)) {
+
+        // Don't sleep while we are looking for the next victim (--pipeline)
+        bool scanning = args->pipeline && !prerank_ready();
+
+        if (timerfd >= 0) {
+            // monitor_wake_fd() is -1 without --monitor-thread, and poll() ignores it
+            struct pollfd pfds[3] = {
+                { .fd = pidfd, .events = POLLIN },
+                { .fd = timerfd, .events = POLLIN },
+                { .fd = monitor_wake_fd(), .events = POLLIN },
+            };
+            int ready = poll(pfds, 3, scanning ? 0 : (int)(KILL_WAIT_TIMEOUT_MS - elapsed_ms));
+            if (ready < 0 && errno != EINTR) {
+                warn("%s: poll: %s\n", __func__, strerror(errno));
+                break;
+            }
+            if (pfds[0].revents) {
+                long long us = elapsed_us(&t0);
+                warn("process %d exited after %lld.%06lld seconds\n", pid, us / 1000000, us % 1000000);
+                goto out_close;
+            }
+            if (pfds[1].revents) {
+                uint64_t expirations;
+                if (read(timerfd, &expirations, sizeof(expirations)) < 0) {
+                    warn("%s: read timerfd: %s\n", __func__, strerror(errno));
+                }
+            }
+            if (pfds[2].revents) {
+                monitor_wait(0, -1);
+            }
+            if (scanning) {
+                prerank_step(args, PRERANK_STEP_US);
+            }
+            continue;
+        }
+
+        if (pidfd >= 0 ? pidfd_exited(pidfd) : !is_alive(pid)) {
             warn("process %d exited after %.3f seconds\n", pid, secs);
             goto out_close;
         }
-        struct timespec req = { .tv_sec = (time_t)(poll_ms / 1000), .tv_nsec = (poll_ms % 1000) * 1000000 };
-        nanosleep(&req, NULL);
+        if (scanning) {
+            prerank_step(args, PRERANK_STEP_US);
+        } else if (monitor_active()) {
+            monitor_wait(check_ms, -1);
+        } else {
+            struct timespec req = { .tv_sec = (time_t)(check_ms / 1000), .tv_nsec = (check_ms % 1000) * 1000000 };
+            nanosleep(&req, NULL);
+        }
     }
 
     res = -1;
@@ -387,7 +872,15 @@ int kill_wait(const poll_loop_args_t* args, pid_t pid, int sig)
     warn("process %d did not exit\n", pid);
 
 out_close:
-    if (pidfd >= 0) {
+    if (monitor_active() && sig != 0) {
+        int saved_errno = errno;
+        monitor_set_victim(0, 0);
+        errno = saved_errno;
+    }
+    if (timerfd >= 0) {
+        close(timerfd);
+    }
+    if (own_pidfd) {
         int saved_errno = errno;
         if (close(pidfd)) {
             warn("%s pid %d: error closing pidfd %d: %s\n", __func__, pid, pidfd, strerror(errno));
@@ -397,33 +890,71 @@ out_close:
     return res;
 }
 
-// is_larger finds out if the process with pid `cur->pid` uses more memory
-// than our current `victim`.
-// In the process, it fills the `cur` structure. It does so lazily, meaning
-// it only fills the fields it needs to make a decision.
-bool is_larger(const poll_loop_args_t* args, const procinfo_t* victim, procinfo_t* cur)
+// Hint flags of the cgroup `cur` is in (--cgroup-hints). The cgroup of
+// the process is cached and looked up again after CGROUP_HINTS_MAX_AGE_MS,
+// in case it has been moved. The hints themselves are cached per cgroup.
+static unsigned cgroup_hint_flags(const procinfo_t* cur, const proc_cache_entry_t* cached)
 {
-    if (cur->pid <= 2) {
-        // Let's not kill init or kthreadd.
-        return false;
-    }
-
-    // Ignore processes owned by root user?
-    if (args->ignore_root_user) {
-        int res = get_uid(cur->pid);
+    struct timespec now = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const long long now_ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    int id = cached->cgroup_id;
+    if (id == 0 || now_ms - cached->cgroup_ms > CGROUP_HINTS_MAX_AGE_MS) {
+        char path[PATH_LEN];
+        int res = get_cgroup(cur->pid, path, sizeof(path));
         if (res < 0) {
-            debug("%s: pid %d: error reading uid: %s\n", __func__, cur->pid, strerror(-res));
-            return false;
+            debug("%s: pid %d: error reading cgroup: %s\n", __func__, cur->pid, strerror(-res));
+            return 0;
         }
-        cur->uid = res;
-
-        if (cur->uid == 0) {
-            return false;
+        id = cgroup_hints_id(path);
+        if (id < 0) {
+            return 0;
         }
+        proc_cache_entry_t learned = {
+            .pid = cur->pid,
+            .starttime = cur->stat.starttime,
+            .uid = PROCINFO_FIELD_NOT_SET,
+            .oom_score_adj = PROCINFO_FIELD_NOT_SET,
+            .cgroup_id = id,
+        };
+        proc_cache_update(&learned);
+    }
+    cgroup_hints_t hints = { 0 };
+    if (!cgroup_hints_get(id, &hints)) {
+        return 0;
+    }
+    return hints.flags;
+}
+
+// Settings for the first pass of scan_pids_two_phase()
+typedef struct {
+    // Estimate oom_score for this many pages of RAM and swap. 0 = don't.
+    long long total_pages;
+    // CLOCK_MONOTONIC time of the scan, in ms
+    long long now_ms;
+} first_pass_t;
+
+// fill_candidate reads everything about process `cur->pid` that is needed
+// to compare it against other processes, and stores it in `cur`.
+// Returns false if the process can never be a victim (or has exited).
+//
+// If `first` is not NULL, only /proc/[pid]/stat is read, and the uid is
+// not checked. oom_score is either left unset or, if first->total_pages is
+// set, computed from rss and oom_score_adj, which is a lower bound of the
+// real value.
+//
+// It does not touch any shared state except the thread-safe proc cache,
+// so the scan threads can call it concurrently.
+static bool fill_candidate(const poll_loop_args_t* args, procinfo_t* cur, const first_pass_t* first)
+{
+    if (cur->pid <= 2) {
+        // Let's not kill init or kthreadd.
+        return false;
     }
 
     {
-        bool res = parse_proc_pid_stat(&cur->stat, cur->pid);
+        // /proc/[pid]/stat also contains the process name, so we get it for free
+        bool res = parse_proc_pid_stat_comm(&cur->stat, cur->name, sizeof(cur->name), cur->pid);
         if (!res) {
             debug("%s: pid %d: error reading stat\n", __func__, cur->pid);
             return false;
@@ -432,6 +963,11 @@ bool is_larger(const poll_loop_args_t* args, const procinfo_t* victim, procinfo_
         cur->VmRSSkiB = cur->stat.rss * page_size / 1024;
     }
 
+    // Already killed, and about to go away (--monitor-thread)
+    if (is_exiting(cur)) {
+        return false;
+    }
+
     // A pid is a kernel thread if it's pid or ppid is 2.
     // At least that's what procs does:
     // https://github.com/warmchang/procps/blob/d173f5d6db746e3f252a6182aa1906a292fc200f/library/readproc.c#L1325
@@ -441,7 +977,57 @@ bool is_larger(const poll_loop_args_t* args, const procinfo_t* victim, procinfo_
         return false;
     }
 
-    {
+    // Values that rarely change are kept across scans. If we are out of
+    // memory, `cached` stays empty and we just read everything.
+    proc_cache_entry_t cached = {
+        .uid = PROCINFO_FIELD_NOT_SET,
+        .oom_score_adj = PROCINFO_FIELD_NOT_SET,
+    };
+    proc_cache_get(cur->pid, cur->stat.starttime, cur->name, &cached);
+    // Values we learn are merged back into the cache at the end
+    proc_cache_entry_t learned = {
+        .pid = cur->pid,
+        .starttime = cur->stat.starttime,
+        .uid = PROCINFO_FIELD_NOT_SET,
+        .oom_score_adj = PROCINFO_FIELD_NOT_SET,
+    };
+    cur->uid = cached.uid;
+    // The oom_score_adj check is done in check_oom_score_adj()
+    cur->oom_score_adj = cached.oom_score_adj;
+
+    // Ignore processes owned by root user?
+    if (args->ignore_root_user && first == NULL) {
+        if (cur->uid == PROCINFO_FIELD_NOT_SET) {
+            int res = get_uid(cur->pid);
+            if (res < 0) {
+                debug("%s: pid %d: error reading uid: %s\n", __func__, cur->pid, strerror(-res));
+                return false;
+            }
+            cur->uid = res;
+            learned.uid = res;
+            proc_cache_update(&learned);
+        }
+        if (cur->uid == 0) {
+            return false;
+        }
+    }
+
+    if (first && first->total_pages == 0) {
+        // oom_score is not needed
+    } else if (first) {
+        // The estimate depends on oom_score_adj, so we don't trust an old value
+        if (cur->oom_score_adj == PROCINFO_FIELD_NOT_SET || first->now_ms - cached.adj_ms > OOM_SCORE_ADJ_MAX_AGE_MS) {
+            int res = get_oom_score_adj(cur->pid, &cur->oom_score_adj);
+            if (res < 0) {
+                debug("%s: pid %d: error reading oom_score_adj: %s\n", __func__, cur->pid, strerror(-res));
+                return false;
+            }
+            learned.oom_score_adj = cur->oom_score_adj;
+            proc_cache_update(&learned);
+            learned.oom_score_adj = PROCINFO_FIELD_NOT_SET;
+        }
+        cur->oom_score = oom_score_points(first->total_pages, cur->stat.rss, cur->oom_score_adj);
+    } else {
         int res = get_oom_score(cur->pid);
         if (res < 0) {
             debug("%s: pid %d: error reading oom_score: %s\n", __func__, cur->pid, strerror(-res));
@@ -451,50 +1037,86 @@ bool is_larger(const poll_loop_args_t* args, const procinfo_t* victim, procinfo_
     }
 
     if ((args->prefer_regex || args->avoid_regex || args->ignore_regex)) {
-        int res = get_comm(cur->pid, cur->name, sizeof(cur->name));
-        if (res < 0) {
-            debug("%s: pid %d: error reading process name: %s\n", __func__, cur->pid, strerror(-res));
-            return false;
+        unsigned match = 0;
+        if (cached.flags & PROC_CACHE_HAVE_REGEX) {
+            match = cached.flags;
+        } else {
+            if (args->prefer_regex && regexec(args->prefer_regex, cur->name, (size_t)0, NULL, 0) == 0) {
+                match |= PROC_CACHE_MATCH_PREFER;
+            }
+            if (args->avoid_regex && regexec(args->avoid_regex, cur->name, (size_t)0, NULL, 0) == 0) {
+                match |= PROC_CACHE_MATCH_AVOID;
+            }
+            if (args->ignore_regex && regexec(args->ignore_regex, cur->name, (size_t)0, NULL, 0) == 0) {
+                match |= PROC_CACHE_MATCH_IGNORE;
+            }
+            learned.flags = match | PROC_CACHE_HAVE_REGEX;
+            proc_cache_update(&learned);
         }
-        if (args->prefer_regex && regexec(args->prefer_regex, cur->name, (size_t)0, NULL, 0) == 0) {
+        if (match & PROC_CACHE_MATCH_PREFER) {
             if (args->sort_by_rss) {
                 cur->VmRSSkiB += VMRSS_PREFER;
             } else {
                 cur->oom_score += OOM_SCORE_PREFER;
             }
         }
-        if (args->avoid_regex && regexec(args->avoid_regex, cur->name, (size_t)0, NULL, 0) == 0) {
+        if (match & PROC_CACHE_MATCH_AVOID) {
             if (args->sort_by_rss) {
                 cur->VmRSSkiB += VMRSS_AVOID;
             } else {
                 cur->oom_score += OOM_SCORE_AVOID;
             }
         }
-        if (args->ignore_regex && regexec(args->ignore_regex, cur->name, (size_t)0, NULL, 0) == 0) {
+        if (match & PROC_CACHE_MATCH_IGNORE) {
             return false;
         }
     }
 
-    // find process with the largest rss
-    if (args->sort_by_rss) {
-        // Case 1: neither victim nor cur have rss=0 (zombie main thread).
-        // This is the usual case.
-        if (cur->VmRSSkiB > 0 && victim->VmRSSkiB > 0) {
-            if (cur->VmRSSkiB < victim->VmRSSkiB) {
-                return false;
-            }
-            if (cur->VmRSSkiB == victim->VmRSSkiB && cur->oom_score <= victim->oom_score) {
-                return false;
-            }
+    if (args->cgroup_hints) {
+        unsigned hints = cgroup_hint_flags(cur, &cached);
+        if (hints & (CGROUP_HINT_OMIT | CGROUP_HINT_MIN)) {
+            return false;
         }
-        // Case 2: one (or both) have rss=0 (zombie main thread)
-        else {
-            if (cur->VmRSSkiB == 0) {
-                // only print the warning when the zombie is first seen, i.e. as "cur"
-                get_comm(cur->pid, cur->name, sizeof(cur->name));
-                warn("%s: pid %d \"%s\": rss=0 but oom_score=%d. Zombie main thread? Using oom_score for this process.\n",
-                    __func__, cur->pid, cur->name, cur->oom_score);
+        if (hints & (CGROUP_HINT_AVOID | CGROUP_HINT_LOW)) {
+            if (args->sort_by_rss) {
+                cur->VmRSSkiB += VMRSS_AVOID;
+            } else {
+                cur->oom_score += OOM_SCORE_AVOID;
             }
+        }
+    }
+    return true;
+}
+
+// With --sort-by-rss, processes with a zombie main thread are compared
+// by oom_score. Tell the user. Called once per process and scan.
+static void warn_zombie(const poll_loop_args_t* args, const procinfo_t* cur)
+{
+    if (args->sort_by_rss && cur->VmRSSkiB == 0) {
+        warn("%s: pid %d \"%s\": rss=0 but oom_score=%d. Zombie main thread? Using oom_score for this process.\n",
+            __func__, cur->pid, cur->name, cur->oom_score);
+    }
+}
+
+// compare_larger decides if `cur` uses more memory than `victim`, based on
+// the values filled in by fill_candidate(). It does no I/O and prints nothing,
+// so it can be called as often as needed.
+static bool compare_larger(const poll_loop_args_t* args, const procinfo_t* victim, const procinfo_t* cur)
+{
+    // find process with the largest rss
+    if (args->sort_by_rss) {
+        // Case 1: neither victim nor cur have rss=0 (zombie main thread).
+        // This is the usual case.
+        if (cur->VmRSSkiB > 0 && victim->VmRSSkiB > 0) {
+            if (cur->VmRSSkiB < victim->VmRSSkiB) {
+                return false;
+            }
+            if (cur->VmRSSkiB == victim->VmRSSkiB && cur->oom_score <= victim->oom_score) {
+                return false;
+            }
+        }
+        // Case 2: one (or both) have rss=0 (zombie main thread)
+        else {
             if (cur->oom_score < victim->oom_score) {
                 return false;
             }
@@ -512,22 +1134,52 @@ bool is_larger(const poll_loop_args_t* args, const procinfo_t* victim, procinfo_
             return false;
         }
     }
+    return true;
+}
 
-    // Skip processes with oom_score_adj = -1000, like the
-    // kernel oom killer would.
-    {
+// Skip processes with oom_score_adj = -1000, like the
+// kernel oom killer would.
+// This is only checked for processes that would otherwise become the new
+// victim, because most processes never get that far.
+static bool check_oom_score_adj(procinfo_t* cur)
+{
+    if (cur->oom_score_adj == PROCINFO_FIELD_NOT_SET) {
         int res = get_oom_score_adj(cur->pid, &cur->oom_score_adj);
         if (res < 0) {
             debug("%s: pid %d: error reading oom_score_adj: %s\n", __func__, cur->pid, strerror(-res));
             return false;
         }
-        if (cur->oom_score_adj == -1000) {
-            return false;
-        }
+        proc_cache_entry_t learned = {
+            .pid = cur->pid,
+            .starttime = cur->stat.starttime,
+            .uid = PROCINFO_FIELD_NOT_SET,
+            .oom_score_adj = cur->oom_score_adj,
+        };
+        proc_cache_update(&learned);
+    }
+    if (cur->oom_score_adj == -1000) {
+        return false;
     }
     return true;
 }
 
+// is_larger finds out if the process with pid `cur->pid` uses more memory
+// than our current `victim`.
+// In the process, it fills the `cur` structure. It does so lazily, meaning
+// it only fills the fields it needs to make a decision.
+bool is_larger(const poll_loop_args_t* args, const procinfo_t* victim, procinfo_t* cur)
+{
+    proc_cache_set_regexes(args->prefer_regex, args->avoid_regex, args->ignore_regex);
+    if (!fill_candidate(args, cur, NULL)) {
+        return false;
+    }
+    warn_zombie(args, cur);
+    if (!compare_larger(args, victim, cur)) {
+        return false;
+    }
+    return check_oom_score_adj(cur);
+}
+
 // Fill the fields in `cur` that are not required for the kill decision.
 // Used to log details about the selected process.
 void fill_informative_fields(procinfo_t* cur)
@@ -544,6 +1196,12 @@ void fill_informative_fields(procinfo_t* cur)
             debug("%s: pid %d: error reading process cmdline: %s\n", __func__, cur->pid, strerror(-res));
         }
     }
+    if (strlen(cur->cgroup) == 0) {
+        int res = get_cgroup(cur->pid, cur->cgroup, sizeof(cur->cgroup));
+        if (res < 0) {
+            debug("%s: pid %d: error reading cgroup: %s\n", __func__, cur->pid, strerror(-res));
+        }
+    }
     if (cur->uid == PROCINFO_FIELD_NOT_SET) {
         int res = get_uid(cur->pid);
         if (res < 0) {
@@ -570,113 +1228,998 @@ void debug_print_procinfo_header()
     debug("  PID OOM_SCORE  RSSkiB   UID OOM_SCORE_ADJ  COMM\n");
 }
 
-/*
- * Find the process with the largest oom_score or rss(when flag --sort-by-rss is set).
- */
-procinfo_t find_largest_process(const poll_loop_args_t* args)
+// State of the scan time budget (--scan-budget) of the current
+// find_largest_process() call
+static struct {
+    struct timespec start;
+    // 0 = no budget
+    long long budget_us;
+    // The scan stopped early, after looking at `seen` of `total` processes
+    bool cut;
+    int seen;
+    int total;
+    // Number of scans that were cut short
+    unsigned hits;
+} budget;
+
+// Has the scan used up its time budget? Only reads `budget`, so the scan
+// threads can call it.
+static bool over_budget(void)
 {
-    DIR* procdir = opendir(procdir_path);
-    if (procdir == NULL) {
-        fatal(5, "%s: could not open /proc: %s", __func__, strerror(errno));
+    return budget.budget_us > 0 && elapsed_us(&budget.start) >= budget.budget_us;
+}
+
+// Remember that the scan was cut short. Only the first cut counts.
+static void budget_cut(int seen, int total)
+{
+    if (!budget.cut) {
+        budget.cut = true;
+        budget.seen = seen;
+        budget.total = total;
     }
+}
 
-    struct timespec t0 = { 0 }, t1 = { 0 };
-    if (enable_debug) {
-        clock_gettime(CLOCK_MONOTONIC, &t0);
+// How many scans have run out of time (--scan-budget)
+unsigned scan_budget_hits(void)
+{
+    return budget.hits;
+}
+
+// The part of procinfo_t that the scan threads fill in for each pid.
+// Kept small because there is one per process.
+typedef struct {
+    int pid;
+    int uid;
+    int oom_score;
+    int oom_score_adj;
+    long long VmRSSkiB;
+    pid_stat_t stat;
+    // Process names from /proc/[pid]/stat have at most 15 bytes
+    char name[PROC_CACHE_COMM_LEN];
+    // fill_candidate() returned true
+    bool eligible;
+    // Not looked at because the time budget was used up
+    bool skipped;
+} scan_result_t;
+
+typedef struct {
+    const poll_loop_args_t* args;
+    const int* pids;
+    scan_result_t* results;
+} scan_job_t;
+
+static const procinfo_t empty_procinfo = {
+    .pid = PROCINFO_FIELD_NOT_SET,
+    .uid = PROCINFO_FIELD_NOT_SET,
+    .oom_score = PROCINFO_FIELD_NOT_SET,
+    .oom_score_adj = PROCINFO_FIELD_NOT_SET,
+    .VmRSSkiB = PROCINFO_FIELD_NOT_SET,
+    /* omitted fields are set to zero */
+};
+
+// The pidfd of `p`, or -1 if it has none.
+int procinfo_pidfd(const procinfo_t* p)
+{
+    return p->has_pidfd ? p->pidfd : -1;
+}
+
+// Close the pidfd of `p`, if it has one.
+void procinfo_close(procinfo_t* p)
+{
+    if (p->has_pidfd) {
+        close(p->pidfd);
+        p->has_pidfd = false;
     }
+}
 
-    debug_print_procinfo_header();
+// pin_victim opens a pidfd for the process in `cur`, which is about to become
+// the victim. Returns false if the process is gone, or if the pid now belongs
+// to a different process. Without pidfd support, cur->has_pidfd stays false
+// and we kill by pid like before.
+static bool pin_victim(procinfo_t* cur)
+{
+    if (strcmp(procdir_path, "/proc") != 0) {
+        // Mock procdir in the test suite. These are not real processes.
+        return true;
+    }
+    int fd = pidfd_open(cur->pid, 0);
+    if (fd < 0) {
+        return errno != ESRCH;
+    }
+    // The pid may have been reused after we read /proc/[pid]/stat. Now that
+    // the process is pinned, check that it is still the one we looked at.
+    pid_stat_t st = { 0 };
+    if (!parse_proc_pid_stat(&st, cur->pid) || st.starttime != cur->stat.starttime) {
+        debug("%s: pid %d has been reused\n", __func__, cur->pid);
+        close(fd);
+        return false;
+    }
+    cur->pidfd = fd;
+    cur->has_pidfd = true;
+    return true;
+}
 
-    const procinfo_t empty_procinfo = {
-        .pid = PROCINFO_FIELD_NOT_SET,
-        .uid = PROCINFO_FIELD_NOT_SET,
-        .oom_score = PROCINFO_FIELD_NOT_SET,
-        .oom_score_adj = PROCINFO_FIELD_NOT_SET,
-        .VmRSSkiB = PROCINFO_FIELD_NOT_SET,
-        /* omitted fields are set to zero */
-    };
+// The runners-up of the last scan are kept in a min-heap of at most
+// args->candidates entries, ordered by compare_larger(). topk[0] is the
+// smallest.
+static procinfo_t topk[CANDIDATES_MAX];
+static int topk_n;
 
-    procinfo_t victim = empty_procinfo;
+static void topk_swap(int i, int j)
+{
+    procinfo_t tmp = topk[i];
+    topk[i] = topk[j];
+    topk[j] = tmp;
+}
+
+// Offer `cur` to the heap. Returns true if it was added.
+static bool topk_offer(const poll_loop_args_t* args, procinfo_t* cur)
+{
+    if (topk_n == args->candidates && !compare_larger(args, &topk[0], cur)) {
+        return false;
+    }
+    if (!check_oom_score_adj(cur)) {
+        return false;
+    }
+    if (topk_n < args->candidates) {
+        // Add at the bottom and sift up
+        int i = topk_n++;
+        topk[i] = *cur;
+        while (i > 0 && compare_larger(args, &topk[i], &topk[(i - 1) / 2])) {
+            topk_swap(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+        return true;
+    }
+    // Replace the smallest and sift down
+    topk[0] = *cur;
+    int i = 0;
     while (1) {
-        errno = 0;
-        struct dirent* d = readdir(procdir);
-        if (d == NULL) {
-            if (errno != 0)
-                warn("%s: readdir error: %s", __func__, strerror(errno));
+        int smallest = i;
+        for (int c = 2 * i + 1; c <= 2 * i + 2 && c < topk_n; c++) {
+            if (compare_larger(args, &topk[c], &topk[smallest])) {
+                smallest = c;
+            }
+        }
+        if (smallest == i) {
             break;
         }
+        topk_swap(i, smallest);
+        i = smallest;
+    }
+    return true;
+}
+
+// rank_candidate looks at process `cur` (filled in by fill_candidate(), which
+// returned `eligible`) and makes it the new `victim` if it is larger.
+// With --candidates, it also keeps the runners-up.
+static void rank_candidate(const poll_loop_args_t* args, procinfo_t* victim, procinfo_t* cur, bool eligible)
+{
+    if (eligible) {
+        warn_zombie(args, cur);
+    }
+    bool larger = eligible && compare_larger(args, victim, cur) && check_oom_score_adj(cur);
+    if (eligible && args->candidates > 1) {
+        topk_offer(args, cur);
+    }
+    if (larger) {
+        larger = pin_victim(cur);
+    }
+
+    debug_print_procinfo(cur);
+
+    if (larger) {
+        debug(" <--- new victim\n");
+        procinfo_close(victim);
+        *victim = *cur;
+    } else {
+        debug("\n");
+    }
+}
+
+// Runs on the scan threads: fill the results for pids [begin, end).
+static void scan_fill_range(void* arg, int begin, int end)
+{
+    scan_job_t* job = arg;
+    for (int i = begin; i < end; i++) {
+        procinfo_t cur = empty_procinfo;
+        cur.pid = job->pids[i];
+        scan_result_t* r = &job->results[i];
+
+        r->skipped = over_budget();
+        if (r->skipped) {
+            r->eligible = false;
+            continue;
+        }
+        r->eligible = fill_candidate(job->args, &cur, NULL);
+        r->pid = cur.pid;
+        r->uid = cur.uid;
+        r->oom_score = cur.oom_score;
+        r->oom_score_adj = cur.oom_score_adj;
+        r->VmRSSkiB = cur.VmRSSkiB;
+        r->stat = cur.stat;
+        // cur.name is zero-padded
+        memcpy(r->name, cur.name, sizeof(r->name) - 1);
+        r->name[sizeof(r->name) - 1] = 0;
+    }
+}
 
-        // proc contains lots of directories not related to processes,
-        // skip them
-        if (!isnumeric(d->d_name))
+// scan_procdir_parallel reads the per-process information on all threads of
+// the scan pool, and then picks the victim on this thread, in pid order, just
+// like scan_procdir() does.
+//
+// Picking the victim is cheap and is not split up: compare_larger() is not
+// transitive when zombie main threads (rss=0) are involved, so merging
+// per-thread winners could pick a different victim than the serial scan.
+static procinfo_t scan_procdir_parallel(const poll_loop_args_t* args, const int* pids, int n)
+{
+    static scan_result_t* results;
+    static int results_cap;
+
+    if (n > results_cap) {
+        int cap = n + n / 4;
+        scan_result_t* fresh = realloc(results, (size_t)cap * sizeof(*results));
+        if (fresh == NULL) {
+            fatal(5, "%s: could not allocate results for %d processes\n", __func__, cap);
+        }
+        results = fresh;
+        results_cap = cap;
+    }
+
+    scan_job_t job = {
+        .args = args,
+        .pids = pids,
+        .results = results,
+    };
+    scan_pool_run(scan_fill_range, &job, n);
+
+    procinfo_t victim = empty_procinfo;
+    int skipped = 0;
+    for (int i = 0; i < n; i++) {
+        const scan_result_t* r = &results[i];
+        if (r->skipped) {
+            skipped++;
             continue;
+        }
+        procinfo_t cur = empty_procinfo;
+        cur.pid = r->pid;
+        cur.uid = r->uid;
+        cur.oom_score = r->oom_score;
+        cur.oom_score_adj = r->oom_score_adj;
+        cur.VmRSSkiB = r->VmRSSkiB;
+        cur.stat = r->stat;
+        snprintf(cur.name, sizeof(cur.name), "%s", r->name);
+
+        rank_candidate(args, &victim, &cur, r->eligible);
+    }
+    if (skipped > 0) {
+        budget_cut(n - skipped, n);
+        // Out of time, but we need a victim. Go on here until we have one.
+        for (int i = 0; i < n && victim.pid <= 0; i++) {
+            if (!results[i].skipped) {
+                continue;
+            }
+            procinfo_t cur = empty_procinfo;
+            cur.pid = pids[i];
+            bool eligible = fill_candidate(args, &cur, NULL);
+            rank_candidate(args, &victim, &cur, eligible);
+        }
+    }
+    return victim;
+}
 
+// scan_pids looks at the processes `pids` on this thread, in order, and
+// returns the largest.
+static procinfo_t scan_pids(const poll_loop_args_t* args, const int* pids, int n)
+{
+    procinfo_t victim = empty_procinfo;
+    for (int i = 0; i < n; i++) {
+        if (victim.pid > 0 && over_budget()) {
+            budget_cut(i, n);
+            break;
+        }
+        if (i % PROCFS_URING_BATCH == 0 && procfs_uring_active()) {
+            // Read stat and oom_score of the next batch in one go (--io-uring)
+            procfs_uring_prefetch(&pids[i], n - i);
+        }
         procinfo_t cur = empty_procinfo;
-        cur.pid = (int)strtol(d->d_name, NULL, 10);
+        cur.pid = pids[i];
+
+        bool eligible = fill_candidate(args, &cur, NULL);
+        rank_candidate(args, &victim, &cur, eligible);
+    }
+    procfs_uring_forget();
+    return victim;
+}
 
-        bool larger = is_larger(args, &victim, &cur);
+// What scan_pids_two_phase() knows about a process after the first pass
+typedef struct {
+    // Index into the pids array
+    int index;
+    // Upper bound of what the process is ranked by: VmRSSkiB with
+    // --sort-by-rss, oom_score otherwise. Includes --prefer/--avoid.
+    long long bound;
+    // With --estimate-oom-score: what the bound was computed from, so it
+    // can be recomputed for a fresh oom_score_adj
+    long long pages;
+    int bonus;
+    int oom_score_adj;
+    // With --ignore-root-user: the uid was not cached and would have been
+    // looked up
+    bool uid_unknown;
+} scan_bound_t;
+
+// A process that scan_pids_two_phase() has read completely
+typedef struct {
+    int index;
+    bool eligible;
+    procinfo_t info;
+} scan_finalist_t;
+
+static int compare_bound_desc(const void* a, const void* b)
+{
+    long long x = ((const scan_bound_t*)a)->bound;
+    long long y = ((const scan_bound_t*)b)->bound;
+    return (x < y) - (x > y);
+}
 
-        debug_print_procinfo(&cur);
+static int compare_index(const void* a, const void* b)
+{
+    return ((const scan_finalist_t*)a)->index - ((const scan_finalist_t*)b)->index;
+}
 
-        if (larger) {
-            debug(" <--- new victim\n");
-            victim = cur;
+// scan_pids_two_phase returns the same victim (and candidates) as
+// scan_pids(), without reading everything about every process.
+//
+// The first pass only reads /proc/[pid]/stat and computes an upper bound
+// of what the process is ranked by. With --sort-by-rss, that is the rss
+// itself. Otherwise (--estimate-oom-score), oom_score is computed from rss
+// and oom_score_adj like the kernel does. The kernel also counts the swap
+// entries and page tables of the process, which are bounded by the swap in
+// use and the page tables of the whole system.
+//
+// The second pass reads the processes completely, largest bound first,
+// until the K-th largest value read is larger than the next bound. These
+// finalists are then ranked in their original order, just like scan_pids()
+// would, so ties are resolved the same way.
+//
+// The oom_score_adj of the first pass may come from the cache and be up to
+// OOM_SCORE_ADJ_MAX_AGE_MS old. A process that has raised it since could
+// be pruned wrongly, so the remaining processes whose bound could reach the
+// K-th largest value with any oom_score_adj have it read again.
+static procinfo_t scan_pids_two_phase(const poll_loop_args_t* args, const int* pids, int n)
+{
+    static scan_bound_t* bounds;
+    static int bounds_cap;
+    static scan_finalist_t* finalists;
+    static int finalists_cap;
+
+    first_pass_t first = { 0 };
+    long long slack_pages = 0;
+    if (!args->sort_by_rss) {
+        meminfo_t m = parse_meminfo();
+        if (m.PageTablesKiB < 0) {
+            return scan_pids(args, pids, n);
+        }
+        struct timespec now = { 0 };
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        first.total_pages = oom_score_total_pages(&m);
+        first.now_ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        // The most a single process can have on top of its rss
+        slack_pages = (m.SwapTotalKiB - m.SwapFreeKiB + m.PageTablesKiB) / (sysconf(_SC_PAGESIZE) / 1024);
+    }
+    if (n > bounds_cap) {
+        int cap = n + n / 4;
+        scan_bound_t* fresh = realloc(bounds, (size_t)cap * sizeof(*bounds));
+        if (fresh == NULL) {
+            fatal(5, "%s: could not allocate bounds for %d processes\n", __func__, cap);
+        }
+        bounds = fresh;
+        bounds_cap = cap;
+    }
+
+    int n_bounds = 0;
+    for (int i = 0; i < n; i++) {
+        if (over_budget()) {
+            // Pick from what we have so far
+            budget_cut(i, n);
+            break;
+        }
+        procinfo_t cur = empty_procinfo;
+        cur.pid = pids[i];
+        if (!fill_candidate(args, &cur, &first)) {
+            continue;
+        }
+        scan_bound_t* b = &bounds[n_bounds++];
+        b->index = i;
+        b->uid_unknown = args->ignore_root_user && cur.uid == PROCINFO_FIELD_NOT_SET;
+        if (args->sort_by_rss) {
+            if (cur.VmRSSkiB <= 0) {
+                // Zombie main thread or --avoid. compare_larger() ranks these
+                // by oom_score, which does not fit into the rss order.
+                debug("%s: pid %d: rss=%lld, reading all processes\n", __func__, cur.pid, cur.VmRSSkiB);
+                return scan_pids(args, pids, n);
+            }
+            b->bound = cur.VmRSSkiB;
+        } else if (cur.stat.rss == 0) {
+            // Zombie main thread. The kernel uses the memory of the other threads.
+            b->bound = LLONG_MAX;
         } else {
-            debug("\n");
+            b->pages = cur.stat.rss + slack_pages;
+            b->bonus = cur.oom_score - oom_score_points(first.total_pages, cur.stat.rss, cur.oom_score_adj);
+            b->oom_score_adj = cur.oom_score_adj;
+            b->bound = oom_score_points(first.total_pages, b->pages, b->oom_score_adj) + b->bonus;
         }
     }
-    closedir(procdir);
+    qsort(bounds, (size_t)n_bounds, sizeof(*bounds), compare_bound_desc);
+
+    const int k = args->candidates > 1 ? args->candidates : 1;
+    // The k largest values read so far, smallest first
+    long long top[CANDIDATES_MAX];
+    int top_n = 0;
+    int n_final = 0;
+    // oom_score_adj values read again (see above), and uids looked up
+    int adj_reads = 0;
+    int uid_reads = 0;
+    for (int i = 0; i < n_bounds; i++) {
+        scan_bound_t* b = &bounds[i];
+        if (top_n == k && b->bound < top[0]) {
+            if (args->sort_by_rss) {
+                break;
+            }
+            if (oom_score_points(first.total_pages, b->pages, OOM_SCORE_ADJ_MAX) + b->bonus < top[0]) {
+                continue;
+            }
+            int adj = 0;
+            adj_reads++;
+            if (get_oom_score_adj(pids[b->index], &adj) < 0 || adj <= b->oom_score_adj) {
+                continue;
+            }
+            debug("%s: pid %d: oom_score_adj went up from %d to %d\n", __func__, pids[b->index], b->oom_score_adj, adj);
+            if (oom_score_points(first.total_pages, b->pages, adj) + b->bonus < top[0]) {
+                continue;
+            }
+        }
+        if (top_n > 0 && over_budget()) {
+            budget_cut(i, n_bounds);
+            break;
+        }
+        if (n_final == finalists_cap) {
+            int cap = finalists_cap ? finalists_cap * 2 : 64;
+            scan_finalist_t* fresh = realloc(finalists, (size_t)cap * sizeof(*finalists));
+            if (fresh == NULL) {
+                fatal(5, "%s: could not allocate %d finalists\n", __func__, cap);
+            }
+            finalists = fresh;
+            finalists_cap = cap;
+        }
+        scan_finalist_t* f = &finalists[n_final++];
+        uid_reads += b->uid_unknown;
+        f->index = b->index;
+        f->info = empty_procinfo;
+        f->info.pid = pids[f->index];
+        f->eligible = fill_candidate(args, &f->info, NULL);
+        if (!f->eligible || !check_oom_score_adj(&f->info)) {
+            continue;
+        }
+        long long value = args->sort_by_rss ? f->info.VmRSSkiB : f->info.oom_score;
+        if (top_n == k && value <= top[0]) {
+            continue;
+        }
+        // Insertion sort. k is small.
+        int j = 0;
+        if (top_n < k) {
+            j = top_n++;
+            while (j > 0 && top[j - 1] > value) {
+                top[j] = top[j - 1];
+                j--;
+            }
+        } else {
+            // Drop the smallest
+            while (j + 1 < k && top[j + 1] < value) {
+                top[j] = top[j + 1];
+                j++;
+            }
+        }
+        top[j] = value;
+    }
 
     if (enable_debug) {
-        clock_gettime(CLOCK_MONOTONIC, &t1);
-        long delta = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
-        debug("selecting victim took %ld.%03ld ms\n", delta / 1000, delta % 1000);
+        // Each skipped process saves reading oom_score (openat, read, close),
+        // and maybe a stat() for the uid. Each finalist costs reading stat
+        // again, and so does each oom_score_adj read again.
+        int skipped = n_bounds - n_final;
+        int saved = 3 * skipped - 3 * n_final - 3 * adj_reads - uid_reads;
+        for (int i = 0; i < n_bounds; i++) {
+            saved += bounds[i].uid_unknown;
+        }
+        debug("%s: read %d of %d processes completely, saved %d syscalls\n", __func__, n_final, n_bounds, saved);
+    }
+
+    qsort(finalists, (size_t)n_final, sizeof(*finalists), compare_index);
+    procinfo_t victim = empty_procinfo;
+    for (int i = 0; i < n_final; i++) {
+        rank_candidate(args, &victim, &finalists[i].info, finalists[i].eligible);
+    }
+    return victim;
+}
+
+// The largest processes of the last scan, by pid, with their rank.
+// See order_by_hints().
+typedef struct {
+    int pid;
+    int rank;
+} scan_hint_t;
+static scan_hint_t hints[CANDIDATES_MAX + 1];
+static int hints_n;
+
+static int compare_hint_pid(const void* a, const void* b)
+{
+    return ((const scan_hint_t*)a)->pid - ((const scan_hint_t*)b)->pid;
+}
+
+// Remember the victim and the runners-up (if sorted by save_ranking()),
+// largest first.
+static void save_hints(const procinfo_t* victim)
+{
+    hints_n = 0;
+    if (victim->pid > 0) {
+        hints[hints_n] = (scan_hint_t) { .pid = victim->pid, .rank = hints_n };
+        hints_n++;
+    }
+    for (int i = 0; i < topk_n; i++) {
+        if (topk[i].pid != victim->pid) {
+            hints[hints_n] = (scan_hint_t) { .pid = topk[i].pid, .rank = hints_n };
+            hints_n++;
+        }
+    }
+    qsort(hints, (size_t)hints_n, sizeof(*hints), compare_hint_pid);
+}
+
+// With --scan-budget, look at the largest processes of the last scan first,
+// so that we have them if the time runs out. Processes don't change size
+// that quickly. Returns `pids` reordered in a buffer of its own.
+static int* order_by_hints(const int* pids, int n)
+{
+    static int* ordered;
+    static int ordered_cap;
+
+    if (n + hints_n > ordered_cap) {
+        int cap = n + n / 4 + hints_n;
+        int* fresh = realloc(ordered, (size_t)cap * sizeof(*ordered));
+        if (fresh == NULL) {
+            fatal(5, "%s: could not allocate %d pids\n", __func__, cap);
+        }
+        ordered = fresh;
+        ordered_cap = cap;
+    }
+    // The hints go to their rank in the first hints_n slots, everything
+    // else after that. Then close the gaps of hints that are gone.
+    for (int i = 0; i < hints_n; i++) {
+        ordered[i] = 0;
+    }
+    int n_rest = 0;
+    for (int i = 0; i < n; i++) {
+        scan_hint_t key = { .pid = pids[i] };
+        const scan_hint_t* h = bsearch(&key, hints, (size_t)hints_n, sizeof(*hints), compare_hint_pid);
+        if (h) {
+            ordered[h->rank] = pids[i];
+        } else {
+            ordered[hints_n + n_rest++] = pids[i];
+        }
+    }
+    int n_front = 0;
+    for (int i = 0; i < hints_n; i++) {
+        if (ordered[i] != 0) {
+            ordered[n_front++] = ordered[i];
+        }
+    }
+    memmove(&ordered[n_front], &ordered[hints_n], (size_t)n_rest * sizeof(*ordered));
+    return ordered;
+}
+
+// list_pids returns the pids of all processes, from the live process table
+// if the proc connector is in use (--proc-events), otherwise from /proc.
+static int list_pids(int** out)
+{
+    if (proc_events_active()) {
+        return proc_events_list_pids(out);
+    }
+    return procfs_list_pids(out);
+}
+
+// scan_procdir walks the pids in procdir_path and returns the process with the largest
+// oom_score or rss, as decided by is_larger().
+static procinfo_t scan_procdir(const poll_loop_args_t* args)
+{
+    int* pids = NULL;
+    int n = list_pids(&pids);
+    if (n < 0) {
+        fatal(5, "%s: could not list /proc: %s", __func__, strerror(-n));
+    }
+    if (args->scan_budget_ms > 0) {
+        pids = order_by_hints(pids, n);
+    }
+
+    debug_print_procinfo_header();
+
+    proc_cache_set_regexes(args->prefer_regex, args->avoid_regex, args->ignore_regex);
+    topk_n = 0;
+
+    if (args->scan_threads > 1) {
+        return scan_procdir_parallel(args, pids, n);
     }
 
-    if (victim.pid == getpid()) {
+    if (args->sort_by_rss || args->estimate_oom_score) {
+        return scan_pids_two_phase(args, pids, n);
+    }
+    return scan_pids(args, pids, n);
+}
+
+// is_larger() may have used cached values for oom_score_adj and uid. These
+// only change rarely, but if they did for the victim, the consequences are
+// bad. So re-read them for the victim.
+// Returns false if the victim must not be killed after all.
+static bool revalidate_cached_fields(const poll_loop_args_t* args, const procinfo_t* victim)
+{
+    int oom_score_adj = 0;
+    if (get_oom_score_adj(victim->pid, &oom_score_adj) == 0 && oom_score_adj == -1000) {
+        debug("%s: pid %d: oom_score_adj has changed to -1000\n", __func__, victim->pid);
+        return false;
+    }
+    if (args->ignore_root_user && get_uid(victim->pid) == 0) {
+        debug("%s: pid %d: uid has changed to 0\n", __func__, victim->pid);
+        return false;
+    }
+    return true;
+}
+
+// Final checks and info gathering for the victim we have selected.
+static void finish_victim(procinfo_t* victim)
+{
+    if (victim->pid == getpid()) {
         warn("%s: selected myself (pid %d). Do you use hidpid? See https://github.com/rfjakob/earlyoom/wiki/proc-hidepid\n",
-            __func__, victim.pid);
+            __func__, victim->pid);
+        procinfo_close(victim);
         // zero victim struct
-        victim = (const procinfo_t) { 0 };
+        *victim = (const procinfo_t) { 0 };
     }
 
-    if (victim.pid >= 0) {
+    if (victim->pid >= 0) {
         // We will pretty-print the victim later, so get all the info.
-        fill_informative_fields(&victim);
+        fill_informative_fields(victim);
+    }
+}
+
+// The candidates of the last full scan, largest first (--candidates).
+// ranked[0] is the victim find_largest_process() returned.
+static procinfo_t ranked[CANDIDATES_MAX];
+static int ranked_n;
+// Next candidate next_candidate() returns
+static int ranked_next;
+// When the scan that produced the ranking started
+static struct timespec ranked_time;
+
+// save_ranking stores `victim` and the runners-up from the top-k heap
+// in ranked[].
+static void save_ranking(const poll_loop_args_t* args, const procinfo_t* victim, const struct timespec* scan_start)
+{
+    // Sort the heap, largest first. It has at most CANDIDATES_MAX entries,
+    // so insertion sort is fine. Equal processes are sorted by pid, so the
+    // order does not depend on the history of the heap.
+    for (int i = 1; i < topk_n; i++) {
+        for (int j = i; j > 0; j--) {
+            const procinfo_t *a = &topk[j - 1], *b = &topk[j];
+            bool b_larger = compare_larger(args, a, b);
+            bool tie = !b_larger && !compare_larger(args, b, a);
+            if (!b_larger && !(tie && b->pid < a->pid)) {
+                break;
+            }
+            topk_swap(j - 1, j);
+        }
+    }
+    ranked_n = 0;
+    if (victim->pid > 0) {
+        ranked[ranked_n] = *victim;
+        // The pidfd belongs to the caller
+        ranked[ranked_n].has_pidfd = false;
+        ranked_n++;
+    }
+    for (int i = 0; i < topk_n && ranked_n < args->candidates; i++) {
+        if (topk[i].pid != victim->pid) {
+            ranked[ranked_n++] = topk[i];
+        }
+    }
+    ranked_next = 1;
+    ranked_time = *scan_start;
+
+    if (enable_debug) {
+        debug("top %d candidates:\n", ranked_n);
+        debug_print_procinfo_header();
+        for (int i = 0; i < ranked_n; i++) {
+            debug_print_procinfo(&ranked[i]);
+            debug("\n");
+        }
     }
+}
+
+// recheck_candidate re-reads the process `old` was filled from. It fails if
+// the process has exited, the pid now belongs to a different process, or the
+// process must no longer be killed. On success, the fresh values are in `out`.
+static bool recheck_candidate(const poll_loop_args_t* args, const procinfo_t* old, procinfo_t* out)
+{
+    procinfo_t cur = empty_procinfo;
+    cur.pid = old->pid;
+    proc_cache_set_regexes(args->prefer_regex, args->avoid_regex, args->ignore_regex);
+    if (!fill_candidate(args, &cur, NULL) || cur.stat.starttime != old->stat.starttime
+        || !check_oom_score_adj(&cur) || !revalidate_cached_fields(args, &cur) || !pin_victim(&cur)) {
+        debug("%s: pid %d \"%s\" is gone or no longer eligible\n", __func__, old->pid, old->name);
+        return false;
+    }
+    finish_victim(&cur);
+    if (cur.pid <= 0) {
+        return false;
+    }
+    *out = cur;
+    return true;
+}
+
+// next_candidate returns the next process from the ranking of the last
+// full scan that is still alive and eligible, so we don't have to scan again
+// when killing the victim failed or did not free enough memory.
+// Returns false when the ranking is used up or too old.
+bool next_candidate(const poll_loop_args_t* args, procinfo_t* victim)
+{
+    if (elapsed_us(&ranked_time) > RANKING_MAX_AGE_MS * 1000LL) {
+        return false;
+    }
+    while (ranked_next < ranked_n) {
+        const procinfo_t* old = &ranked[ranked_next++];
+        if (recheck_candidate(args, old, victim)) {
+            debug("%s: using candidate #%d: pid %d \"%s\"\n", __func__, ranked_next, victim->pid, victim->name);
+            return true;
+        }
+    }
+    return false;
+}
 
+/*
+ * Find the process with the largest oom_score or rss(when flag --sort-by-rss is set).
+ */
+procinfo_t find_largest_process(const poll_loop_args_t* args)
+{
+    struct timespec t0 = { 0 }, t1 = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    budget.start = t0;
+    budget.budget_us = args->scan_budget_ms * 1000LL;
+    budget.cut = false;
+
+    procinfo_t victim;
+    while (1) {
+        proc_cache_begin_scan();
+        victim = scan_procdir(args);
+        proc_cache_stats_t stats = proc_cache_end_scan();
+        debug("proc cache: %u hits, %u misses, %u evicted, %u entries\n",
+            stats.hits, stats.misses, stats.evicted, stats.entries);
+
+        if (victim.pid <= 0 || revalidate_cached_fields(args, &victim)) {
+            break;
+        }
+        // Stale cache entry. Forget it and try again. This terminates because
+        // the entries created by the rescan are fresh.
+        procinfo_close(&victim);
+        proc_cache_forget(victim.pid);
+    }
+
+    if (enable_debug) {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        long delta = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+        debug("selecting victim took %ld.%03ld ms\n", delta / 1000, delta % 1000);
+    }
+
+    if (budget.cut) {
+        budget.hits++;
+        warn("scan budget of %d ms used up after %d of %d processes, taking the largest so far (%u times)\n",
+            args->scan_budget_ms, budget.seen, budget.total, budget.hits);
+    }
+
+    finish_victim(&victim);
+    if (args->candidates > 1) {
+        save_ranking(args, &victim, &t0);
+    }
+    save_hints(&victim);
     return victim;
 }
 
 /*
- * Kill the victim process, wait for it to exit, send a gui notification
- * (if enabled).
+ * Find the largest process in the cgroup `dir` and the cgroups below it
+ * (--cgroup-limit). Only these processes are looked at, and the ranking
+ * of the last full scan (--candidates) is kept.
  */
-void kill_process(const poll_loop_args_t* args, int sig, const procinfo_t* victim)
+procinfo_t find_largest_process_in(const poll_loop_args_t* args, const char* dir)
 {
-    if (victim->pid <= 0) {
-        warn("Could not find a process to kill. Sleeping 1 second.\n");
-        if (args->notify) {
-            notify_dbus("Error: Could not find a process to kill. Sleeping 1 second.");
+    int* pids = NULL;
+    int n = cgroup_read_procs_below(dir, &pids);
+    if (n < 0) {
+        warn("%s: %s: %s\n", __func__, dir, strerror(-n));
+        return empty_procinfo;
+    }
+    // The cgroup has few processes compared to the whole system
+    budget.budget_us = 0;
+    budget.cut = false;
+    debug_print_procinfo_header();
+    proc_cache_set_regexes(args->prefer_regex, args->avoid_regex, args->ignore_regex);
+    topk_n = 0;
+
+    procinfo_t victim;
+    while (1) {
+        victim = scan_pids(args, pids, n);
+        if (victim.pid <= 0 || revalidate_cached_fields(args, &victim)) {
+            break;
+        }
+        procinfo_close(&victim);
+        proc_cache_forget(victim.pid);
+    }
+    free(pids);
+    finish_victim(&victim);
+    return victim;
+}
+
+// The pre-ranking walks /proc in small steps while memory is getting low
+// (see prerank_step()), so that when we have to kill, the victim is
+// already known.
+static struct {
+    // Snapshot of the pid list of the current pass
+    int* pids;
+    int n;
+    int cap;
+    // Next index into pids. n = no pass in progress.
+    int next;
+    // Largest process of the current pass so far
+    procinfo_t best;
+    struct timespec pass_start;
+    // Result of the last complete pass. pid <= 0 = none.
+    procinfo_t ready;
+    // When the pass that found `ready` started
+    struct timespec ready_time;
+} prerank;
+
+// Forget the pre-ranking, for example because we have left the warm band.
+void prerank_reset(void)
+{
+    prerank.n = 0;
+    prerank.next = 0;
+    prerank.ready = empty_procinfo;
+}
+
+// prerank_step continues the pre-ranking pass for at most `budget_us`
+// microseconds, and starts a new pass when the last one is complete.
+void prerank_step(const poll_loop_args_t* args, long long budget_us)
+{
+    struct timespec t0 = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (prerank.next >= prerank.n) {
+        int* pids = NULL;
+        int n = list_pids(&pids);
+        if (n < 0) {
+            warn("%s: could not list /proc: %s\n", __func__, strerror(-n));
+            return;
+        }
+        // list_pids() reuses its buffer, and find_largest_process()
+        // may run before this pass is complete.
+        if (n > prerank.cap) {
+            int* fresh = realloc(prerank.pids, (size_t)n * sizeof(*fresh));
+            if (fresh == NULL) {
+                warn("%s: could not allocate %d pids\n", __func__, n);
+                return;
+            }
+            prerank.pids = fresh;
+            prerank.cap = n;
+        }
+        memcpy(prerank.pids, pids, (size_t)n * sizeof(*pids));
+        prerank.n = n;
+        prerank.next = 0;
+        prerank.best = empty_procinfo;
+        prerank.pass_start = t0;
+        proc_cache_begin_scan();
+    }
+
+    while (prerank.next < prerank.n) {
+        procinfo_t cur = empty_procinfo;
+        cur.pid = prerank.pids[prerank.next++];
+        if (is_larger(args, &prerank.best, &cur)) {
+            prerank.best = cur;
+        }
+        // Looking at the clock costs about as much as reading one file,
+        // so don't do it after every process.
+        if (prerank.next % 16 == 0 && elapsed_us(&t0) >= budget_us) {
+            break;
         }
-        sleep(1);
-        return;
     }
 
-    char* sig_name = "?";
+    if (prerank.next >= prerank.n) {
+        proc_cache_end_scan();
+        prerank.ready = prerank.best;
+        prerank.ready_time = prerank.pass_start;
+        debug("%s: pass over %d processes complete, top: pid %d \"%s\"\n",
+            __func__, prerank.n, prerank.ready.pid, prerank.ready.name);
+    }
+}
+
+// Is there a recent result of the pre-ranking?
+bool prerank_ready(void)
+{
+    return prerank.ready.pid > 0 && elapsed_us(&prerank.ready_time) <= RANKING_MAX_AGE_MS * 1000LL;
+}
+
+// prerank_victim returns the victim found by the pre-ranking, after checking
+// that it is still alive, still the same process, and still allowed to be
+// killed. Other processes are not looked at again.
+// Returns false if there is no usable result. Call find_largest_process()
+// then.
+bool prerank_victim(const poll_loop_args_t* args, procinfo_t* victim)
+{
+    if (!prerank_ready()) {
+        return false;
+    }
+    struct timespec t0 = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    const procinfo_t old = prerank.ready;
+    // Use it only once. If the kill does not help, we do a full scan next time.
+    prerank.ready = empty_procinfo;
+
+    if (!recheck_candidate(args, &old, victim)) {
+        return false;
+    }
+
+    if (enable_debug) {
+        long long delta = elapsed_us(&t0);
+        debug("selecting victim took %lld.%03lld ms (pre-ranked)\n", delta / 1000, delta % 1000);
+    }
+    return true;
+}
+
+static const char* sig_name(int sig)
+{
     if (sig == SIGTERM) {
-        sig_name = "SIGTERM";
+        return "SIGTERM";
     } else if (sig == SIGKILL) {
-        sig_name = "SIGKILL";
+        return "SIGKILL";
     } else if (sig == 0) {
-        sig_name = "0 (no-op signal)";
+        return "0 (no-op signal)";
     }
+    return "?";
+}
+
+static void print_kill(int sig, const procinfo_t* victim)
+{
     // sig == 0 is used as a self-test during startup. Don't notify the user.
     if (sig != 0 || enable_debug) {
         warn("sending %s to process %d uid %d \"%s\": oom_score %d, oom_score_adj %d, VmRSS %lld MiB, cmdline \"%s\"\n",
-            sig_name, victim->pid, victim->uid, victim->name, victim->oom_score, victim->oom_score_adj, victim->VmRSSkiB / 1024,
+            sig_name(sig), victim->pid, victim->uid, victim->name, victim->oom_score, victim->oom_score_adj, victim->VmRSSkiB / 1024,
             victim->cmdline);
     }
+}
+
+/*
+ * Kill the victim process, wait for it to exit, send a gui notification
+ * (if enabled).
+ * Returns 0 on success, or the errno value of the failed kill.
+ */
+int kill_process(const poll_loop_args_t* args, int sig, const procinfo_t* victim)
+{
+    if (victim->pid <= 0) {
+        warn("Could not find a process to kill. Sleeping 1 second.\n");
+        if (args->notify) {
+            notify_dbus("Error: Could not find a process to kill. Sleeping 1 second.");
+        }
+        sleep(1);
+        return ESRCH;
+    }
+
+    print_kill(sig, victim);
 
     // Invoke program BEFORE killing a process. There is a small risk that there
     // is not enough memory to spawn it, warn; and a brief period of waiting to
@@ -686,7 +2229,7 @@ void kill_process(const poll_loop_args_t* args, int sig, const procinfo_t* victi
         kill_process_prehook(args, victim);
     }
 
-    int res = kill_wait(args, victim->pid, sig);
+    int res = kill_wait(args, victim, sig);
     int saved_errno = errno;
 
     // Send the GUI notification AFTER killing a process. This makes it more likely
@@ -696,20 +2239,218 @@ void kill_process(const poll_loop_args_t* args, int sig, const procinfo_t* victi
     }
 
     if (sig == 0) {
-        return;
+        return res != 0 ? saved_errno : 0;
     }
 
+    if (res != 0 && saved_errno == EINPROGRESS) {
+        // Signal sent, but we stopped waiting for the process to exit
+        return EINPROGRESS;
+    }
     if (res != 0) {
         warn("kill failed: %s\n", strerror(saved_errno));
         if (args->notify) {
             notify_dbus("Error: Failed to kill process");
         }
-        // Killing the process may have failed because we are not running as root.
-        // In that case, trying again in 100ms will just yield the same error.
-        // Throttle ourselves to not spam the log.
-        if (saved_errno == EPERM) {
-            warn("sleeping 1 second\n");
-            sleep(1);
+        return saved_errno;
+    }
+    return 0;
+}
+
+// batch_deficit_kib calculates how much memory and swap have to be freed to
+// get back above the SIGTERM limits plus --batch-kill percent. Getting there
+// with either of them is enough. Without swap, only memory counts.
+static void batch_deficit_kib(const poll_loop_args_t* args, const meminfo_t* m, long long* mem_kib, long long* swap_kib)
+{
+    double margin = args->batch_kill_percent;
+    *mem_kib = (long long)((args->mem_term_percent + margin) * (double)m->UserMemTotalKiB / 100) - m->MemAvailableKiB;
+    *swap_kib = LLONG_MAX;
+    if (m->SwapTotalKiB > 0) {
+        *swap_kib = (long long)((args->swap_term_percent + margin) * (double)m->SwapTotalKiB / 100) - m->SwapFreeKiB;
+    }
+}
+
+// batch_select fills batch[] with `first` and as many of the next candidates
+// (see next_candidate()) as are needed to cover the deficit, at most
+// args->candidates. batch[0] is a copy of `first` and shares its pidfd, the
+// others have their own. Returns the number of processes in batch[].
+int batch_select(const poll_loop_args_t* args, const meminfo_t* m, const procinfo_t* first, procinfo_t* batch)
+{
+    long long mem_deficit_kib, swap_deficit_kib;
+    batch_deficit_kib(args, m, &mem_deficit_kib, &swap_deficit_kib);
+    long long mem_freed_kib = 0, swap_freed_kib = 0;
+    int n = 0;
+    batch[n++] = *first;
+    while (1) {
+        const procinfo_t* cur = &batch[n - 1];
+        long long mem_kib = 0, swap_kib = 0;
+        if (get_freeable_kib(cur->pid, &mem_kib, &swap_kib) < 0) {
+            // Assume that all of the rss is freed, and no swap
+            mem_kib = cur->VmRSSkiB > 0 ? cur->VmRSSkiB : 0;
+            swap_kib = 0;
+        }
+        mem_freed_kib += mem_kib;
+        swap_freed_kib += swap_kib;
+        if (mem_freed_kib >= mem_deficit_kib || swap_freed_kib >= swap_deficit_kib) {
+            break;
         }
+        if (n >= args->candidates || !next_candidate(args, &batch[n])) {
+            break;
+        }
+        n++;
+    }
+    debug("%s: deficit mem %lld MiB, swap %lld MiB. %d processes free mem %lld MiB, swap %lld MiB\n",
+        __func__, mem_deficit_kib / 1024, swap_deficit_kib == LLONG_MAX ? -1 : swap_deficit_kib / 1024,
+        n, mem_freed_kib / 1024, swap_freed_kib / 1024);
+    return n;
+}
+
+/*
+ * kill_batch kills `first`, and the next candidates that are needed to get
+ * back above the SIGTERM limits (--batch-kill), all at once. Then it waits
+ * for all of them to exit together.
+ * Returns 0 if at least one process was killed, or the errno value of the
+ * failed kill of `first`.
+ */
+int kill_batch(const poll_loop_args_t* args, int sig, const meminfo_t* m, const procinfo_t* first)
+{
+    if (first->pid <= 0) {
+        return kill_process(args, sig, first);
+    }
+    procinfo_t batch[CANDIDATES_MAX];
+    const int selected = batch_select(args, m, first, batch);
+    int n = selected;
+    victim_set_t set = { .epfd = -1 };
+    int res = n > 1 ? victim_set_open(&set) : 0;
+    if (n == 1 || res < 0) {
+        if (res < 0) {
+            warn("%s: epoll_create1: %s. Killing one process only\n", __func__, strerror(-res));
+        }
+        for (int i = 1; i < n; i++) {
+            procinfo_close(&batch[i]);
+        }
+        return kill_process(args, sig, first);
+    }
+    warn("killing %d processes to free enough memory\n", n);
+
+    for (int i = 0; i < n; i++) {
+        print_kill(sig, &batch[i]);
+        if (args->kill_process_prehook) {
+            kill_process_prehook(args, &batch[i]);
+        }
+        // Keeps batch[] and set.members[] in step
+        res = victim_set_add(&set, batch[i].pid, procinfo_pidfd(&batch[i]));
+        if (res < 0) {
+            warn("%s: pid %d: %s\n", __func__, batch[i].pid, strerror(-res));
+            n = i;
+            break;
+        }
+    }
+    int killed = 0;
+    if (args->dryrun) {
+        warn("dryrun, not actually sending any signal\n");
+    } else {
+        killed = victim_set_signal(&set, sig, 0);
+        victim_set_wait_all(args, &set, &sig, 0);
+    }
+
+    for (int i = 0; i < n; i++) {
+        const victim_member_t* member = &set.members[i];
+        if (member->err) {
+            warn("kill failed: pid %d: %s\n", member->pid, strerror(member->err));
+        } else if (member->exited) {
+            warn("process %d exited after %lld.%06lld seconds\n", member->pid,
+                member->exit_us / 1000000, member->exit_us % 1000000);
+        }
+        notify_process_killed(args, &batch[i]);
+    }
+    int first_errno = n > 0 ? set.members[0].err : 0;
+    victim_set_close(&set);
+    for (int i = 1; i < selected; i++) {
+        procinfo_close(&batch[i]);
+    }
+    if (args->dryrun || killed > 0) {
+        return 0;
+    }
+    return first_errno;
+}
+
+/*
+ * kill_cgroup sends `sig` to all processes in the cgroup `cg` (--cgroup-kill),
+ * waits until the cgroup is empty, and reports how much memory that freed.
+ * Escalates to SIGKILL when we reach the SIGKILL limits.
+ * Returns 0 on success, or the errno value of the failed kill.
+ */
+int kill_cgroup(const poll_loop_args_t* args, int sig, const cgroup_info_t* cg)
+{
+    // The first process stands in for the cgroup in the hooks
+    procinfo_t victim = empty_procinfo;
+    victim.pid = cg->pid;
+    victim.VmRSSkiB = cg->mem_kib;
+    fill_informative_fields(&victim);
+
+    warn("sending %s to cgroup %s: %d processes, memory %lld MiB, swap %lld MiB\n",
+        sig_name(sig), cgroup_name(cg), cg->nprocs, cg->mem_kib / 1024, cg->swap_kib / 1024);
+    if (args->kill_process_prehook) {
+        kill_process_prehook(args, &victim);
+    }
+    if (args->dryrun) {
+        warn("dryrun, not actually sending any signal\n");
+        notify_process_killed(args, &victim);
+        return 0;
+    }
+
+    // -1 is fine, then poll() only sleeps
+    int events_fd = cgroup_events_open(cg->dir);
+    const int check_ms = args->kill_check_ms > 0 ? args->kill_check_ms : KILL_CHECK_MS_DEFAULT;
+    meminfo_t before = parse_meminfo();
+    struct timespec t0 = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int err = 0;
+    bool atomic = false;
+    int res = cgroup_signal(cg->dir, sig, &atomic);
+    if (res < 0) {
+        err = -res;
+        warn("kill failed: %s\n", strerror(err));
+        goto out;
+    }
+    // A cgroup that is gone is empty
+    while (cgroup_populated(cg->dir) > 0) {
+        long long elapsed_ms = elapsed_us(&t0) / 1000;
+        if (elapsed_ms >= KILL_WAIT_TIMEOUT_MS) {
+            warn("cgroup %s is still populated after %lld ms\n", cgroup_name(cg), elapsed_ms);
+            err = ETIME;
+            goto out;
+        }
+        if (sig != SIGKILL && at_sigkill_limits(args)) {
+            sig = SIGKILL;
+            warn("escalating to SIGKILL after %.3f seconds\n", (float)elapsed_ms / 1000);
+            cgroup_signal(cg->dir, sig, &atomic);
+        } else if (sig == SIGKILL && !atomic) {
+            // Get the processes that have been forked in the meantime
+            cgroup_signal(cg->dir, sig, &atomic);
+        }
+        struct pollfd pfd = { .fd = events_fd, .events = POLLPRI };
+        if (poll(&pfd, 1, check_ms) < 0 && errno != EINTR) {
+            warn("%s: poll: %s\n", __func__, strerror(errno));
+        }
+    }
+    long long us = elapsed_us(&t0);
+    // What the cgroup still holds, like page cache. Nothing if it has been removed.
+    long long mem_kib = 0, swap_kib = 0;
+    cgroup_read_kib(cg->dir, "memory.current", &mem_kib);
+    cgroup_read_kib(cg->dir, "memory.swap.current", &swap_kib);
+    meminfo_t after = parse_meminfo();
+    warn("cgroup %s is empty after %lld.%06lld seconds, freed memory %lld MiB, swap %lld MiB, mem avail %+lld MiB\n",
+        cgroup_name(cg), us / 1000000, us % 1000000, (cg->mem_kib - mem_kib) / 1024, (cg->swap_kib - swap_kib) / 1024,
+        (after.MemAvailableKiB - before.MemAvailableKiB) / 1024);
+
+out:
+    if (events_fd >= 0) {
+        close(events_fd);
+    }
+    notify_process_killed(args, &victim);
+    if (err != 0 && args->notify) {
+        notify_dbus("Error: Failed to kill cgroup");
     }
+    return err;
 }
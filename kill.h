@@ -5,6 +5,7 @@
 #include <regex.h>
 #include <stdbool.h>
 
+#include "cgroup.h"
 #include "meminfo.h"
 
 typedef struct {
@@ -37,11 +38,88 @@ typedef struct {
     bool dryrun;
     /* Flag --kernel-oom was passed, use kernel oom killer via /proc/sysrq-trigger */
     bool kernel_oom;
+    /* number of threads for finding the victim. <= 1 = scan on the main thread */
+    int scan_threads;
+    /* pre-rank the processes when memory is getting low, see prerank_step() */
+    bool prerank;
+    /* number of candidates to remember from a scan, see next_candidate() */
+    int candidates;
+    /* after sending SIGTERM, check for SIGKILL escalation every this many milliseconds.
+     * 0 = KILL_CHECK_MS_DEFAULT */
+    int kill_check_ms;
+    /* PSI trigger to wait on in poll_loop (or NULL), like "some 150000 1000000" */
+    char* psi_trigger;
+    /* plan sleep times with this percentage of the measured fill rate.
+     * 0 = assume fixed worst-case rates */
+    int fill_rate_margin_percent;
+    /* send SIGTERM when the SIGTERM limits are projected to be reached
+     * within this many milliseconds. 0 = off */
+    int predict_ms;
+    /* compute oom_score in userspace and only read it for the largest processes */
+    bool estimate_oom_score;
+    /* stop looking for the victim after this many milliseconds and take the
+     * largest process found so far. 0 = no limit */
+    int scan_budget_ms;
+    /* check memory on a separate thread, see monitor_loop() */
+    bool monitor_thread;
+    /* look for the next victim while the last one exits, see kill_wait() */
+    bool pipeline;
+    /* kill as many processes at once as are needed to get this many percent
+     * above the SIGTERM limits, see kill_batch(). 0 = one at a time */
+    int batch_kill_percent;
+    /* kill the heaviest leaf cgroup below this cgroup v2 directory as a whole
+     * instead of single processes, see kill_cgroup(). NULL = off */
+    char* cgroup_root;
+    /* skip or avoid processes and cgroups based on the oomd xattrs and the
+     * memory.min/low protection of their cgroup, see cgroup_hints_get() */
+    bool cgroup_hints;
 } poll_loop_args_t;
 
-void kill_process(const poll_loop_args_t* args, int sig, const procinfo_t* victim);
+#define KILL_CHECK_MS_DEFAULT 100
+// Upper limit for --kill-check-interval
+#define KILL_CHECK_MS_MAX 1000
+// Upper limit for the sleep between memory checks with --psi-trigger
+#define PSI_MAX_SLEEP_MS 10000
+// Upper limit for --fill-rate-margin
+#define FILL_RATE_MARGIN_MAX 1000
+// Range for --predict
+#define PREDICT_MS_MIN 100
+#define PREDICT_MS_MAX 60000
+// Upper limit for --scan-budget
+#define SCAN_BUDGET_MS_MAX 10000
+// Give up waiting for the victim to exit after this long
+#define KILL_WAIT_TIMEOUT_MS 10000
+
+// With --pipeline, kill the next victim if the last one has not exited
+// this long after SIGKILL and memory is still low
+#define KILL_PIPELINE_DEADLINE_MS 1000
+
+// Time budget for each prerank_step() call
+#define PRERANK_STEP_US 10000
+// A ranking (--prerank, --candidates) older than this is not used
+#define RANKING_MAX_AGE_MS 2000
+// Upper limit for --candidates
+#define CANDIDATES_MAX 32
+// --candidates for --batch-kill, unless given
+#define BATCH_KILL_CANDIDATES_DEFAULT 8
+// Upper limit for --batch-kill
+#define BATCH_KILL_PERCENT_MAX 50
+
+int kill_process(const poll_loop_args_t* args, int sig, const procinfo_t* victim);
+int batch_select(const poll_loop_args_t* args, const meminfo_t* m, const procinfo_t* first, procinfo_t* batch);
+int kill_batch(const poll_loop_args_t* args, int sig, const meminfo_t* m, const procinfo_t* first);
+int kill_cgroup(const poll_loop_args_t* args, int sig, const cgroup_info_t* cg);
+int procinfo_pidfd(const procinfo_t* p);
+void procinfo_close(procinfo_t* p);
 procinfo_t find_largest_process(const poll_loop_args_t* args);
+procinfo_t find_largest_process_in(const poll_loop_args_t* args, const char* dir);
+unsigned scan_budget_hits(void);
+bool next_candidate(const poll_loop_args_t* args, procinfo_t* victim);
 bool is_larger(const poll_loop_args_t* args, const procinfo_t* victim, procinfo_t* cur);
 int trigger_kernel_oom(const poll_loop_args_t* args);
+void prerank_reset(void);
+void prerank_step(const poll_loop_args_t* args, long long budget_us);
+bool prerank_ready(void);
+bool prerank_victim(const poll_loop_args_t* args, procinfo_t* victim);
 
 #endif
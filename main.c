@@ -5,6 +5,8 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,10 +18,19 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "cgroup.h"
+#include "cgroup_watch.h"
+#include "fill_rate.h"
 #include "globals.h"
 #include "kill.h"
 #include "meminfo.h"
+#include "monitor.h"
 #include "msg.h"
+#include "oom_score.h"
+#include "proc_events.h"
+#include "procfs_uring.h"
+#include "psi.h"
+#include "scan_pool.h"
 
 /* Don't fail compilation if the user has an old glibc that
  * does not define MCL_ONFAULT. The kernel may still be recent
@@ -44,10 +55,28 @@ enum {
     LONG_OPT_USE_SYSLOG,
     LONG_OPT_SORT_BY_RSS,
     LONG_OPT_USE_KERNEL_OOM,
+    LONG_OPT_SCAN_THREADS,
+    LONG_OPT_PRERANK,
+    LONG_OPT_CANDIDATES,
+    LONG_OPT_PROC_EVENTS,
+    LONG_OPT_KILL_CHECK_INTERVAL,
+    LONG_OPT_PSI_TRIGGER,
+    LONG_OPT_FILL_RATE_MARGIN,
+    LONG_OPT_PREDICT,
+    LONG_OPT_IO_URING,
+    LONG_OPT_ESTIMATE_OOM_SCORE,
+    LONG_OPT_SCAN_BUDGET,
+    LONG_OPT_MONITOR_THREAD,
+    LONG_OPT_PIPELINE,
+    LONG_OPT_BATCH_KILL,
+    LONG_OPT_CGROUP_KILL,
+    LONG_OPT_CGROUP_HINTS,
+    LONG_OPT_CGROUP_LIMIT,
 };
 
 static int set_oom_score_adj(int);
 static void poll_loop(const poll_loop_args_t* args);
+static int monitor_thread_start(const poll_loop_args_t* args);
 
 extern int trigger_kernel_oom(const poll_loop_args_t* args);
 
@@ -83,6 +112,16 @@ static void startup_selftests(poll_loop_args_t* args)
         debug("%s: dry-running oom kill...\n", __func__);
         procinfo_t victim = find_largest_process(args);
         kill_process(args, 0, &victim);
+        procinfo_close(&victim);
+    }
+    if (args->cgroup_root) {
+        cgroup_info_t cg;
+        int res = cgroup_find_largest(args->cgroup_root, args->cgroup_hints, &cg);
+        if (res < 0) {
+            warn("%s: --cgroup-kill: no cgroup to kill below %s: %s\n", __func__, args->cgroup_root, strerror(-res));
+        } else {
+            debug("%s: --cgroup-kill: would kill cgroup %s\n", __func__, cgroup_name(&cg));
+        }
     }
     if (args->notify_ext) {
         if (args->notify_ext[0] != '/') {
@@ -157,6 +196,8 @@ int main(int argc, char* argv[])
         /* omitted fields are set to zero */
     };
     int set_my_priority = 0;
+    bool use_proc_events = false;
+    bool use_io_uring = false;
     char* prefer_cmds = NULL;
     char* avoid_cmds = NULL;
     char* ignore_cmds = NULL;
@@ -199,6 +240,23 @@ int main(int argc, char* argv[])
         { "sort-by-rss", no_argument, NULL, LONG_OPT_SORT_BY_RSS },
         { "syslog", no_argument, NULL, LONG_OPT_USE_SYSLOG },
         { "kernel-oom", no_argument, NULL, LONG_OPT_USE_KERNEL_OOM },
+        { "scan-threads", required_argument, NULL, LONG_OPT_SCAN_THREADS },
+        { "prerank", no_argument, NULL, LONG_OPT_PRERANK },
+        { "candidates", required_argument, NULL, LONG_OPT_CANDIDATES },
+        { "proc-events", no_argument, NULL, LONG_OPT_PROC_EVENTS },
+        { "io-uring", no_argument, NULL, LONG_OPT_IO_URING },
+        { "estimate-oom-score", no_argument, NULL, LONG_OPT_ESTIMATE_OOM_SCORE },
+        { "scan-budget", required_argument, NULL, LONG_OPT_SCAN_BUDGET },
+        { "monitor-thread", no_argument, NULL, LONG_OPT_MONITOR_THREAD },
+        { "pipeline", no_argument, NULL, LONG_OPT_PIPELINE },
+        { "batch-kill", required_argument, NULL, LONG_OPT_BATCH_KILL },
+        { "cgroup-kill", required_argument, NULL, LONG_OPT_CGROUP_KILL },
+        { "cgroup-hints", no_argument, NULL, LONG_OPT_CGROUP_HINTS },
+        { "cgroup-limit", required_argument, NULL, LONG_OPT_CGROUP_LIMIT },
+        { "kill-check-interval", required_argument, NULL, LONG_OPT_KILL_CHECK_INTERVAL },
+        { "fill-rate-margin", required_argument, NULL, LONG_OPT_FILL_RATE_MARGIN },
+        { "predict", required_argument, NULL, LONG_OPT_PREDICT },
+        { "psi-trigger", required_argument, NULL, LONG_OPT_PSI_TRIGGER },
         { "help", no_argument, NULL, 'h' },
         { "debug", no_argument, NULL, 'd' },
         { 0, 0, NULL, 0 } /* end-of-array marker */
@@ -319,6 +377,132 @@ int main(int argc, char* argv[])
         case LONG_OPT_IGNORE:
             ignore_cmds = optarg;
             break;
+        case LONG_OPT_PRERANK:
+            args.prerank = true;
+            fprintf(stderr, "Pre-ranking processes when memory is at or below twice the SIGTERM limits\n");
+            break;
+        case LONG_OPT_PROC_EVENTS:
+            use_proc_events = true;
+            break;
+        case LONG_OPT_IO_URING:
+            use_io_uring = true;
+            break;
+        case LONG_OPT_ESTIMATE_OOM_SCORE:
+            args.estimate_oom_score = true;
+            break;
+        case LONG_OPT_PSI_TRIGGER:
+            args.psi_trigger = optarg;
+            break;
+        case LONG_OPT_KILL_CHECK_INTERVAL: {
+            char* end = NULL;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == 0 || *end != 0 || n < 1 || n > KILL_CHECK_MS_MAX) {
+                fatal(14, "--kill-check-interval: must be a number between 1 and %d, got '%s'\n", KILL_CHECK_MS_MAX, optarg);
+            }
+            args.kill_check_ms = (int)n;
+            break;
+        }
+        case LONG_OPT_FILL_RATE_MARGIN: {
+            char* end = NULL;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == 0 || *end != 0 || n < 100 || n > FILL_RATE_MARGIN_MAX) {
+                fatal(14, "--fill-rate-margin: must be a number between 100 and %d, got '%s'\n", FILL_RATE_MARGIN_MAX, optarg);
+            }
+            args.fill_rate_margin_percent = (int)n;
+            fprintf(stderr, "Planning sleep times with %ld%% of the measured memory fill rate\n", n);
+            break;
+        }
+        case LONG_OPT_PREDICT: {
+            char* end = NULL;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == 0 || *end != 0 || n < PREDICT_MS_MIN || n > PREDICT_MS_MAX) {
+                fatal(14, "--predict: must be a number between %d and %d, got '%s'\n", PREDICT_MS_MIN, PREDICT_MS_MAX, optarg);
+            }
+            args.predict_ms = (int)n;
+            fprintf(stderr, "Sending SIGTERM when memory is projected to reach the SIGTERM limits within %ld ms\n", n);
+            break;
+        }
+        case LONG_OPT_CANDIDATES: {
+            char* end = NULL;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == 0 || *end != 0 || n < 1 || n > CANDIDATES_MAX) {
+                fatal(14, "--candidates: must be a number between 1 and %d, got '%s'\n", CANDIDATES_MAX, optarg);
+            }
+            args.candidates = (int)n;
+            break;
+        }
+        case LONG_OPT_BATCH_KILL: {
+            char* end = NULL;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == 0 || *end != 0 || n < 1 || n > BATCH_KILL_PERCENT_MAX) {
+                fatal(14, "--batch-kill: must be a number between 1 and %d, got '%s'\n", BATCH_KILL_PERCENT_MAX, optarg);
+            }
+            args.batch_kill_percent = (int)n;
+            break;
+        }
+        case LONG_OPT_CGROUP_KILL: {
+            int res = cgroup_check_root(optarg);
+            if (res < 0) {
+                fatal(14, "--cgroup-kill: '%s' is not a cgroup v2 directory: %s\n", optarg, strerror(-res));
+            }
+            args.cgroup_root = optarg;
+            fprintf(stderr, "Killing whole cgroups below %s\n", optarg);
+            break;
+        }
+        case LONG_OPT_CGROUP_HINTS:
+            args.cgroup_hints = true;
+            break;
+        case LONG_OPT_CGROUP_LIMIT: {
+            // DIR=PERCENT[,KILL_PERCENT]. The directory may contain "=".
+            char dir[PATH_MAX] = { 0 };
+            snprintf(dir, sizeof(dir), "%s", optarg);
+            char* eq = strrchr(dir, '=');
+            if (eq == NULL) {
+                fatal(14, "--cgroup-limit: expected DIR=PERCENT[,KILL_PERCENT], got '%s'\n", optarg);
+            }
+            *eq = 0;
+            tuple = parse_term_kill_tuple(eq + 1, 99);
+            if (strlen(tuple.err)) {
+                fatal(14, "--cgroup-limit: %s\n", tuple.err);
+            }
+            int res = cgroup_check_root(dir);
+            if (res < 0) {
+                fatal(14, "--cgroup-limit: '%s' is not a cgroup v2 directory: %s\n", dir, strerror(-res));
+            }
+            res = cgroup_watch_add(dir, tuple.term, tuple.kill);
+            if (res < 0) {
+                fatal(14, "--cgroup-limit: cannot watch '%s': %s\n", dir, strerror(-res));
+            }
+            fprintf(stderr, "Watching cgroup %s: SIGTERM when mem avail <= " PRIPCT ", SIGKILL when <= " PRIPCT " of its limit\n",
+                dir, tuple.term, tuple.kill);
+            break;
+        }
+        case LONG_OPT_SCAN_BUDGET: {
+            char* end = NULL;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == 0 || *end != 0 || n < 1 || n > SCAN_BUDGET_MS_MAX) {
+                fatal(14, "--scan-budget: must be a number between 1 and %d, got '%s'\n", SCAN_BUDGET_MS_MAX, optarg);
+            }
+            args.scan_budget_ms = (int)n;
+            fprintf(stderr, "Taking the largest process found within %ld ms\n", n);
+            break;
+        }
+        case LONG_OPT_MONITOR_THREAD:
+            args.monitor_thread = true;
+            break;
+        case LONG_OPT_PIPELINE:
+            args.pipeline = true;
+            fprintf(stderr, "Looking for the next victim while the last one exits\n");
+            break;
+        case LONG_OPT_SCAN_THREADS: {
+            char* end = NULL;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == 0 || *end != 0 || n < 1 || n > SCAN_THREADS_MAX) {
+                fatal(14, "--scan-threads: must be a number between 1 and %d, got '%s'\n", SCAN_THREADS_MAX, optarg);
+            }
+            args.scan_threads = (int)n;
+            break;
+        }
         case 'h':
             fprintf(stderr,
                 "Usage: %s [OPTION]...\n"
@@ -352,6 +536,50 @@ int main(int argc, char* argv[])
                 "  --kernel-oom              use kernel OOM killer via /proc/sysrq-trigger\n"
                 "                            instead of killing processes directly. Requires\n"
                 "                            Linux v5.17+ and root to work correctly.\n"
+                "  --scan-threads N          use N threads to find the victim (default 1)\n"
+                "  --scan-budget MS          stop looking for the victim after MS milliseconds\n"
+                "                            and take the largest process found so far\n"
+                "  --candidates K            remember the K largest processes of a scan and fall\n"
+                "                            back to the next one if killing fails (default 1)\n"
+                "  --psi-trigger TRIGGER     wake up when memory pressure reaches TRIGGER, for\n"
+                "                            example \"some 150000 2000000\", and sleep longer\n"
+                "                            otherwise. Requires Linux v5.2+\n"
+                "  --fill-rate-margin PERCENT\n"
+                "                            plan the sleep between memory checks with PERCENT\n"
+                "                            of the measured memory fill rate (at least 100)\n"
+                "                            instead of fixed worst-case rates\n"
+                "  --predict MS              send SIGTERM already when memory is projected to\n"
+                "                            reach the SIGTERM limits within MS milliseconds\n"
+                "  --kill-check-interval MS  while waiting for the victim to exit, check if we\n"
+                "                            have to escalate to SIGKILL every MS milliseconds\n"
+                "                            (default 100)\n"
+                "  --proc-events             track processes using the kernel proc connector\n"
+                "                            instead of listing /proc. Requires CAP_NET_ADMIN.\n"
+                "  --io-uring                read /proc in batches using io_uring when looking\n"
+                "                            for the victim. Requires Linux v5.19+\n"
+                "  --estimate-oom-score      compute oom_score from rss and oom_score_adj and\n"
+                "                            only read it from the kernel for the processes that\n"
+                "                            can be the victim\n"
+                "  --prerank                 find the victim in the background as memory gets\n"
+                "                            low, so it is ready when we have to kill\n"
+                "  --monitor-thread          keep checking memory on a separate thread while\n"
+                "                            killing, and kill the next process if the victim\n"
+                "                            does not exit in time\n"
+                "  --pipeline                look for the next victim while the last one is\n"
+                "                            exiting, and kill it right away if memory is\n"
+                "                            still at the SIGKILL limits\n"
+                "  --batch-kill PERCENT      kill as many of the largest processes at once as\n"
+                "                            are needed to get PERCENT above the SIGTERM limits\n"
+                "  --cgroup-kill ROOT        kill the leaf cgroup below the cgroup v2 directory\n"
+                "                            ROOT that uses the most memory and swap as a whole,\n"
+                "                            instead of single processes\n"
+                "  --cgroup-hints            do not kill cgroups marked with user.oomd_omit or\n"
+                "                            within memory.min, and avoid the ones marked with\n"
+                "                            user.oomd_avoid or within memory.low\n"
+                "  --cgroup-limit DIR=PERCENT[,KILL_PERCENT]\n"
+                "                            kill in cgroup DIR when less than PERCENT of its\n"
+                "                            memory.max or memory.high is available. Can be\n"
+                "                            given many times\n"
                 "  -h, --help                this help text\n",
                 argv[0]);
             exit(0);
@@ -429,6 +657,79 @@ int main(int argc, char* argv[])
         }
     }
 
+    if (use_proc_events) {
+        int res = proc_events_open();
+        if (res < 0) {
+            warn("Could not subscribe to process events: %s. Listing /proc instead\n", strerror(-res));
+        } else {
+            fprintf(stderr, "Tracking processes using the proc connector\n");
+        }
+    }
+    if (use_io_uring) {
+        int res = procfs_uring_open();
+        if (res < 0) {
+            warn("Could not set up io_uring: %s. Reading /proc synchronously\n", strerror(-res));
+        } else {
+            fprintf(stderr, "Reading /proc using io_uring\n");
+        }
+    }
+
+    if (args.estimate_oom_score) {
+        if (args.sort_by_rss || args.scan_threads > 1) {
+            warn("--estimate-oom-score has no effect with --sort-by-rss or --scan-threads\n");
+            args.estimate_oom_score = false;
+        } else {
+            int res = oom_score_selftest();
+            if (res < 0) {
+                warn("Cannot compute oom_score like this kernel: %s. Reading it for every process\n", strerror(-res));
+                args.estimate_oom_score = false;
+            } else {
+                fprintf(stderr, "Estimating oom_score, reading it only for the largest processes\n");
+            }
+        }
+    }
+
+    if (args.batch_kill_percent) {
+        if (args.kill_process_group) {
+            warn("--batch-kill has no effect with -g\n");
+            args.batch_kill_percent = 0;
+        } else {
+            // The batch is taken from the candidates of the scan
+            if (args.candidates == 0) {
+                args.candidates = BATCH_KILL_CANDIDATES_DEFAULT;
+            }
+            fprintf(stderr, "Killing up to %d processes at once to get %d%% above the SIGTERM limits\n",
+                args.candidates, args.batch_kill_percent);
+        }
+    }
+    if (args.cgroup_root && (args.kill_process_group || args.batch_kill_percent)) {
+        warn("-g and --batch-kill have no effect with --cgroup-kill\n");
+    }
+    if (args.cgroup_hints) {
+        // With --cgroup-kill, the cgroups are looked at from its root
+        char mount[PATH_MAX] = { 0 };
+        int res = 0;
+        if (args.cgroup_root) {
+            snprintf(mount, sizeof(mount), "%s", args.cgroup_root);
+        } else {
+            res = cgroup_find_mount(mount, sizeof(mount));
+        }
+        if (res < 0) {
+            warn("Could not find the cgroup v2 hierarchy: %s. Ignoring --cgroup-hints\n", strerror(-res));
+            args.cgroup_hints = false;
+        } else {
+            cgroup_hints_init(mount);
+            fprintf(stderr, "Honoring the oomd xattrs and memory.min/low of the cgroups in %s\n", mount);
+        }
+    }
+    if (args.monitor_thread) {
+        int res = monitor_open();
+        if (res < 0) {
+            warn("Could not set up the monitor thread: %s. Checking memory between kills only\n", strerror(-res));
+            args.monitor_thread = false;
+        }
+    }
+
     startup_selftests(&args);
 
     // Print memory limits
@@ -453,6 +754,23 @@ int main(int argc, char* argv[])
         perror("Could not lock memory - continuing anyway");
     }
 
+    // Start the scan threads after mlockall() so their stacks are locked too
+    if (args.scan_threads > 1) {
+        int res = scan_pool_init(args.scan_threads);
+        if (res < 0) {
+            fatal(1, "could not start %d scan threads: %s\n", args.scan_threads, strerror(-res));
+        }
+        fprintf(stderr, "using %d threads to find the victim\n", args.scan_threads);
+    }
+    if (args.monitor_thread) {
+        // Before the thread prints its first memory report
+        fprintf(stderr, "Checking memory on a separate thread\n");
+        int res = monitor_thread_start(&args);
+        if (res < 0) {
+            fatal(1, "could not start the monitor thread: %s\n", strerror(-res));
+        }
+    }
+
     // Jump into main poll loop
     poll_loop(&args);
     return 0;
@@ -484,29 +802,75 @@ static int set_oom_score_adj(int oom_score_adj)
     return 0;
 }
 
+/* headroom_kib calculates how much memory and swap can still be used
+ * before we reach the SIGTERM limits.
+ */
+static void headroom_kib(const poll_loop_args_t* args, const meminfo_t* m, long long* mem_kib, long long* swap_kib)
+{
+    *mem_kib = (long long)((m->MemAvailablePercent - args->mem_term_percent) * (double)m->UserMemTotalKiB / 100);
+    if (*mem_kib < 0) {
+        *mem_kib = 0;
+    }
+    *swap_kib = (long long)((m->SwapFreePercent - args->swap_term_percent) * (double)m->SwapTotalKiB / 100);
+    if (*swap_kib < 0) {
+        *swap_kib = 0;
+    }
+}
+
 /* Calculate the time we should sleep based upon how far away from the memory and swap
- * limits we are (headroom). Returns a millisecond value between 100 and 1000 (inclusive).
+ * limits we are (headroom). Returns a millisecond value between 100 and max_sleep (inclusive).
  * The idea is simple: if memory and swap can only fill up so fast, we know how long we can sleep
  * without risking to miss a low memory event.
+ * With --fill-rate-margin, how fast they fill up is measured (see fill_rate.c) instead of assumed.
+ * max_sleep = 0 means 1 second, or FILL_RATE_MAX_SLEEP_MS when we plan with a measured rate.
  */
-static unsigned sleep_time_ms(const poll_loop_args_t* args, const meminfo_t* m)
+static unsigned sleep_time_ms(const poll_loop_args_t* args, const meminfo_t* m, const fill_rate_t* fr, unsigned max_sleep)
 {
     // Maximum expected memory/swap fill rate. In kiB per millisecond ==~ MiB per second.
-    const long long mem_fill_rate = 6000; // 6000MiB/s seen with "stress -m 4 --vm-bytes 4G"
-    const long long swap_fill_rate = 800; //  800MiB/s seen with membomb on ZRAM
+    const double mem_fill_rate_max = 6000; // 6000MiB/s seen with "stress -m 4 --vm-bytes 4G"
+    const double swap_fill_rate_max = 800; //  800MiB/s seen with membomb on ZRAM
     // Clamp calculated value to this range (milliseconds)
     const unsigned min_sleep = 100;
-    const unsigned max_sleep = 1000;
 
-    long long mem_headroom_kib = (long long)((m->MemAvailablePercent - args->mem_term_percent) * (double)m->UserMemTotalKiB / 100);
-    if (mem_headroom_kib < 0) {
-        mem_headroom_kib = 0;
+    long long mem_headroom_kib, swap_headroom_kib;
+    headroom_kib(args, m, &mem_headroom_kib, &swap_headroom_kib);
+    double mem_fill_rate = mem_fill_rate_max;
+    double swap_fill_rate = swap_fill_rate_max;
+    unsigned default_max_sleep = 1000;
+    bool measured = false;
+    fill_rate_estimate_t est;
+    if (fill_rate_estimate(fr, args->fill_rate_margin_percent ? args->fill_rate_margin_percent : 100, &est)) {
+        if (enable_debug) {
+            long long fixed_ms = (long long)((double)mem_headroom_kib / mem_fill_rate_max + (double)swap_headroom_kib / swap_fill_rate_max);
+            long long measured_ms = (long long)((double)mem_headroom_kib / est.mem_rate + (double)swap_headroom_kib / est.swap_rate);
+            debug("fill rate MiB/s: mem %.0f (avg %.0f, max %.0f), swap %.0f (avg %.0f, max %.0f). "
+                  "headroom lasts %lld ms (%lld ms at fixed rates)\n",
+                est.mem_rate, est.mem_ewma, est.mem_max, est.swap_rate, est.swap_ewma, est.swap_max,
+                measured_ms, fixed_ms);
+        }
+        if (args->fill_rate_margin_percent) {
+            mem_fill_rate = est.mem_rate;
+            swap_fill_rate = est.swap_rate;
+            measured = true;
+            // A slowly filling box may sleep longer than with the fixed rates
+            default_max_sleep = FILL_RATE_MAX_SLEEP_MS;
+        }
     }
-    long long swap_headroom_kib = (long long)((m->SwapFreePercent - args->swap_term_percent) * (double)m->SwapTotalKiB / 100);
-    if (swap_headroom_kib < 0) {
-        swap_headroom_kib = 0;
+    if (max_sleep == 0) {
+        max_sleep = default_max_sleep;
+    }
+    long long ms = (long long)((double)mem_headroom_kib / mem_fill_rate + (double)swap_headroom_kib / swap_fill_rate);
+    if (measured && ms > 1000) {
+        // See FILL_RATE_LONG_SLEEP_DIVISOR
+        long long long_ms = 1000;
+        if (fr->n_samples >= FILL_RATE_HISTORY) {
+            double mem_floor = mem_fill_rate_max / FILL_RATE_LONG_SLEEP_DIVISOR;
+            double swap_floor = swap_fill_rate_max / FILL_RATE_LONG_SLEEP_DIVISOR;
+            long_ms = (long long)((double)mem_headroom_kib / (mem_fill_rate > mem_floor ? mem_fill_rate : mem_floor)
+                + (double)swap_headroom_kib / (swap_fill_rate > swap_floor ? swap_fill_rate : swap_floor));
+        }
+        ms = long_ms > 1000 ? long_ms : 1000;
     }
-    long long ms = mem_headroom_kib / mem_fill_rate + swap_headroom_kib / swap_fill_rate;
     if (ms < min_sleep) {
         return min_sleep;
     }
@@ -530,56 +894,453 @@ static int lowmem_sig(const poll_loop_args_t* args, const meminfo_t* m)
     return 0;
 }
 
+/* in_warm_band returns true if memory is at or below twice the SIGTERM
+ * limits. We are not killing anything yet, but we pre-rank the processes
+ * so the victim is ready when we have to (--prerank).
+ */
+static bool in_warm_band(const poll_loop_args_t* args, const meminfo_t* m)
+{
+    return m->MemAvailablePercent <= 2 * args->mem_term_percent && m->SwapFreePercent <= 2 * args->swap_term_percent;
+}
+
+/* sample_memory reads /proc/meminfo, feeds the fill rate and decides which
+ * signal the situation calls for.
+ */
+static monitor_sample_t sample_memory(const poll_loop_args_t* args, fill_rate_t* fr)
+{
+    monitor_sample_t s = { 0 };
+    s.m = parse_meminfo();
+    fill_rate_sample(fr, monitor_now_ms(), s.m.MemAvailableKiB, s.m.SwapFreeKiB);
+    s.sig = lowmem_sig(args, &s.m);
+    if (s.sig == 0 && args->predict_ms) {
+        long long mem_headroom_kib, swap_headroom_kib, eta_ms;
+        headroom_kib(args, &s.m, &mem_headroom_kib, &swap_headroom_kib);
+        if (fill_rate_predict(fr, mem_headroom_kib + swap_headroom_kib, args->predict_ms, &eta_ms)) {
+            s.sig = SIGTERM;
+            s.predicted = true;
+            print_mem_stats(warn, s.m);
+            warn("memory is running out fast! projected to reach the SIGTERM limits in %lld ms\n", eta_ms);
+        } else if (eta_ms >= 0) {
+            debug("projected to reach the SIGTERM limits in %lld ms\n", eta_ms);
+        }
+    }
+    s.warm = in_warm_band(args, &s.m);
+    return s;
+}
+
+static void warn_low_memory(const poll_loop_args_t* args, const monitor_sample_t* s)
+{
+    if (s->sig == SIGKILL) {
+        print_mem_stats(warn, s->m);
+        warn("low memory! at or below SIGKILL limits: mem " PRIPCT ", swap " PRIPCT "\n",
+            args->mem_kill_percent, args->swap_kill_percent);
+    } else if (s->sig == SIGTERM && !s->predicted) {
+        print_mem_stats(warn, s->m);
+        warn("low memory! at or below SIGTERM limits: mem " PRIPCT ", swap " PRIPCT "\n",
+            args->mem_term_percent, args->swap_term_percent);
+    }
+}
+
+// act_cgroup kills the heaviest leaf cgroup as a whole (--cgroup-kill)
+static void act_cgroup(const poll_loop_args_t* args, const monitor_sample_t* s)
+{
+    cgroup_info_t cg;
+    int res = cgroup_find_largest(args->cgroup_root, args->cgroup_hints, &cg);
+    if (res < 0) {
+        warn("Could not find a cgroup to kill: %s. Sleeping 1 second.\n", strerror(-res));
+        sleep(1);
+        return;
+    }
+    meminfo_t m = parse_meminfo();
+    if (!s->predicted && lowmem_sig(args, &m) == 0) {
+        warn("memory situation has recovered while selecting victim\n");
+        return;
+    }
+    if (kill_cgroup(args, s->sig, &cg) == EPERM) {
+        warn("sleeping 1 second\n");
+        sleep(1);
+    }
+}
+
+/* act selects a victim and sends it s->sig. Returns false if we have
+ * triggered the kernel OOM killer instead (--kernel-oom).
+ * `killed_last_round` tells if the last call killed a process, so the other
+ * candidates from that scan can be used (--candidates).
+ */
+static bool act(const poll_loop_args_t* args, const monitor_sample_t* s, bool* killed_last_round)
+{
+    if (args->kernel_oom) {
+        trigger_kernel_oom(args);
+        // Sleep a bit to give the kernel OOM killer time to do its work
+        struct timespec req = { .tv_sec = 0, .tv_nsec = 500 * 1000000 };
+        nanosleep(&req, NULL);
+        return false;
+    }
+    if (args->cgroup_root) {
+        act_cgroup(args, s);
+        return true;
+    }
+    procinfo_t victim;
+    // If the last kill did not free enough memory, the runner-up of
+    // the last scan may still be good enough.
+    bool have_victim = *killed_last_round && args->candidates > 1 && next_candidate(args, &victim);
+    // The ranking may also come from waiting for the last victim (--pipeline)
+    if (!have_victim && (args->prerank || args->pipeline)) {
+        have_victim = prerank_victim(args, &victim);
+    }
+    if (!have_victim) {
+        victim = find_largest_process(args);
+    }
+    /* The run time of find_largest_process is proportional to the number
+     * of processes, and takes 2.5ms on my box with a running Gnome desktop (try "make bench").
+     * This is long enough that the situation may have changed in the meantime,
+     * so we double-check if we still need to kill anything.
+     * The run time of parse_meminfo is only 6us on my box and independent of the number
+     * of processes (try "make bench").
+     */
+    meminfo_t m = parse_meminfo();
+    *killed_last_round = false;
+    // A forecast cannot be re-checked from a single sample
+    if (!s->predicted && lowmem_sig(args, &m) == 0) {
+        warn("memory situation has recovered while selecting victim\n");
+    } else {
+        *killed_last_round = true;
+        int err;
+        if (args->batch_kill_percent) {
+            err = kill_batch(args, s->sig, &m, &victim);
+        } else {
+            err = kill_process(args, s->sig, &victim);
+        }
+        // The victim may have exited in the meantime, or we may not be
+        // allowed to kill it. Move on to the next candidate right away.
+        while ((err == ESRCH || err == EPERM) && args->candidates > 1) {
+            procinfo_close(&victim);
+            if (!next_candidate(args, &victim)) {
+                break;
+            }
+            err = kill_process(args, s->sig, &victim);
+        }
+        // We found the next victim while this one was exiting (--pipeline).
+        // If that did not help enough, kill it right away instead of sleeping
+        // and scanning again. With --monitor-thread, the monitor thread
+        // decides when to move on.
+        while (args->pipeline && (err == 0 || (err == EINPROGRESS && !monitor_active()))) {
+            m = parse_meminfo();
+            if (lowmem_sig(args, &m) != SIGKILL) {
+                break;
+            }
+            procinfo_close(&victim);
+            if (!prerank_victim(args, &victim)) {
+                break;
+            }
+            print_mem_stats(warn, m);
+            warn("still at or below SIGKILL limits, killing the next process right away\n");
+            err = kill_process(args, SIGKILL, &victim);
+        }
+        // Killing the process may have failed because we are not running as root.
+        // In that case, trying again in 100ms will just yield the same error.
+        // Throttle ourselves to not spam the log.
+        if (err == EPERM) {
+            warn("sleeping 1 second\n");
+            sleep(1);
+        }
+    }
+    procinfo_close(&victim);
+    return true;
+}
+
+/* kill_in_cgroup sends `sig` to the largest process in cgroup `dir` or
+ * below (--cgroup-limit), or, with --cgroup-kill, to the heaviest leaf
+ * cgroup in there as a whole.
+ */
+static void kill_in_cgroup(const poll_loop_args_t* args, int sig, const char* dir)
+{
+    // The next victim of the whole system is of no use here
+    poll_loop_args_t local = *args;
+    local.pipeline = false;
+    if (args->cgroup_root) {
+        cgroup_info_t cg;
+        int res = cgroup_find_largest(dir, args->cgroup_hints, &cg);
+        if (res < 0) {
+            warn("Could not find a cgroup to kill in %s: %s\n", dir, strerror(-res));
+            return;
+        }
+        kill_cgroup(&local, sig, &cg);
+        return;
+    }
+    procinfo_t victim = find_largest_process_in(&local, dir);
+    if (victim.pid <= 0) {
+        warn("Could not find a process to kill in cgroup %s\n", dir);
+        return;
+    }
+    kill_process(&local, sig, &victim);
+    procinfo_close(&victim);
+}
+
+/* act_cgroup_limits checks the watched cgroups that are due (--cgroup-limit)
+ * and kills in the ones that are at or below their limits. Every cgroup is
+ * looked at only once per call, so a cgroup that stays low cannot keep us
+ * from checking the whole system.
+ */
+static void act_cgroup_limits(const poll_loop_args_t* args)
+{
+    if (!cgroup_watch_active()) {
+        return;
+    }
+    long long now_ms = monitor_now_ms();
+    cgroup_watch_drain(now_ms);
+    cgroup_watch_hit_t hit;
+    while (cgroup_watch_next(now_ms, &hit)) {
+        const cgroup_usage_t* u = &hit.usage;
+        warn("low memory in cgroup %s! mem avail: %lld of %lld MiB (" PRIPCT "), %s limit " PRIPCT "\n",
+            hit.dir, u->avail_kib / 1024, u->limit_kib / 1024, u->avail_percent,
+            hit.sig == SIGKILL ? "SIGKILL" : "SIGTERM", hit.sig == SIGKILL ? hit.kill_percent : hit.term_percent);
+        kill_in_cgroup(args, hit.sig, hit.dir);
+    }
+}
+
+static void prerank_tick(const poll_loop_args_t* args, bool warm)
+{
+    if (!args->prerank) {
+        return;
+    }
+    if (warm) {
+        prerank_step(args, PRERANK_STEP_US);
+    } else {
+        prerank_reset();
+    }
+}
+
+// Returns the fd of the PSI trigger (--psi-trigger), or -1
+static int open_psi_trigger(const poll_loop_args_t* args)
+{
+    if (!args->psi_trigger) {
+        return -1;
+    }
+    int psi_fd = psi_trigger_open(args->psi_trigger);
+    if (psi_fd < 0) {
+        warn("Could not set up PSI trigger \"%s\": %s. Using adaptive sleep instead\n",
+            args->psi_trigger, strerror(-psi_fd));
+        return -1;
+    }
+    fprintf(stderr, "Waking up on memory pressure \"%s\"\n", args->psi_trigger);
+    return psi_fd;
+}
+
+/* wait_next_sample sleeps until the next memory check: on the PSI trigger
+ * in `*psi_fd` if we have one, or for the adaptive sleep time otherwise.
+ * With `cgroup_fd` (see cgroup_watch_fd()), it also wakes up for the
+ * watched cgroups (--cgroup-limit), in the same poll().
+ * Sleeps at most `max_sleep_ms` (0 = no extra limit).
+ */
+static void wait_next_sample(const poll_loop_args_t* args, int* psi_fd, int cgroup_fd, const meminfo_t* m,
+    const fill_rate_t* fr, int* report_countdown_ms, unsigned max_sleep_ms)
+{
+    if (*psi_fd >= 0 || cgroup_fd >= 0) {
+        // Sleep until memory stalls begin or a watched cgroup needs a look.
+        // The headroom-based timeout makes sure we don't miss memory
+        // filling up without stalls.
+        unsigned max_ms = *psi_fd >= 0 ? PSI_MAX_SLEEP_MS : 0;
+        int timeout_ms = (int)sleep_time_ms(args, m, fr, max_sleep_ms ? max_sleep_ms : max_ms);
+        if ((*psi_fd >= 0 || timeout_ms > 1000) && args->report_interval_ms && *report_countdown_ms > 0
+            && *report_countdown_ms < timeout_ms) {
+            timeout_ms = *report_countdown_ms;
+        }
+        int cgroup_ms = cgroup_fd >= 0 ? cgroup_watch_timeout_ms(monitor_now_ms()) : -1;
+        if (cgroup_ms >= 0 && cgroup_ms < timeout_ms) {
+            timeout_ms = cgroup_ms;
+        }
+        struct pollfd pfds[2] = {
+            { .fd = *psi_fd, .events = POLLPRI },
+            { .fd = cgroup_fd, .events = POLLIN },
+        };
+        long long t0 = monitor_now_ms();
+        int res = poll(pfds, 2, timeout_ms);
+        int slept_ms = (int)(monitor_now_ms() - t0);
+        if (res < 0 && errno != EINTR) {
+            warn("%s: poll: %s. Sleeping 1 second.\n", __func__, strerror(errno));
+            sleep(1);
+        } else if (pfds[0].revents & POLLERR) {
+            // The monitored cgroup or the trigger is gone
+            warn("psi trigger failed: %s. Using adaptive sleep instead\n", strerror(EIO));
+            close(*psi_fd);
+            *psi_fd = -1;
+        } else if (pfds[0].revents) {
+            debug("psi trigger fired after %d ms\n", slept_ms);
+        } else if (pfds[1].revents) {
+            debug("cgroup event after %d ms\n", slept_ms);
+        } else {
+            debug("timeout after %d ms\n", slept_ms);
+        }
+        *report_countdown_ms -= slept_ms;
+        return;
+    }
+    unsigned sleep_ms = sleep_time_ms(args, m, fr, max_sleep_ms);
+    // Only the long sleeps of --fill-rate-margin would delay the report noticeably
+    if (sleep_ms > 1000 && args->report_interval_ms && *report_countdown_ms > 0 && (unsigned)*report_countdown_ms < sleep_ms) {
+        sleep_ms = (unsigned)*report_countdown_ms;
+    }
+    debug("adaptive sleep time: %d ms\n", sleep_ms);
+    struct timespec req = { .tv_sec = (time_t)(sleep_ms / 1000), .tv_nsec = (sleep_ms % 1000) * 1000000 };
+    while (nanosleep(&req, &req) == -1 && errno == EINTR)
+        ;
+    *report_countdown_ms -= (int)sleep_ms;
+}
+
+/* monitor_loop runs on the monitor thread (--monitor-thread). It checks
+ * memory all the time, also while the main thread is busy selecting and
+ * killing, and tells the main thread what to do through monitor.c.
+ */
+static void* monitor_loop(void* arg)
+{
+    const poll_loop_args_t* args = arg;
+    int report_countdown_ms = 0;
+    int psi_fd = open_psi_trigger(args);
+    fill_rate_t fill_rate = { 0 };
+    // The victim we have last seen, and how much memory + swap
+    // was available when it was killed
+    long long victim_since_ms = 0;
+    long long victim_avail_kib = 0;
+
+    while (1) {
+        monitor_sample_t s = sample_memory(args, &fill_rate);
+        monitor_publish(&s);
+        long long avail_kib = s.m.MemAvailableKiB + s.m.SwapFreeKiB;
+        monitor_victim_t v = monitor_victim();
+        if (v.pid > 0 && v.since_ms != victim_since_ms) {
+            // The old samples do not tell us where memory goes from here
+            fill_rate_trend_reset(&fill_rate);
+            victim_since_ms = v.since_ms;
+            victim_avail_kib = avail_kib;
+        }
+
+        if (s.sig && !monitor_kill_pending() && !monitor_busy()) {
+            warn_low_memory(args, &s);
+            monitor_request_kill();
+        } else if (s.sig == SIGKILL && v.pid > 0 && v.sig == SIGTERM) {
+            // Let the main thread escalate right away
+            monitor_wake();
+        } else if (s.sig == SIGKILL && v.pid > 0 && v.sig == SIGKILL && !monitor_kill_pending()
+            && monitor_now_ms() - v.since_ms >= MONITOR_PREEMPT_MS && avail_kib < victim_avail_kib) {
+            // The victim is still exiting (maybe stuck in uninterruptible
+            // sleep) while memory keeps running out. Don't wait for it.
+            warn_low_memory(args, &s);
+            warn("process %d has not exited after %lld ms and memory keeps running out\n",
+                v.pid, monitor_now_ms() - v.since_ms);
+            monitor_request_kill();
+        } else if (s.sig == 0 && s.warm && args->prerank) {
+            monitor_wake();
+        }
+        if (s.sig == 0 && args->report_interval_ms && report_countdown_ms <= 0) {
+            print_mem_stats(info, s.m);
+            report_countdown_ms = args->report_interval_ms;
+        }
+
+        // Watch the victim closely while it is exiting
+        unsigned max_sleep_ms = 0;
+        if (v.pid > 0) {
+            max_sleep_ms = (unsigned)(args->kill_check_ms ? args->kill_check_ms : KILL_CHECK_MS_DEFAULT);
+        }
+        // The watched cgroups are checked on the main thread (--cgroup-limit)
+        wait_next_sample(args, &psi_fd, -1, &s.m, &fill_rate, &report_countdown_ms, max_sleep_ms);
+    }
+    return NULL;
+}
+
+// Start monitor_loop() on its own thread. Returns 0 or -errno.
+static int monitor_thread_start(const poll_loop_args_t* args)
+{
+    pthread_attr_t attr;
+    int res = pthread_attr_init(&attr);
+    if (res != 0) {
+        return -res;
+    }
+    // The default of 8 MiB would be locked by mlockall()
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    res = pthread_create(&thread, &attr, monitor_loop, (void*)args);
+    pthread_attr_destroy(&attr);
+    return -res;
+}
+
+/* actor_loop is the main loop with --monitor-thread: it waits for the
+ * monitor thread and does the work that can block. Never returns.
+ */
+static void actor_loop(const poll_loop_args_t* args)
+{
+    bool killed_last_round = false;
+
+    while (1) {
+        // Keep the socket buffer from overflowing (--proc-events)
+        proc_events_drain();
+        if (monitor_kill_pending()) {
+            monitor_set_busy(true);
+            monitor_take_request();
+            monitor_sample_t s = monitor_sample();
+            act(args, &s, &killed_last_round);
+            monitor_set_busy(false);
+            continue;
+        }
+        monitor_sample_t s = monitor_sample();
+        if (s.sig == 0) {
+            killed_last_round = false;
+            prerank_tick(args, s.warm);
+        }
+        act_cgroup_limits(args);
+        int timeout_ms = cgroup_watch_timeout_ms(monitor_now_ms());
+        if (timeout_ms < 0 || timeout_ms > 1000) {
+            timeout_ms = 1000;
+        }
+        int res = monitor_wait(timeout_ms, cgroup_watch_fd());
+        if (res < 0) {
+            warn("%s: %s\n", __func__, strerror(-res));
+            sleep(1);
+        }
+    }
+}
+
 // poll_loop is the main event loop. Never returns.
 static void poll_loop(const poll_loop_args_t* args)
 {
+    if (args->monitor_thread) {
+        actor_loop(args);
+    }
     // Print a a memory report when this reaches zero. We start at zero so
     // we print the first report immediately.
     int report_countdown_ms = 0;
+    int psi_fd = open_psi_trigger(args);
+    // Memory and swap fill rates, measured from the samples below
+    fill_rate_t fill_rate = { 0 };
+    // We have killed a process in the last round, and the
+    // other candidates from that scan can be used (--candidates).
+    bool killed_last_round = false;
 
     while (1) {
-        meminfo_t m = parse_meminfo();
-        int sig = lowmem_sig(args, &m);
-        if (sig == SIGKILL) {
-            print_mem_stats(warn, m);
-            warn("low memory! at or below SIGKILL limits: mem " PRIPCT ", swap " PRIPCT "\n",
-                args->mem_kill_percent, args->swap_kill_percent);
-        } else if (sig == SIGTERM) {
-            print_mem_stats(warn, m);
-            warn("low memory! at or below SIGTERM limits: mem " PRIPCT ", swap " PRIPCT "\n",
-                args->mem_term_percent, args->swap_term_percent);
-        }
-        if (sig) {
-            if (args->kernel_oom) {
-                trigger_kernel_oom(args);
-                // Sleep a bit to give the kernel OOM killer time to do its work
-                struct timespec req = { .tv_sec = 0, .tv_nsec = 500 * 1000000 };
-                nanosleep(&req, NULL);
+        // Keep the socket buffer from overflowing (--proc-events)
+        proc_events_drain();
+        monitor_sample_t s = sample_memory(args, &fill_rate);
+        warn_low_memory(args, &s);
+        if (s.sig) {
+            if (!act(args, &s, &killed_last_round)) {
                 continue;
             }
-            procinfo_t victim = find_largest_process(args);
-            /* The run time of find_largest_process is proportional to the number
-             * of processes, and takes 2.5ms on my box with a running Gnome desktop (try "make bench").
-             * This is long enough that the situation may have changed in the meantime,
-             * so we double-check if we still need to kill anything.
-             * The run time of parse_meminfo is only 6us on my box and independent of the number
-             * of processes (try "make bench").
-             */
-            m = parse_meminfo();
-            if (lowmem_sig(args, &m) == 0) {
-                warn("memory situation has recovered while selecting victim\n");
-            } else {
-                kill_process(args, sig, &victim);
+            // The old samples do not tell us where memory goes from here
+            fill_rate_trend_reset(&fill_rate);
+            // The sleep time must reflect the memory the kill has freed, not the
+            // low-memory sample from before. The run time of parse_meminfo is
+            // only 6us on my box and independent of the number of processes
+            // (try "make bench").
+            s.m = parse_meminfo();
+        } else {
+            killed_last_round = false;
+            prerank_tick(args, s.warm);
+            if (args->report_interval_ms && report_countdown_ms <= 0) {
+                print_mem_stats(info, s.m);
+                report_countdown_ms = args->report_interval_ms;
             }
-        } else if (args->report_interval_ms && report_countdown_ms <= 0) {
-            print_mem_stats(info, m);
-            report_countdown_ms = args->report_interval_ms;
         }
-        unsigned sleep_ms = sleep_time_ms(args, &m);
-        debug("adaptive sleep time: %d ms\n", sleep_ms);
-        struct timespec req = { .tv_sec = (time_t)(sleep_ms / 1000), .tv_nsec = (sleep_ms % 1000) * 1000000 };
-        while (nanosleep(&req, &req) == -1 && errno == EINTR)
-            ;
-        report_countdown_ms -= (int)sleep_ms;
+        act_cgroup_limits(args);
+        wait_next_sample(args, &psi_fd, cgroup_watch_fd(), &s.m, &fill_rate, &report_countdown_ms, 0);
     }
 }
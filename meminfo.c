@@ -4,6 +4,8 @@
  * Returned values are in kiB */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stddef.h> // for size_t
 #include <stdio.h>
@@ -16,91 +18,176 @@
 #include "meminfo.h"
 #include "msg.h"
 #include "proc_pid.h"
+#include "procfs.h"
 
-/* Parse the contents of /proc/meminfo (in buf), return value of "name"
- * (example: "MemTotal:")
- * Returns -errno if the entry cannot be found. */
-static long long get_entry(const char* name, const char* buf)
+// The fields we use, in the order the kernel prints them
+enum {
+    MI_MEM_TOTAL,
+    MI_MEM_FREE,
+    MI_MEM_AVAILABLE,
+    MI_BUFFERS,
+    MI_CACHED,
+    MI_MLOCKED,
+    MI_SWAP_TOTAL,
+    MI_SWAP_FREE,
+    MI_ANON_PAGES,
+    MI_SHMEM,
+    MI_SRECLAIMABLE,
+    MI_PAGE_TABLES,
+    MI_COUNT
+};
+
+static const struct {
+    const char* name; // including the colon
+    size_t len;
+} fields[MI_COUNT] = {
+#define FIELD(s) { s, sizeof(s) - 1 }
+    [MI_MEM_TOTAL] = FIELD("MemTotal:"),
+    [MI_MEM_FREE] = FIELD("MemFree:"),
+    [MI_MEM_AVAILABLE] = FIELD("MemAvailable:"),
+    [MI_BUFFERS] = FIELD("Buffers:"),
+    [MI_CACHED] = FIELD("Cached:"),
+    [MI_MLOCKED] = FIELD("Mlocked:"),
+    [MI_SWAP_TOTAL] = FIELD("SwapTotal:"),
+    [MI_SWAP_FREE] = FIELD("SwapFree:"),
+    [MI_ANON_PAGES] = FIELD("AnonPages:"),
+    [MI_SHMEM] = FIELD("Shmem:"),
+    [MI_SRECLAIMABLE] = FIELD("SReclaimable:"),
+    [MI_PAGE_TABLES] = FIELD("PageTables:"),
+#undef FIELD
+};
+
+// Where each field started in the last buffer we parsed, or -1 if it was
+// missing. The layout only changes when a value outgrows its column.
+static int field_off[MI_COUNT];
+static bool field_off_valid;
+// The monitor thread (--monitor-thread) and the main thread both parse
+static pthread_mutex_t field_off_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Parse the number after the field name at buf[off], like "   12345 kB".
+ * Returns -ENODATA if there is none. */
+static long long parse_value(const char* buf, size_t len, size_t off)
 {
-    char* hit = strstr(buf, name);
-    if (hit == NULL) {
+    while (off < len && buf[off] == ' ') {
+        off++;
+    }
+    if (off >= len || buf[off] < '0' || buf[off] > '9') {
         return -ENODATA;
     }
-
-    errno = 0;
-    long long val = strtoll(hit + strlen(name), NULL, 10);
-    if (errno != 0) {
-        int strtoll_errno = errno;
-        warn("%s: strtol() failed: %s", __func__, strerror(errno));
-        return -strtoll_errno;
+    long long val = 0;
+    while (off < len && buf[off] >= '0' && buf[off] <= '9') {
+        val = val * 10 + (buf[off] - '0');
+        off++;
     }
     return val;
 }
 
-/* Like get_entry(), but exit if the value cannot be found */
-static long long get_entry_fatal(const char* name, const char* buf)
+// Read all fields from the offsets remembered from the last buffer.
+// Returns false if the layout has changed.
+static bool parse_known_offsets(const char* buf, size_t len, long long* kib)
+{
+    if (!field_off_valid) {
+        return false;
+    }
+    for (int i = 0; i < MI_COUNT; i++) {
+        if (field_off[i] < 0) {
+            kib[i] = -ENODATA;
+            continue;
+        }
+        size_t off = (size_t)field_off[i];
+        if (off + fields[i].len > len || memcmp(buf + off, fields[i].name, fields[i].len) != 0) {
+            return false;
+        }
+        kib[i] = parse_value(buf, len, off + fields[i].len);
+        if (kib[i] < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Go through all lines once, read the fields we want, and remember where
+// they are.
+static void parse_all_lines(const char* buf, size_t len, long long* kib)
+{
+    for (int i = 0; i < MI_COUNT; i++) {
+        kib[i] = -ENODATA;
+        field_off[i] = -1;
+    }
+    // Fields appear in table order, so we usually find the next one
+    // at the first try
+    int next = 0;
+    size_t off = 0;
+    while (off < len) {
+        const char* line = buf + off;
+        const char* eol = memchr(line, '\n', len - off);
+        size_t line_len = eol ? (size_t)(eol - line) : len - off;
+        for (int j = 0; j < MI_COUNT; j++) {
+            int i = (next + j) % MI_COUNT;
+            if (line_len >= fields[i].len && memcmp(line, fields[i].name, fields[i].len) == 0) {
+                kib[i] = parse_value(buf, off + line_len, off + fields[i].len);
+                field_off[i] = kib[i] < 0 ? -1 : (int)off;
+                next = (i + 1) % MI_COUNT;
+                break;
+            }
+        }
+        off += line_len + 1;
+    }
+    field_off_valid = true;
+}
+
+/* Return the value of field i, or exit if it cannot be found */
+static long long get_entry_fatal(const long long* kib, int i, const char* buf)
 {
-    long long val = get_entry(name, buf);
-    if (val < 0) {
+    if (kib[i] < 0) {
         warn("%s: fatal error, dumping buffer for later diagnosis:\n%s", __func__, buf);
-        fatal(104, "could not find entry '%s' in /proc/meminfo: %s\n", name, strerror((int)-val));
+        fatal(104, "could not find entry '%s' in /proc/meminfo: %s\n", fields[i].name, strerror((int)-kib[i]));
     }
-    return val;
+    return kib[i];
 }
 
 /* If the kernel does not provide MemAvailable (introduced in Linux 3.14),
  * approximate it using other data we can get */
-static long long available_guesstimate(const char* buf)
+static long long available_guesstimate(const long long* kib, const char* buf)
 {
-    long long Cached = get_entry_fatal("Cached:", buf);
-    long long MemFree = get_entry_fatal("MemFree:", buf);
-    long long Buffers = get_entry_fatal("Buffers:", buf);
-    long long Shmem = get_entry_fatal("Shmem:", buf);
+    long long Cached = get_entry_fatal(kib, MI_CACHED, buf);
+    long long MemFree = get_entry_fatal(kib, MI_MEM_FREE, buf);
+    long long Buffers = get_entry_fatal(kib, MI_BUFFERS, buf);
+    long long Shmem = get_entry_fatal(kib, MI_SHMEM, buf);
 
     return MemFree + Cached + Buffers - Shmem;
 }
 
-/* Parse /proc/meminfo.
+/* Parse the contents of /proc/meminfo in buf[0:len], which must be
+ * null-terminated.
  * This function either returns valid data or kills the process
  * with a fatal error.
  */
-meminfo_t parse_meminfo()
+meminfo_t parse_meminfo_buf(const char* buf, size_t len)
 {
-    // Note that we do not need to close static FDs that we ensure to
-    // `fopen()` maximally once.
-    static FILE* fd;
     static int guesstimate_warned = 0;
-    // On Linux 5.3, "wc -c /proc/meminfo" counts 1391 bytes.
-    // 8192 should be enough for the foreseeable future.
-    char buf[8192] = { 0 };
+    long long kib[MI_COUNT];
     meminfo_t m = { 0 };
 
-    if (fd == NULL) {
-        char buf[PATH_LEN] = { 0 };
-        snprintf(buf, sizeof(buf), "%s/%s", procdir_path, "meminfo");
-        fd = fopen(buf, "r");
-    }
-    if (fd == NULL) {
-        fatal(102, "could not open /proc/meminfo: %s\n", strerror(errno));
-    }
-    rewind(fd);
-
-    size_t len = fread(buf, 1, sizeof(buf) - 1, fd);
-    if (ferror(fd)) {
-        fatal(103, "could not read /proc/meminfo: %s\n", strerror(errno));
-    }
-    if (len == 0) {
-        fatal(103, "could not read /proc/meminfo: 0 bytes returned\n");
+    pthread_mutex_lock(&field_off_lock);
+    if (!parse_known_offsets(buf, len, kib)) {
+        parse_all_lines(buf, len, kib);
     }
+    pthread_mutex_unlock(&field_off_lock);
 
-    m.MemTotalKiB = get_entry_fatal("MemTotal:", buf);
-    m.SwapTotalKiB = get_entry_fatal("SwapTotal:", buf);
-    m.AnonPagesKiB = get_entry_fatal("AnonPages:", buf);
-    m.SwapFreeKiB = get_entry_fatal("SwapFree:", buf);
+    m.MemTotalKiB = get_entry_fatal(kib, MI_MEM_TOTAL, buf);
+    m.SwapTotalKiB = get_entry_fatal(kib, MI_SWAP_TOTAL, buf);
+    m.AnonPagesKiB = get_entry_fatal(kib, MI_ANON_PAGES, buf);
+    m.SwapFreeKiB = get_entry_fatal(kib, MI_SWAP_FREE, buf);
+    // Informational, -1 if the kernel does not provide them
+    m.ShmemKiB = kib[MI_SHMEM] < 0 ? -1 : kib[MI_SHMEM];
+    m.SReclaimableKiB = kib[MI_SRECLAIMABLE] < 0 ? -1 : kib[MI_SRECLAIMABLE];
+    m.MlockedKiB = kib[MI_MLOCKED] < 0 ? -1 : kib[MI_MLOCKED];
+    m.PageTablesKiB = kib[MI_PAGE_TABLES] < 0 ? -1 : kib[MI_PAGE_TABLES];
 
-    m.MemAvailableKiB = get_entry("MemAvailable:", buf);
+    m.MemAvailableKiB = kib[MI_MEM_AVAILABLE];
     if (m.MemAvailableKiB < 0) {
-        m.MemAvailableKiB = available_guesstimate(buf);
+        m.MemAvailableKiB = available_guesstimate(kib, buf);
         if (guesstimate_warned == 0) {
             fprintf(stderr, "Warning: Your kernel does not provide MemAvailable data (needs 3.14+)\n"
                             "         Falling back to guesstimate\n");
@@ -122,6 +209,46 @@ meminfo_t parse_meminfo()
     return m;
 }
 
+/* Parse /proc/meminfo.
+ * This function either returns valid data or kills the process
+ * with a fatal error.
+ */
+meminfo_t parse_meminfo()
+{
+    // Note that we do not need to close static FDs that we ensure to
+    // `open()` maximally once.
+    static int fd = -1;
+    // On Linux 5.3, "wc -c /proc/meminfo" counts 1391 bytes.
+    // 8192 should be enough for the foreseeable future.
+    char buf[8192];
+
+    if (fd < 0) {
+        char path[PATH_LEN] = { 0 };
+        snprintf(path, sizeof(path), "%s/%s", procdir_path, "meminfo");
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        fatal(102, "could not open /proc/meminfo: %s\n", strerror(errno));
+    }
+
+    // The kernel generates the whole file in one go when we read from
+    // offset 0. Reading on from where we stopped would generate it again.
+    ssize_t res;
+    do {
+        res = pread(fd, buf, sizeof(buf) - 1, 0);
+    } while (res < 0 && errno == EINTR);
+    if (res < 0) {
+        fatal(103, "could not read /proc/meminfo: %s\n", strerror(errno));
+    }
+    if (res == 0) {
+        fatal(103, "could not read /proc/meminfo: 0 bytes returned\n");
+    }
+    size_t len = (size_t)res;
+    buf[len] = 0;
+
+    return parse_meminfo_buf(buf, len);
+}
+
 bool is_alive(int pid)
 {
     // whole process group (-g flag)?
@@ -155,17 +282,18 @@ bool is_alive(int pid)
  */
 static int read_proc_file_integer(const int pid, const char* name, int* out)
 {
-    char path[PATH_LEN] = { 0 };
-    snprintf(path, sizeof(path), "%s/%d/%s", procdir_path, pid, name);
-    FILE* f = fopen(path, "r");
-    if (f == NULL) {
-        return -errno;
-    }
-    int matches = fscanf(f, "%d", out);
-    fclose(f);
-    if (matches != 1) {
+    // oom_score_adj is "-1000\n" at most
+    char buf[32];
+    ssize_t n = procfs_read_pid_file(pid, name, buf, sizeof(buf));
+    if (n < 0) {
+        return (int)n;
+    }
+    char* endptr = NULL;
+    long val = strtol(buf, &endptr, 10);
+    if (endptr == buf) {
         return -ENODATA;
     }
+    *out = (int)val;
     return 0;
 }
 
@@ -198,20 +326,10 @@ int get_oom_score_adj(const int pid, int* out)
  */
 int get_comm(int pid, char* out, size_t outlen)
 {
-    char path[PATH_LEN] = { 0 };
-    snprintf(path, sizeof(path), "%s/%d/comm", procdir_path, pid);
-    FILE* f = fopen(path, "r");
-    if (f == NULL) {
-        return -errno;
-    }
-    size_t n = fread(out, 1, outlen - 1, f);
-    if (ferror(f)) {
-        int fread_errno = errno;
-        perror("get_comm: fread() failed");
-        fclose(f);
-        return -fread_errno;
-    }
-    fclose(f);
+    ssize_t n = procfs_read_pid_file(pid, "comm", out, outlen);
+    if (n < 0) {
+        return (int)n;
+    }
     // Process name may be empty, but we should get at least a newline
     // Example for empty process name: perl -MPOSIX -e '$0=""; pause'
     if (n < 1) {
@@ -229,22 +347,16 @@ int get_comm(int pid, char* out, size_t outlen)
  */
 int get_cmdline(int pid, char* out, size_t outlen)
 {
-    char path[PATH_LEN] = { 0 };
-    snprintf(path, sizeof(path), "%s/%d/cmdline", procdir_path, pid);
-    FILE* f = fopen(path, "r");
-    if (f == NULL) {
-        return -errno;
-    }
-    size_t n = fread(out, 1, outlen - 1, f);
-    if (ferror(f)) {
-        int fread_errno = errno;
-        perror("get_cmdline: fread() failed");
-        fclose(f);
-        return -fread_errno;
-    }
-    fclose(f);
+    ssize_t n = procfs_read_pid_file(pid, "cmdline", out, outlen);
+    if (n < 0) {
+        return (int)n;
+    }
+    // Kernel threads have an empty cmdline
+    if (n == 0) {
+        return 0;
+    }
     /* replace null character with space */
-    for (size_t i = 0; i < n; i++) {
+    for (ssize_t i = 0; i < n; i++) {
         if (out[i] == '\0') {
             out[i] = ' ';
         }
@@ -255,20 +367,85 @@ int get_cmdline(int pid, char* out, size_t outlen)
     return 0;
 }
 
+/* Read the cgroup v2 path of `pid` from /proc/[pid]/cgroup, the "0::" line,
+ * like "/user.slice/user-1000.slice/session-2.scope".
+ * Returns 0 on success and -errno on error. -ENODATA means that the process
+ * is not in a cgroup v2 hierarchy.
+ */
+int get_cgroup(int pid, char* out, size_t outlen)
+{
+    // Hybrid setups list every v1 hierarchy first
+    char buf[2048];
+    ssize_t n = procfs_read_pid_file(pid, "cgroup", buf, sizeof(buf));
+    if (n < 0) {
+        return (int)n;
+    }
+    const char* p = buf;
+    if (strncmp(p, "0::", 3) != 0) {
+        p = strstr(buf, "\n0::");
+        if (p == NULL) {
+            return -ENODATA;
+        }
+        p++;
+    }
+    p += 3;
+    size_t len = strcspn(p, "\n");
+    if (len >= outlen) {
+        len = outlen - 1;
+    }
+    memcpy(out, p, len);
+    out[len] = 0;
+    return 0;
+}
+
 // Get the effective uid (EUID) of `pid`.
 // Returns the uid (>= 0) or -errno on error.
 int get_uid(int pid)
 {
-    char path[PATH_LEN] = { 0 };
-    snprintf(path, sizeof(path), "%s/%d", procdir_path, pid);
     struct stat st = { 0 };
-    int res = stat(path, &st);
+    int res = procfs_stat_pid(pid, &st);
     if (res < 0) {
-        return -errno;
+        return res;
     }
     return (int)st.st_uid;
 }
 
+// Value of the line `key` (like "\nVmSwap:") in the contents of
+// /proc/[pid]/status, in KiB, or -1 if there is no such line.
+long long proc_status_kib(const char* buf, const char* key)
+{
+    const char* p = strstr(buf, key);
+    if (p == NULL) {
+        return -1;
+    }
+    return strtoll(p + strlen(key), NULL, 10);
+}
+
+/* Estimate how much memory and swap are given back when `pid` is killed,
+ * from /proc/[pid]/status: its anonymous memory (RssAnon) and its swap
+ * (VmSwap). File-backed pages are already counted in MemAvailable, and
+ * shared memory stays around.
+ * Returns 0 on success and -errno on error. -ENODATA means that the kernel
+ * does not tell (before Linux 4.5), or that the process has no memory map.
+ */
+int get_freeable_kib(int pid, long long* mem_kib, long long* swap_kib)
+{
+    // /proc/self/status is about 1.5 kiB
+    char buf[4096];
+    ssize_t n = procfs_read_pid_file(pid, "status", buf, sizeof(buf));
+    if (n < 0) {
+        return (int)n;
+    }
+    long long anon = proc_status_kib(buf, "\nRssAnon:");
+    long long swap = proc_status_kib(buf, "\nVmSwap:");
+    if (anon < 0 || swap < 0) {
+        return -ENODATA;
+    }
+    *mem_kib = anon;
+    *swap_kib = swap;
+    return 0;
+}
+
 /* Print a status line like
  *   mem avail: 5259 MiB (67 %), swap free: 0 MiB (0 %)"
  * as an informational message to stdout (default), or
@@ -14,6 +14,11 @@ typedef struct {
     long long SwapTotalKiB;
     long long SwapFreeKiB;
     long long AnonPagesKiB;
+    // Not used for decisions, -1 if the kernel does not provide them
+    long long ShmemKiB;
+    long long SReclaimableKiB;
+    long long MlockedKiB;
+    long long PageTablesKiB;
     // Calculated values
     // UserMemTotalKiB = MemAvailableKiB + AnonPagesKiB.
     // Represents the total amount of memory that may be used by user processes.
@@ -32,12 +37,21 @@ typedef struct procinfo {
     pid_stat_t stat;
     char name[PATH_LEN];
     char cmdline[PATH_LEN];
+    // cgroup v2 path, like "/system.slice/foo.service". See fill_informative_fields().
+    char cgroup[PATH_LEN];
+    // pidfd for the process once it has been selected as the victim, valid if
+    // has_pidfd is set. Pins the process so the pid cannot be reused before
+    // we kill it. The flag keeps a zero-initialized procinfo_t from
+    // pointing at fd 0. Use procinfo_pidfd().
+    bool has_pidfd;
+    int pidfd;
 } procinfo_t;
 
 // placeholder value for numeric fields
 #define PROCINFO_FIELD_NOT_SET -9999
 
 meminfo_t parse_meminfo();
+meminfo_t parse_meminfo_buf(const char* buf, size_t len);
 bool is_alive(int pid);
 void print_mem_stats(int (*out_func)(const char* fmt, ...), const meminfo_t m);
 int get_oom_score(int pid);
@@ -45,5 +59,8 @@ int get_oom_score_adj(const int pid, int* out);
 int get_comm(int pid, char* out, size_t outlen);
 int get_uid(int pid);
 int get_cmdline(int pid, char* out, size_t outlen);
+int get_cgroup(int pid, char* out, size_t outlen);
+long long proc_status_kib(const char* buf, const char* key);
+int get_freeable_kib(int pid, long long* mem_kib, long long* swap_kib);
 
 #endif
@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: MIT
+
+/* Hand-off between the monitor thread and the main thread (--monitor-thread).
+ *
+ * The monitor thread samples /proc/meminfo all the time and decides what has
+ * to be done. The main thread selects and kills the victims and sends the
+ * notifications, which can block for seconds. Neither ever waits for the
+ * other: the samples and the victim are published with sequence locks,
+ * the kill requests are counters, and the main thread is woken up through
+ * an eventfd. */
+
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "monitor.h"
+#include "msg.h"
+
+static int wake_fd = -1;
+
+// Written by the monitor thread. `sample_seq` is odd while it is writing.
+static unsigned sample_seq;
+static monitor_sample_t sample;
+// Incremented by the monitor thread for every kill it wants
+static unsigned long requested;
+
+// Written by the main thread
+static unsigned victim_seq;
+static monitor_victim_t victim;
+// The last request the main thread has started to act on
+static unsigned long taken;
+// The main thread is selecting or killing a victim
+static bool busy;
+
+static void seq_write_begin(unsigned* seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void seq_write_end(unsigned* seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+// Copy `len` bytes from `src`, which is protected by `seq`, to `dst`
+static void seq_read(const unsigned* seq, void* dst, const void* src, size_t len)
+{
+    while (1) {
+        unsigned begin = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if (begin & 1) {
+            // The writer may have been preempted. Let it finish.
+            sched_yield();
+            continue;
+        }
+        memcpy(dst, src, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seq, __ATOMIC_RELAXED) == begin) {
+            return;
+        }
+    }
+}
+
+// Set up the wakeup fd. Returns 0 or -errno.
+int monitor_open(void)
+{
+    if (wake_fd >= 0) {
+        return 0;
+    }
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0) {
+        return -errno;
+    }
+    wake_fd = fd;
+    return 0;
+}
+
+// Only used by the testsuite
+void monitor_close(void)
+{
+    if (wake_fd >= 0) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+}
+
+bool monitor_active(void)
+{
+    return wake_fd >= 0;
+}
+
+// The fd that becomes readable when the monitor thread wants the main
+// thread to look at the situation again, or -1
+int monitor_wake_fd(void)
+{
+    return wake_fd;
+}
+
+// CLOCK_MONOTONIC time in ms
+long long monitor_now_ms(void)
+{
+    struct timespec now = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void monitor_publish(const monitor_sample_t* s)
+{
+    seq_write_begin(&sample_seq);
+    sample = *s;
+    seq_write_end(&sample_seq);
+}
+
+// Ask the main thread for another kill
+void monitor_request_kill(void)
+{
+    __atomic_fetch_add(&requested, 1, __ATOMIC_RELEASE);
+    monitor_wake();
+}
+
+// Is there a kill request the main thread has not started on?
+bool monitor_kill_pending(void)
+{
+    return __atomic_load_n(&requested, __ATOMIC_ACQUIRE) != __atomic_load_n(&taken, __ATOMIC_ACQUIRE);
+}
+
+bool monitor_busy(void)
+{
+    return __atomic_load_n(&busy, __ATOMIC_ACQUIRE);
+}
+
+// The victim the main thread is waiting for. pid is 0 if there is none.
+monitor_victim_t monitor_victim(void)
+{
+    monitor_victim_t v;
+    seq_read(&victim_seq, &v, &victim, sizeof(v));
+    return v;
+}
+
+void monitor_wake(void)
+{
+    if (wake_fd < 0) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        warn("%s: %s\n", __func__, strerror(errno));
+    }
+}
+
+// The last sample of the monitor thread
+monitor_sample_t monitor_sample(void)
+{
+    monitor_sample_t s;
+    seq_read(&sample_seq, &s, &sample, sizeof(s));
+    return s;
+}
+
+// Sleep until the monitor thread wakes us up, `extra_fd` becomes readable
+// (-1 = none), or `timeout_ms` has passed.
+// Returns 1 if woken up or `extra_fd` is readable, 0 on timeout, or -errno.
+int monitor_wait(int timeout_ms, int extra_fd)
+{
+    struct pollfd pfds[2] = {
+        { .fd = wake_fd, .events = POLLIN },
+        { .fd = extra_fd, .events = POLLIN },
+    };
+    int res = poll(pfds, 2, timeout_ms);
+    if (res < 0) {
+        return errno == EINTR ? 0 : -errno;
+    }
+    if (pfds[0].revents) {
+        uint64_t count;
+        if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            return -errno;
+        }
+    }
+    return res > 0;
+}
+
+// Start acting on the kill requests so far. Returns the request counter,
+// see monitor_requests().
+unsigned long monitor_take_request(void)
+{
+    unsigned long r = __atomic_load_n(&requested, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&taken, r, __ATOMIC_RELEASE);
+    return r;
+}
+
+// Number of kill requests so far. When this changes while we wait for a
+// victim, the monitor thread wants us to move on.
+unsigned long monitor_requests(void)
+{
+    return __atomic_load_n(&requested, __ATOMIC_ACQUIRE);
+}
+
+void monitor_set_busy(bool b)
+{
+    __atomic_store_n(&busy, b, __ATOMIC_RELEASE);
+}
+
+// Tell the monitor thread that we sent `sig` to `pid` and are waiting for
+// it to exit. pid = 0: we are not waiting anymore.
+void monitor_set_victim(int pid, int sig)
+{
+    seq_write_begin(&victim_seq);
+    victim.pid = pid;
+    victim.sig = sig;
+    victim.since_ms = monitor_now_ms();
+    seq_write_end(&victim_seq);
+}
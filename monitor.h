@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <stdbool.h>
+
+#include "meminfo.h"
+
+// After SIGKILL, give the victim this long to exit before the monitor
+// asks for another kill while memory keeps running out (--monitor-thread)
+#define MONITOR_PREEMPT_MS 1000
+
+// What the monitor thread last saw
+typedef struct {
+    meminfo_t m;
+    // Signal the memory situation calls for: SIGKILL, SIGTERM or 0
+    int sig;
+    // The signal is based on a forecast (--predict)
+    bool predicted;
+    // Memory is in the pre-ranking band (--prerank)
+    bool warm;
+} monitor_sample_t;
+
+// The victim the main thread is waiting for
+typedef struct {
+    int pid;
+    int sig;
+    // CLOCK_MONOTONIC time the signal was sent, in ms
+    long long since_ms;
+} monitor_victim_t;
+
+int monitor_open(void);
+void monitor_close(void);
+bool monitor_active(void);
+int monitor_wake_fd(void);
+long long monitor_now_ms(void);
+
+// Monitor thread side
+void monitor_publish(const monitor_sample_t* s);
+void monitor_request_kill(void);
+bool monitor_kill_pending(void);
+bool monitor_busy(void);
+monitor_victim_t monitor_victim(void);
+void monitor_wake(void);
+
+// Main thread side
+monitor_sample_t monitor_sample(void);
+int monitor_wait(int timeout_ms, int extra_fd);
+unsigned long monitor_take_request(void);
+unsigned long monitor_requests(void);
+void monitor_set_busy(bool busy);
+void monitor_set_victim(int pid, int sig);
+
+#endif
@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: MIT
+
+/* Userspace computation of /proc/[pid]/oom_score.
+ *
+ * The kernel computes the score in proc_oom_score() and oom_badness():
+ *
+ *   badness = rss + swap entries + page table pages
+ *             + oom_score_adj * (totalpages / 1000)
+ *   oom_score = (1000 + badness * 1000 / totalpages) * 2 / 3
+ *
+ * where all values are in pages, and totalpages = MemTotal + SwapTotal.
+ * Processes with oom_score_adj = -1000, processes without memory map
+ * (kernel threads, zombies) and init have oom_score = 0.
+ *
+ * The formula has changed in the past (Linux 5.9 added the "* 2 / 3",
+ * and older kernels exported badness * 1000 / totalpages directly), so
+ * oom_score_selftest() checks that we agree with the running kernel. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "meminfo.h"
+#include "msg.h"
+#include "oom_score.h"
+#include "proc_pid.h"
+#include "procfs.h"
+
+// OOM_SCORE_ADJ_MIN in the kernel
+#define OOM_SCORE_ADJ_MIN (-1000)
+// Set in pid_stat_t.flags for kernel threads
+#define PF_KTHREAD 0x00200000
+
+static long long page_kib(void)
+{
+    return sysconf(_SC_PAGESIZE) / 1024;
+}
+
+// totalpages as used by proc_oom_score()
+long long oom_score_total_pages(const meminfo_t* m)
+{
+    return (m->MemTotalKiB + m->SwapTotalKiB) / page_kib();
+}
+
+// oom_score of a process that uses `pages` pages (rss + swap + page tables)
+// and has `oom_score_adj`. The result is monotonic in `pages`.
+int oom_score_points(long long total_pages, long long pages, int oom_score_adj)
+{
+    if (oom_score_adj == OOM_SCORE_ADJ_MIN || total_pages <= 0) {
+        return 0;
+    }
+    long long badness = pages + oom_score_adj * (total_pages / 1000);
+    // Division truncates towards zero, like in the kernel
+    return (int)((1000 + badness * 1000 / total_pages) * 2 / 3);
+}
+
+// Compute the oom_score of process `pid` from /proc/[pid]/stat, status and
+// oom_score_adj, like the kernel does. This reads more than just reading
+// /proc/[pid]/oom_score and is only used for testing.
+// Returns 0 on success or -errno.
+int oom_score_compute(int pid, long long total_pages, int* out)
+{
+    pid_stat_t stat = { 0 };
+    if (!parse_proc_pid_stat(&stat, pid)) {
+        return -ESRCH;
+    }
+    int adj = 0;
+    int res = get_oom_score_adj(pid, &adj);
+    if (res < 0) {
+        return res;
+    }
+    // /proc/self/status is about 1.5 kiB
+    char buf[4096];
+    ssize_t n = procfs_read_pid_file(pid, "status", buf, sizeof(buf));
+    if (n < 0) {
+        return (int)n;
+    }
+    long long swap_kib = proc_status_kib(buf, "\nVmSwap:");
+    long long pte_kib = proc_status_kib(buf, "\nVmPTE:");
+    if ((stat.flags & PF_KTHREAD) || swap_kib < 0 || pte_kib < 0) {
+        // No memory map
+        *out = 0;
+        return 0;
+    }
+    long long pages = stat.rss + (swap_kib + pte_kib) / page_kib();
+    *out = oom_score_points(total_pages, pages, adj);
+    return 0;
+}
+
+// Check that oom_score_compute() agrees with the kernel, using our own
+// process. Returns 0 if it does, -EPROTO if it does not, or -errno.
+int oom_score_selftest(void)
+{
+    meminfo_t m = parse_meminfo();
+    long long total_pages = oom_score_total_pages(&m);
+    int pid = (int)getpid();
+    int computed = 0;
+    int res = oom_score_compute(pid, total_pages, &computed);
+    if (res < 0) {
+        return res;
+    }
+    int kernel = get_oom_score(pid);
+    if (kernel < 0) {
+        return kernel;
+    }
+    debug("%s: computed oom_score %d, kernel says %d\n", __func__, computed, kernel);
+    // Our rss may have changed a little in between
+    if (abs(computed - kernel) > 1) {
+        return -EPROTO;
+    }
+    return 0;
+}
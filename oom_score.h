@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef OOM_SCORE_H
+#define OOM_SCORE_H
+
+#include "meminfo.h"
+
+// How long a cached oom_score_adj may be used by the estimated scan
+// (--estimate-oom-score) before it is read again
+#define OOM_SCORE_ADJ_MAX_AGE_MS 10000
+// OOM_SCORE_ADJ_MAX in the kernel
+#define OOM_SCORE_ADJ_MAX 1000
+
+long long oom_score_total_pages(const meminfo_t* m);
+int oom_score_points(long long total_pages, long long pages, int oom_score_adj);
+int oom_score_compute(int pid, long long total_pages, int* out);
+int oom_score_selftest(void);
+
+#endif
@@ -0,0 +1,287 @@
+// SPDX-License-Identifier: MIT
+
+/* Cache of per-process information that survives across
+ * find_largest_process() scans.
+ *
+ * The table is an open-addressing hash table with linear probing, keyed by
+ * pid. Because pids get reused, every lookup also compares the process
+ * start time from /proc/[pid]/stat. A mismatch means we are looking at a
+ * different process, and the cached values are discarded.
+ *
+ * All functions are thread-safe. Entries are copied in and out, so callers
+ * never hold pointers into the table. */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "globals.h"
+#include "meminfo.h"
+#include "msg.h"
+#include "proc_cache.h"
+
+// Initial number of slots. Must be a power of two.
+#define PROC_CACHE_MIN_SLOTS 256
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static proc_cache_entry_t* slots;
+static unsigned n_slots;
+static unsigned n_entries;
+// Current scan generation. Starts at 1 so a zeroed entry is never "seen".
+static unsigned generation = 1;
+static proc_cache_stats_t stats;
+// The procdir_path the cache contents belong to. The test suite switches
+// procdir_path between mock directories, and we must not mix them up.
+static char cached_procdir[PATH_LEN];
+// The regexes the cached match results belong to
+static const regex_t *cached_prefer, *cached_avoid, *cached_ignore;
+
+static unsigned slot_of(int pid)
+{
+    // Knuth's multiplicative hash
+    return ((uint32_t)pid * 2654435761u) & (n_slots - 1);
+}
+
+// Insert `e` into the table without checking for duplicates or load.
+static void insert_raw(const proc_cache_entry_t* e)
+{
+    unsigned i = slot_of(e->pid);
+    while (slots[i].pid != 0) {
+        i = (i + 1) & (n_slots - 1);
+    }
+    slots[i] = *e;
+}
+
+// Grow the table to `want` slots. Returns false if out of memory, in which
+// case the old table is left untouched.
+static bool resize(unsigned want)
+{
+    proc_cache_entry_t* old = slots;
+    unsigned old_n = n_slots;
+
+    proc_cache_entry_t* fresh = calloc(want, sizeof(*fresh));
+    if (fresh == NULL) {
+        return false;
+    }
+    slots = fresh;
+    n_slots = want;
+    for (unsigned i = 0; i < old_n; i++) {
+        if (old[i].pid != 0) {
+            insert_raw(&old[i]);
+        }
+    }
+    free(old);
+    return true;
+}
+
+// Delete the entry in slot `i`, using backward-shift deletion so that
+// linear probing keeps working without tombstones.
+static void delete_slot(unsigned i)
+{
+    unsigned mask = n_slots - 1;
+    unsigned j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (slots[j].pid == 0) {
+            break;
+        }
+        unsigned home = slot_of(slots[j].pid);
+        // Can the entry at j be moved to the hole at i? Only if its home
+        // slot is not cyclically within (i, j].
+        if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    memset(&slots[i], 0, sizeof(slots[i]));
+    n_entries--;
+}
+
+static int find_slot(int pid)
+{
+    if (n_slots == 0) {
+        return -1;
+    }
+    unsigned i = slot_of(pid);
+    while (slots[i].pid != 0) {
+        if (slots[i].pid == pid) {
+            return (int)i;
+        }
+        i = (i + 1) & (n_slots - 1);
+    }
+    return -1;
+}
+
+static void flush_locked(void)
+{
+    free(slots);
+    slots = NULL;
+    n_slots = 0;
+    n_entries = 0;
+}
+
+// Forget everything if procdir_path has changed since we last looked.
+static void check_procdir(void)
+{
+    if (strcmp(cached_procdir, procdir_path) == 0) {
+        return;
+    }
+    flush_locked();
+    snprintf(cached_procdir, sizeof(cached_procdir), "%s", procdir_path);
+}
+
+static void reset_entry(proc_cache_entry_t* e, int pid, unsigned long long starttime, const char* comm)
+{
+    memset(e, 0, sizeof(*e));
+    e->pid = pid;
+    e->starttime = starttime;
+    e->uid = PROCINFO_FIELD_NOT_SET;
+    e->oom_score_adj = PROCINFO_FIELD_NOT_SET;
+    snprintf(e->comm, sizeof(e->comm), "%s", comm);
+}
+
+// Look up the cache entry for process `pid` with start time `starttime`
+// and name `comm`, creating an empty one if needed, and copy it to `out`.
+// Returns false if we are out of memory.
+bool proc_cache_get(int pid, unsigned long long starttime, const char* comm, proc_cache_entry_t* out)
+{
+    pthread_mutex_lock(&lock);
+    check_procdir();
+
+    int i = find_slot(pid);
+    if (i >= 0) {
+        proc_cache_entry_t* e = &slots[i];
+        if (e->starttime != starttime || strncmp(e->comm, comm, sizeof(e->comm) - 1) != 0) {
+            // pid reuse or exec()
+            reset_entry(e, pid, starttime, comm);
+            stats.misses++;
+        } else {
+            stats.hits++;
+        }
+        e->seen = generation;
+        *out = *e;
+        pthread_mutex_unlock(&lock);
+        return true;
+    }
+
+    // Keep the load factor below 1/2
+    if ((n_entries + 1) * 2 > n_slots) {
+        unsigned want = n_slots ? n_slots * 2 : PROC_CACHE_MIN_SLOTS;
+        if (!resize(want)) {
+            pthread_mutex_unlock(&lock);
+            warn("%s: could not grow cache to %u entries\n", __func__, want);
+            return false;
+        }
+    }
+    reset_entry(out, pid, starttime, comm);
+    out->seen = generation;
+    insert_raw(out);
+    n_entries++;
+    stats.misses++;
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+// Merge the values in `e` that are known (not PROCINFO_FIELD_NOT_SET, or
+// 0 for cgroup_id) and its flags into the cache entry for the same process,
+// if it still exists.
+// Values that exempt the process from being killed (uid 0 for
+// --ignore-root-user, oom_score_adj -1000) are not cached. Only the victim is
+// checked again before the kill, so a process that drops root or raises its
+// oom_score_adj later would stay exempt for as long as it lives.
+void proc_cache_update(const proc_cache_entry_t* e)
+{
+    pthread_mutex_lock(&lock);
+    int i = find_slot(e->pid);
+    if (i >= 0 && slots[i].starttime == e->starttime) {
+        if (e->uid != PROCINFO_FIELD_NOT_SET && e->uid != 0) {
+            slots[i].uid = e->uid;
+        }
+        if (e->oom_score_adj != PROCINFO_FIELD_NOT_SET && e->oom_score_adj != -1000) {
+            struct timespec now = { 0 };
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            slots[i].oom_score_adj = e->oom_score_adj;
+            slots[i].adj_ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        }
+        if (e->cgroup_id != 0) {
+            struct timespec now = { 0 };
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            slots[i].cgroup_id = e->cgroup_id;
+            slots[i].cgroup_ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        }
+        slots[i].flags |= e->flags;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Invalidate cached regex match results if the regexes have changed.
+void proc_cache_set_regexes(const regex_t* prefer, const regex_t* avoid, const regex_t* ignore)
+{
+    pthread_mutex_lock(&lock);
+    if (prefer != cached_prefer || avoid != cached_avoid || ignore != cached_ignore) {
+        const unsigned regex_flags = PROC_CACHE_HAVE_REGEX | PROC_CACHE_MATCH_PREFER
+            | PROC_CACHE_MATCH_AVOID | PROC_CACHE_MATCH_IGNORE;
+        for (unsigned i = 0; i < n_slots; i++) {
+            slots[i].flags &= ~regex_flags;
+        }
+        cached_prefer = prefer;
+        cached_avoid = avoid;
+        cached_ignore = ignore;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Drop the entry for `pid`, if any.
+void proc_cache_forget(int pid)
+{
+    pthread_mutex_lock(&lock);
+    int i = find_slot(pid);
+    if (i >= 0) {
+        delete_slot((unsigned)i);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Drop all entries.
+void proc_cache_flush(void)
+{
+    pthread_mutex_lock(&lock);
+    flush_locked();
+    pthread_mutex_unlock(&lock);
+}
+
+// Start a new scan. Entries not looked up until the matching
+// proc_cache_end_scan() are evicted there.
+void proc_cache_begin_scan(void)
+{
+    pthread_mutex_lock(&lock);
+    check_procdir();
+    generation++;
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&lock);
+}
+
+// Evict entries for processes that have not been seen in this scan
+// (they have exited) and return statistics about the scan.
+proc_cache_stats_t proc_cache_end_scan(void)
+{
+    pthread_mutex_lock(&lock);
+    unsigned i = 0;
+    while (i < n_slots) {
+        if (slots[i].pid != 0 && slots[i].seen != generation) {
+            // delete_slot() may shift another entry into slot i,
+            // so look at this slot again.
+            delete_slot(i);
+            stats.evicted++;
+            continue;
+        }
+        i++;
+    }
+    stats.entries = n_entries;
+    proc_cache_stats_t ret = stats;
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
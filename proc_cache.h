@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef PROC_CACHE_H
+#define PROC_CACHE_H
+
+#include <regex.h>
+#include <stdbool.h>
+
+// Process names in /proc/[pid]/comm are at most 15 bytes plus null byte
+// (TASK_COMM_LEN). We leave some room in case this ever grows.
+#define PROC_CACHE_COMM_LEN 32
+
+// Flag bits for proc_cache_entry_t.flags
+enum {
+    // The regex match results below are valid
+    PROC_CACHE_HAVE_REGEX = 1 << 0,
+    PROC_CACHE_MATCH_PREFER = 1 << 1,
+    PROC_CACHE_MATCH_AVOID = 1 << 2,
+    PROC_CACHE_MATCH_IGNORE = 1 << 3,
+};
+
+// Information about a process that rarely changes and that we therefore
+// keep across find_largest_process() scans. Fields that change all the time
+// (rss, oom_score) are not cached.
+typedef struct {
+    // Key. The starttime is used to detect pid reuse.
+    int pid;
+    unsigned long long starttime;
+    // Cached values. PROCINFO_FIELD_NOT_SET if not known yet.
+    int uid;
+    int oom_score_adj;
+    // CLOCK_MONOTONIC time in ms when oom_score_adj was stored
+    long long adj_ms;
+    // The cgroup for cgroup_hints_get(), 0 if not known yet (--cgroup-hints)
+    int cgroup_id;
+    // CLOCK_MONOTONIC time in ms when cgroup_id was stored
+    long long cgroup_ms;
+    unsigned flags;
+    // Scan generation this entry was last seen in. Used for eviction.
+    unsigned seen;
+    // The name the cached values belong to. When it changes, the process
+    // has probably called exec(), and we forget what we know.
+    char comm[PROC_CACHE_COMM_LEN];
+} proc_cache_entry_t;
+
+typedef struct {
+    unsigned hits;
+    unsigned misses;
+    unsigned evicted;
+    unsigned entries;
+} proc_cache_stats_t;
+
+void proc_cache_begin_scan(void);
+proc_cache_stats_t proc_cache_end_scan(void);
+bool proc_cache_get(int pid, unsigned long long starttime, const char* comm, proc_cache_entry_t* out);
+void proc_cache_update(const proc_cache_entry_t* e);
+void proc_cache_set_regexes(const regex_t* prefer, const regex_t* avoid, const regex_t* ignore);
+void proc_cache_forget(int pid);
+void proc_cache_flush(void);
+
+#endif
@@ -0,0 +1,395 @@
+// SPDX-License-Identifier: MIT
+
+/* Live process table, kept current by the kernel proc connector.
+ *
+ * Instead of listing /proc every time we look for a victim, we subscribe
+ * to fork/exec/exit/uid/comm events (NETLINK_CONNECTOR, CN_IDX_PROC) and
+ * apply them to a sorted array of pids. The table is seeded from /proc
+ * after subscribing, so no process is missed, and re-seeded whenever the
+ * kernel tells us that we have lost events (ENOBUFS).
+ *
+ * Subscribing needs CAP_NET_ADMIN in the initial user and network
+ * namespace. Without it, proc_events_open() fails and we keep using
+ * procfs_list_pids(). */
+
+#include <errno.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "msg.h"
+#include "proc_cache.h"
+#include "proc_events.h"
+#include "proc_pid.h"
+#include "procfs.h"
+
+// How long to wait for the kernel to acknowledge our subscription
+#define PROC_EVENTS_ACK_TIMEOUT_MS 1000
+// Socket receive buffer. Events that do not fit are lost, and we
+// re-seed the table from /proc.
+#define PROC_EVENTS_RCVBUF (256 * 1024)
+
+static int sock = -1;
+// Sorted pids of all processes (thread group leaders)
+static int* pids;
+static int n_pids;
+static int pids_cap;
+// Processes whose main thread has exited while other threads are still
+// running ("zombie main thread"). They stay in the table until the whole
+// thread group is gone.
+static int* orphans;
+static int n_orphans;
+static int orphans_cap;
+// The table has missed events and must be re-seeded from /proc
+static bool need_resync;
+// Statistics for debug output
+static unsigned long n_events;
+static unsigned long n_resyncs;
+
+// Binary search for `pid`. Returns its index, or, if not found,
+// -(insertion point) - 1.
+static int find_pid(int pid)
+{
+    int lo = 0, hi = n_pids - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (pids[mid] < pid) {
+            lo = mid + 1;
+        } else if (pids[mid] > pid) {
+            hi = mid - 1;
+        } else {
+            return mid;
+        }
+    }
+    return -lo - 1;
+}
+
+static void add_pid(int pid)
+{
+    int i = find_pid(pid);
+    if (i >= 0) {
+        return;
+    }
+    i = -i - 1;
+    if (n_pids == pids_cap) {
+        int want = pids_cap ? pids_cap * 2 : 1024;
+        int* fresh = realloc(pids, (size_t)want * sizeof(*pids));
+        if (fresh == NULL) {
+            warn("%s: could not grow pid table to %d entries\n", __func__, want);
+            need_resync = true;
+            return;
+        }
+        pids = fresh;
+        pids_cap = want;
+    }
+    // New pids are usually the largest, so this rarely moves anything
+    memmove(&pids[i + 1], &pids[i], (size_t)(n_pids - i) * sizeof(*pids));
+    pids[i] = pid;
+    n_pids++;
+}
+
+static void remove_pid(int pid)
+{
+    int i = find_pid(pid);
+    if (i < 0) {
+        return;
+    }
+    memmove(&pids[i], &pids[i + 1], (size_t)(n_pids - i - 1) * sizeof(*pids));
+    n_pids--;
+}
+
+static int find_orphan(int tgid)
+{
+    for (int i = 0; i < n_orphans; i++) {
+        if (orphans[i] == tgid) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Does the thread group `tgid` still have live threads? An exiting
+// thread may still be counted until it has been reaped.
+static bool has_live_threads(int tgid)
+{
+    pid_stat_t st = { 0 };
+    if (!parse_proc_pid_stat(&st, tgid)) {
+        return false;
+    }
+    // A zombie leader stays counted as well. Without other threads it does
+    // not use any memory, like in is_alive().
+    if (st.state == 'Z' && st.num_threads <= 1) {
+        return false;
+    }
+    return st.num_threads > 1;
+}
+
+// The main thread of process `tgid` has exited.
+static void leader_exited(int tgid)
+{
+    if (!has_live_threads(tgid)) {
+        remove_pid(tgid);
+        return;
+    }
+    if (find_orphan(tgid) >= 0) {
+        return;
+    }
+    if (n_orphans == orphans_cap) {
+        int want = orphans_cap ? orphans_cap * 2 : 16;
+        int* fresh = realloc(orphans, (size_t)want * sizeof(*orphans));
+        if (fresh == NULL) {
+            // We will find out at the next resync
+            remove_pid(tgid);
+            return;
+        }
+        orphans = fresh;
+        orphans_cap = want;
+    }
+    orphans[n_orphans++] = tgid;
+}
+
+// Drop the orphans whose last thread is gone. This is not done on thread
+// exit events because the exiting thread is still counted at that point,
+// and there may be no further event for the process.
+static void prune_orphans(void)
+{
+    for (int i = n_orphans - 1; i >= 0; i--) {
+        if (has_live_threads(orphans[i])) {
+            continue;
+        }
+        remove_pid(orphans[i]);
+        orphans[i] = orphans[--n_orphans];
+    }
+}
+
+// Replace the table with a fresh listing of /proc.
+static void resync(void)
+{
+    int* list = NULL;
+    int n = procfs_list_pids(&list);
+    if (n < 0) {
+        warn("%s: could not list /proc: %s\n", __func__, strerror(-n));
+        return;
+    }
+    if (n > pids_cap) {
+        int* fresh = realloc(pids, (size_t)n * sizeof(*pids));
+        if (fresh == NULL) {
+            warn("%s: could not allocate pid table for %d entries\n", __func__, n);
+            return;
+        }
+        pids = fresh;
+        pids_cap = n;
+    }
+    memcpy(pids, list, (size_t)n * sizeof(*pids));
+    n_pids = n;
+    n_orphans = 0;
+    need_resync = false;
+    n_resyncs++;
+}
+
+static void handle_event(const struct proc_event* ev)
+{
+    n_events++;
+    switch (ev->what) {
+    case PROC_EVENT_FORK:
+        // Only new processes, not new threads. Kernel threads are children
+        // of kthreadd (pid 2) and are never killed.
+        if (ev->event_data.fork.child_pid == ev->event_data.fork.child_tgid
+            && ev->event_data.fork.parent_tgid != 2) {
+            add_pid(ev->event_data.fork.child_tgid);
+        }
+        break;
+    case PROC_EVENT_EXEC:
+        proc_cache_forget(ev->event_data.exec.process_tgid);
+        break;
+    case PROC_EVENT_UID:
+        proc_cache_forget(ev->event_data.id.process_tgid);
+        break;
+    case PROC_EVENT_COMM:
+        proc_cache_forget(ev->event_data.comm.process_tgid);
+        break;
+    case PROC_EVENT_EXIT:
+        if (ev->event_data.exit.process_pid == ev->event_data.exit.process_tgid) {
+            leader_exited(ev->event_data.exit.process_tgid);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Receive one batch of messages. Returns the number of bytes received,
+// 0 if there was nothing to read, or -errno.
+// If `ack` is not NULL, it is set to the error code of a subscription
+// acknowledgement we received (or left alone).
+static ssize_t receive(int* ack)
+{
+    static char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    ssize_t len = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+    if (len < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        return -errno;
+    }
+    for (struct nlmsghdr* nh = (struct nlmsghdr*)buf; NLMSG_OK(nh, (size_t)len); nh = NLMSG_NEXT(nh, len)) {
+        if (nh->nlmsg_type == NLMSG_NOOP || nh->nlmsg_type == NLMSG_ERROR) {
+            continue;
+        }
+        const struct cn_msg* cn = NLMSG_DATA(nh);
+        if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC) {
+            continue;
+        }
+        const struct proc_event* ev = (const struct proc_event*)cn->data;
+        if (ev->what == PROC_EVENT_NONE) {
+            if (ack != NULL) {
+                *ack = (int)ev->event_data.ack.err;
+            }
+            continue;
+        }
+        handle_event(ev);
+    }
+    return len;
+}
+
+static int send_mcast_op(enum proc_cn_mcast_op op)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct cn_msg cn;
+        enum proc_cn_mcast_op op;
+    } __attribute__((packed)) req;
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = sizeof(req);
+    req.nh.nlmsg_type = NLMSG_DONE;
+    req.nh.nlmsg_pid = (uint32_t)getpid();
+    req.cn.id.idx = CN_IDX_PROC;
+    req.cn.id.val = CN_VAL_PROC;
+    req.cn.len = sizeof(req.op);
+    req.op = op;
+    if (send(sock, &req, sizeof(req), 0) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+// Subscribe to process events and seed the process table from /proc.
+// Returns 0 on success or -errno.
+int proc_events_open(void)
+{
+    if (sock >= 0) {
+        return 0;
+    }
+    sock = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (sock < 0) {
+        return -errno;
+    }
+    int rcvbuf = PROC_EVENTS_RCVBUF;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = CN_IDX_PROC,
+        .nl_pid = (uint32_t)getpid(),
+    };
+    int err = 0;
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        err = -errno;
+        goto fail;
+    }
+    err = send_mcast_op(PROC_CN_MCAST_LISTEN);
+    if (err != 0) {
+        goto fail;
+    }
+    // The kernel acknowledges the subscription with a PROC_EVENT_NONE
+    // message. Other events may arrive before it.
+    int ack = -1;
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    while (ack == -1) {
+        int res = poll(&pfd, 1, PROC_EVENTS_ACK_TIMEOUT_MS);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            // Old kernels do not send an acknowledgement
+            break;
+        }
+        ssize_t len = receive(&ack);
+        if (len < 0) {
+            err = (int)len;
+            goto fail;
+        }
+    }
+    if (ack > 0) {
+        err = -ack;
+        goto fail;
+    }
+
+    // Events that happen while we list /proc are applied afterwards
+    resync();
+    if (need_resync) {
+        err = -ENOMEM;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    close(sock);
+    sock = -1;
+    return err;
+}
+
+// Are we using the proc connector? The test suite points procdir_path
+// at mock directories, which the events know nothing about.
+bool proc_events_active(void)
+{
+    return sock >= 0 && strcmp(procdir_path, "/proc") == 0;
+}
+
+// Apply all pending events to the process table.
+void proc_events_drain(void)
+{
+    if (sock < 0) {
+        return;
+    }
+    while (1) {
+        ssize_t len = receive(NULL);
+        if (len == 0) {
+            break;
+        }
+        if (len == -ENOBUFS) {
+            // The socket buffer has overflowed and events are lost
+            need_resync = true;
+            continue;
+        }
+        if (len < 0) {
+            warn("%s: %s\n", __func__, strerror((int)-len));
+            need_resync = true;
+            break;
+        }
+    }
+    if (need_resync) {
+        debug("%s: lost events, re-reading /proc\n", __func__);
+        resync();
+    }
+    prune_orphans();
+}
+
+/* List the pids in the process table, like procfs_list_pids(). `*out`
+ * is sorted and stays valid until the next call into this module.
+ * Returns the number of pids.
+ */
+int proc_events_list_pids(int** out)
+{
+    proc_events_drain();
+    debug("%s: %d processes, %lu events, %lu resyncs\n", __func__, n_pids, n_events, n_resyncs);
+    *out = pids;
+    return n_pids;
+}
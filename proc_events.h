@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef PROC_EVENTS_H
+#define PROC_EVENTS_H
+
+#include <stdbool.h>
+
+int proc_events_open(void);
+bool proc_events_active(void);
+void proc_events_drain(void);
+int proc_events_list_pids(int** out);
+
+#endif
@@ -6,12 +6,70 @@
 #include "globals.h"
 #include "msg.h"
 #include "proc_pid.h"
+#include "procfs.h"
+
+// Skip `n` space-separated fields at `*p`. glibc's strchr() scans with
+// SIMD instructions where the CPU has them.
+static bool skip_fields(const char** p, int n)
+{
+    const char* q = *p;
+    for (int i = 0; i < n; i++) {
+        q = strchr(q, ' ');
+        if (q == NULL) {
+            return false;
+        }
+        q++;
+    }
+    *p = q;
+    return true;
+}
+
+// Parse the unsigned decimal number at `*p` and move `*p` to the start of
+// the next field. Returns false if there is no number.
+static bool next_ull(const char** p, unsigned long long* out)
+{
+    const char* q = *p;
+    unsigned long long val = 0;
+    if (*q < '0' || *q > '9') {
+        return false;
+    }
+    while (*q >= '0' && *q <= '9') {
+        val = val * 10 + (unsigned)(*q - '0');
+        q++;
+    }
+    if (*q == ' ') {
+        q++;
+    } else if (*q != 0 && *q != '\n') {
+        return false;
+    }
+    *out = val;
+    *p = q;
+    return true;
+}
+
+// Like next_ull(), but the number may be negative
+static bool next_ll(const char** p, long long* out)
+{
+    bool negative = (**p == '-');
+    if (negative) {
+        (*p)++;
+    }
+    unsigned long long val;
+    if (!next_ull(p, &val)) {
+        return false;
+    }
+    *out = negative ? -(long long)val : (long long)val;
+    return true;
+}
 
 // Parse a buffer that contains the text from /proc/$pid/stat. Example:
 // $ cat /proc/self/stat
 // 551716 (cat) R 551087 551716 551087 34816 551716 4194304 94 0 0 0 0 0 0 0 20 0 1 0 5017160 227065856 448 18446744073709551615 94898152189952 94898152206609 140721104501216 0 0 0 0 0 0 0 0 0 17 0 0 0 0 0 0 94898152221328 94898152222824 94898185641984 140721104505828 140721104505848 140721104505848 140721104510955 0
+// Field numbers below are from "man 5 proc".
 bool parse_proc_pid_stat_buf(pid_stat_t* out, char* buf)
 {
+    // The process name may contain anything, including ')' and spaces,
+    // but the kernel does not put a ')' after it
     char* closing_bracket = strrchr(buf, ')');
     if (!closing_bracket) {
         return false;
@@ -21,55 +79,140 @@ bool parse_proc_pid_stat_buf(pid_stat_t* out, char* buf)
         return false;
     }
     // Because of the check above, there must be at least one more byte at
-    // closing_bracket[2] (possibly a null byte, but sscanf will handle that).
-    char* state_field = &closing_bracket[2];
-    int ret = sscanf(state_field,
-        "%c " // state
-        "%d %*d %*d %*d %*d " // ppid, pgrp, sid, tty_nr, tty_pgrp
-        "%*u %*u %*u %*u %*u " // flags, min_flt, cmin_flt, maj_flt, cmaj_flt
-        "%*u %*u %*u %*u " // utime, stime, cutime, cstime
-        "%*d %*d " // priority, nice
-        "%ld " // num_threads
-        "%*d %*d %*d" // itrealvalue, starttime, vsize
-        "%ld ", // rss
-        &out->state,
-        &out->ppid,
-        &out->num_threads,
-        &out->rss);
-    if (ret != 4) {
-        return false;
-    };
+    // closing_bracket[2] (possibly a null byte, which fails the check below).
+    const char* p = &closing_bracket[2];
+    unsigned long long u;
+    long long l;
+
+    // (3) state
+    if (*p == 0 || p[1] != ' ') {
+        return false;
+    }
+    out->state = *p;
+    p += 2;
+    // (4) ppid
+    if (!next_ll(&p, &l)) {
+        return false;
+    }
+    out->ppid = (int)l;
+    // (5) pgrp
+    if (!next_ll(&p, &l)) {
+        return false;
+    }
+    out->pgrp = (int)l;
+    // (6) session, (7) tty_nr, (8) tpgid
+    if (!skip_fields(&p, 3)) {
+        return false;
+    }
+    // (9) flags
+    if (!next_ull(&p, &u)) {
+        return false;
+    }
+    out->flags = (unsigned)u;
+    // (10) minflt, (11) cminflt
+    if (!skip_fields(&p, 2)) {
+        return false;
+    }
+    // (12) majflt
+    if (!next_ull(&p, &u)) {
+        return false;
+    }
+    out->maj_flt = (unsigned long)u;
+    // (13) cmajflt
+    if (!skip_fields(&p, 1)) {
+        return false;
+    }
+    // (14) utime, (15) stime
+    if (!next_ull(&p, &u)) {
+        return false;
+    }
+    out->utime = (unsigned long)u;
+    if (!next_ull(&p, &u)) {
+        return false;
+    }
+    out->stime = (unsigned long)u;
+    // (16) cutime, (17) cstime, (18) priority, (19) nice
+    if (!skip_fields(&p, 4)) {
+        return false;
+    }
+    // (20) num_threads
+    if (!next_ll(&p, &l)) {
+        return false;
+    }
+    out->num_threads = (long)l;
+    // (21) itrealvalue
+    if (!skip_fields(&p, 1)) {
+        return false;
+    }
+    // (22) starttime, (23) vsize
+    if (!next_ull(&p, &u)) {
+        return false;
+    }
+    out->starttime = u;
+    if (!next_ull(&p, &u)) {
+        return false;
+    }
+    out->vsize = (unsigned long)u;
+    // (24) rss
+    if (!next_ll(&p, &l)) {
+        return false;
+    }
+    out->rss = (long)l;
     return true;
 };
 
+// Copy the process name (the part in brackets) from the /proc/$pid/stat
+// text in `buf` to `out`, truncating it to `outlen` if needed.
+static void copy_comm(char* out, size_t outlen, const char* buf)
+{
+    const char* opening_bracket = strchr(buf, '(');
+    const char* closing_bracket = strrchr(buf, ')');
+    out[0] = 0;
+    if (!opening_bracket || !closing_bracket || closing_bracket < opening_bracket) {
+        return;
+    }
+    size_t n = (size_t)(closing_bracket - opening_bracket - 1);
+    if (n > outlen - 1) {
+        n = outlen - 1;
+    }
+    memcpy(out, opening_bracket + 1, n);
+    out[n] = 0;
+    fix_truncated_utf8(out);
+}
+
 // Read and parse /proc/$pid/stat. Returns true on success, false on error.
 bool parse_proc_pid_stat(pid_stat_t* out, int pid)
+{
+    return parse_proc_pid_stat_comm(out, NULL, 0, pid);
+}
+
+// Like parse_proc_pid_stat(), but also copies the process name to `comm`
+// (if not NULL). This is the same string that /proc/$pid/comm contains,
+// so we save opening that file.
+bool parse_proc_pid_stat_comm(pid_stat_t* out, char* comm, size_t commlen, int pid)
 {
     // Largest /proc/*/stat file here is 363 bytes acc. to:
     //   wc -c /proc/*/stat | sort
     // 512 seems safe given that we only need the first 20 fields.
-    char buf[512] = { 0 };
+    char buf[512];
 
-    // Read /proc/$pid/stat
-    snprintf(buf, sizeof(buf), "%s/%d/stat", procdir_path, pid);
-    FILE* f = fopen(buf, "r");
-    if (f == NULL) {
+    // File content looks like this:
+    // 10751 (cat) R 2663 10751 2663[...]
+    // File may be bigger than 512 bytes, but we only need the first 20 or so.
+    ssize_t len = procfs_read_pid_file(pid, "stat", buf, sizeof(buf));
+    if (len < 0) {
         // Process is gone - good.
         return false;
     }
-    memset(buf, 0, sizeof(buf));
-
-    // File content looks like this:
-    // 10751 (cat) R 2663 10751 2663[...]
-    // File may be bigger than 256 bytes, but we only need the first 20 or so.
-    int len = (int)fread(buf, 1, sizeof(buf) - 1, f);
-    bool read_error = ferror(f) || len == 0;
-    fclose(f);
-    if (read_error) {
-        warn("%s: fread failed: %s\n", __func__, strerror(errno));
+    if (len == 0) {
+        warn("%s: read returned 0 bytes\n", __func__);
         return false;
     }
-    // Terminate string at end of data
-    buf[len] = 0;
-    return parse_proc_pid_stat_buf(out, buf);
+    if (!parse_proc_pid_stat_buf(out, buf)) {
+        return false;
+    }
+    if (comm) {
+        copy_comm(comm, commlen, buf);
+    }
+    return true;
 }
@@ -3,15 +3,32 @@
 #define PROC_PID_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef struct {
     char state;
     int ppid;
+    // Process group
+    int pgrp;
+    // PF_* flags, like PF_KTHREAD
+    unsigned flags;
+    // Major page faults (that needed I/O)
+    unsigned long maj_flt;
+    // CPU time spent in user and kernel mode, in clock ticks
+    unsigned long utime;
+    unsigned long stime;
     long num_threads;
+    // Start time in clock ticks after boot. Together with the pid, this
+    // uniquely identifies a process.
+    unsigned long long starttime;
+    // Virtual memory size in bytes
+    unsigned long vsize;
+    // Resident set size in pages
     long rss;
 } pid_stat_t;
 
 bool parse_proc_pid_stat_buf(pid_stat_t* out, char* buf);
 bool parse_proc_pid_stat(pid_stat_t* out, int pid);
+bool parse_proc_pid_stat_comm(pid_stat_t* out, char* comm, size_t commlen, int pid);
 
 #endif
@@ -0,0 +1,225 @@
+// SPDX-License-Identifier: MIT
+
+/* Access to /proc/[pid]/ files relative to a directory fd that we keep open.
+ *
+ * Compared to fopen("/proc/123/stat"), this saves resolving "/proc" on
+ * every call, and the malloc() of a stdio buffer. Files are read with
+ * plain read() into caller-provided (stack) buffers. */
+
+#include <dirent.h> /* DT_DIR, DT_UNKNOWN */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h> /* Definition of SYS_* constants */
+#include <unistd.h>
+
+#include "globals.h"
+#include "meminfo.h"
+#include "msg.h"
+#include "procfs.h"
+#include "procfs_uring.h"
+
+// Buffer size for getdents64(). Each pid entry takes 24 to 32 bytes, so
+// a typical system is listed in one or two syscalls.
+#define DENTS_BUFSIZ 32768
+
+static int proc_dirfd = -1;
+// Files opened and directories stat()ed below /proc/[pid], see procfs_calls()
+static unsigned long n_calls;
+// The procdir_path that proc_dirfd belongs to. The test suite switches
+// procdir_path between mock directories.
+static char proc_dirfd_path[PATH_LEN];
+
+// Returns a directory fd for procdir_path, opening it if needed,
+// or -errno on error.
+int procfs_dirfd(void)
+{
+    if (proc_dirfd >= 0 && strcmp(proc_dirfd_path, procdir_path) == 0) {
+        return proc_dirfd;
+    }
+    if (proc_dirfd >= 0) {
+        close(proc_dirfd);
+        proc_dirfd = -1;
+    }
+    int fd = open(procdir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    proc_dirfd = fd;
+    snprintf(proc_dirfd_path, sizeof(proc_dirfd_path), "%s", procdir_path);
+    return proc_dirfd;
+}
+
+// Open /proc/[pid]/[name] read-only.
+// Returns the fd or -errno on error.
+int procfs_open_pid_file(int pid, const char* name)
+{
+    int dirfd = procfs_dirfd();
+    if (dirfd < 0) {
+        return dirfd;
+    }
+    char path[PATH_LEN] = { 0 };
+    snprintf(path, sizeof(path), "%d/%s", pid, name);
+    __atomic_fetch_add(&n_calls, 1, __ATOMIC_RELAXED);
+    int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    return fd;
+}
+
+// Read up to len-1 bytes from /proc/[pid]/[name] into `buf` and
+// null-terminate it. A single read() returns the whole file for the small
+// files we care about, larger files are truncated.
+// Returns the number of bytes read or -errno on error.
+ssize_t procfs_read_pid_file(int pid, const char* name, char* buf, size_t len)
+{
+    // Already read by procfs_uring_prefetch() (--io-uring)?
+    ssize_t res = 0;
+    if (procfs_uring_lookup(pid, name, buf, len, &res)) {
+        return res;
+    }
+    int fd = procfs_open_pid_file(pid, name);
+    if (fd < 0) {
+        buf[0] = 0;
+        return fd;
+    }
+    ssize_t n = read(fd, buf, len - 1);
+    int read_errno = errno;
+    close(fd);
+    if (n < 0) {
+        buf[0] = 0;
+        return -read_errno;
+    }
+    buf[n] = 0;
+    return n;
+}
+
+// stat() the /proc/[pid] directory.
+// Returns 0 on success or -errno on error.
+int procfs_stat_pid(int pid, struct stat* st)
+{
+    int dirfd = procfs_dirfd();
+    if (dirfd < 0) {
+        return dirfd;
+    }
+    char path[PATH_LEN] = { 0 };
+    snprintf(path, sizeof(path), "%d", pid);
+    __atomic_fetch_add(&n_calls, 1, __ATOMIC_RELAXED);
+    if (fstatat(dirfd, path, st, 0) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+// Number of openat() and fstatat() calls on /proc/[pid] so far.
+// Lets the test suite see what the proc cache saves.
+unsigned long procfs_calls(void)
+{
+    return __atomic_load_n(&n_calls, __ATOMIC_RELAXED);
+}
+
+// The kernel's directory entry format for getdents64(). glibc only
+// provides a wrapper since 2.30, so we use the raw syscall.
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static int cmp_int(const void* a, const void* b)
+{
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// Parse a directory name as a pid. Returns -1 for names that are not
+// all-digits (like "self" or "meminfo").
+static int parse_pid(const char* name)
+{
+    if (name[0] < '0' || name[0] > '9') {
+        return -1;
+    }
+    int pid = 0;
+    for (const char* c = name; *c; c++) {
+        if (*c < '0' || *c > '9' || pid > (INT32_MAX - 9) / 10) {
+            return -1;
+        }
+        pid = pid * 10 + (*c - '0');
+    }
+    return pid;
+}
+
+/* List the pids in procdir_path. `*out` is set to an array of pids sorted in
+ * ascending order, which stays valid until the next call.
+ * Returns the number of pids or -errno on error.
+ *
+ * This calls getdents64() directly into a large buffer that is reused
+ * across calls, instead of going through opendir()/readdir(), which
+ * allocates a DIR buffer each time and returns one entry at a time.
+ */
+int procfs_list_pids(int** out)
+{
+    static char buf[DENTS_BUFSIZ] __attribute__((aligned(8)));
+    static int* pids;
+    static int pids_cap;
+
+    int dirfd = procfs_dirfd();
+    if (dirfd < 0) {
+        return dirfd;
+    }
+    if (lseek(dirfd, 0, SEEK_SET) < 0) {
+        return -errno;
+    }
+
+    int n = 0;
+    bool sorted = true;
+    while (1) {
+        long nread = syscall(SYS_getdents64, dirfd, buf, sizeof(buf));
+        if (nread < 0) {
+            return -errno;
+        }
+        if (nread == 0) {
+            break;
+        }
+        for (long pos = 0; pos < nread;) {
+            struct linux_dirent64* d = (struct linux_dirent64*)(buf + pos);
+            pos += d->d_reclen;
+            if (d->d_type != DT_DIR && d->d_type != DT_UNKNOWN) {
+                continue;
+            }
+            int pid = parse_pid(d->d_name);
+            if (pid < 0) {
+                continue;
+            }
+            if (n == pids_cap) {
+                int want = pids_cap ? pids_cap * 2 : 1024;
+                int* fresh = realloc(pids, (size_t)want * sizeof(*pids));
+                if (fresh == NULL) {
+                    warn("%s: could not grow pid list to %d entries\n", __func__, want);
+                    return -ENOMEM;
+                }
+                pids = fresh;
+                pids_cap = want;
+            }
+            if (n > 0 && pid < pids[n - 1]) {
+                sorted = false;
+            }
+            pids[n++] = pid;
+        }
+    }
+    // /proc lists pids in ascending order, but mock directories
+    // in the test suite do not.
+    if (!sorted) {
+        qsort(pids, (size_t)n, sizeof(*pids), cmp_int);
+    }
+    *out = pids;
+    return n;
+}
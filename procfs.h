@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef PROCFS_H
+#define PROCFS_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+int procfs_dirfd(void);
+int procfs_open_pid_file(int pid, const char* name);
+ssize_t procfs_read_pid_file(int pid, const char* name, char* buf, size_t len);
+int procfs_stat_pid(int pid, struct stat* st);
+int procfs_list_pids(int** out);
+unsigned long procfs_calls(void);
+
+#endif
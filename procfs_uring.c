@@ -0,0 +1,395 @@
+// SPDX-License-Identifier: MIT
+
+/* Batched reads of /proc/[pid] files with io_uring (--io-uring).
+ *
+ * Reading /proc/[pid]/stat and /proc/[pid]/oom_score costs six syscalls
+ * per process (open, read, close for each). procfs_uring_prefetch() instead
+ * queues openat -> read -> close chains for a batch of pids and submits
+ * them with a single io_uring_enter(). The files are opened into the ring's
+ * fixed file table ("direct descriptors"), so the read can refer to the
+ * file before the open has completed.
+ *
+ * procfs_read_pid_file() then hands out the prefetched contents instead of
+ * reading the files. We talk to the kernel with raw syscalls, so there is
+ * no dependency on liburing.
+ *
+ * Needs Linux 5.19+ for the sparse file table. If io_uring is not
+ * available, disabled (kernel.io_uring_disabled) or blocked by seccomp,
+ * procfs_uring_open() fails and everything stays synchronous.
+ *
+ * Not thread-safe: only the main thread may use the ring. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "msg.h"
+#include "procfs.h"
+#include "procfs_uring.h"
+
+#include <linux/io_uring.h>
+
+#if defined(IORING_FILE_INDEX_ALLOC) && defined(IORING_RSRC_REGISTER_SPARSE)
+
+#ifndef SYS_io_uring_setup
+#define SYS_io_uring_setup 425
+#define SYS_io_uring_enter 426
+#define SYS_io_uring_register 427
+#endif
+
+// The files we prefetch for every pid, and how much of them
+static const struct {
+    const char* name;
+    size_t len;
+} files[] = {
+    // parse_proc_pid_stat_comm() uses 512 bytes
+    { "stat", 512 },
+    { "oom_score", 32 },
+};
+#define N_FILES (int)(sizeof(files) / sizeof(files[0]))
+#define SLOTS (PROCFS_URING_BATCH * N_FILES)
+// Every file takes three SQEs: openat, read, close
+#define SQ_ENTRIES (SLOTS * 3)
+
+// What the low bits of a CQE's user_data say
+enum { OP_OPEN,
+    OP_READ,
+    OP_CLOSE };
+
+static struct {
+    int fd;
+    // The mappings of the rings and of the SQE array
+    char* rings;
+    size_t rings_len;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+} ring = { .fd = -1 };
+
+// The prefetched files of the current batch. Slot i holds file i % N_FILES
+// of pids[i / N_FILES].
+static int batch_pids[PROCFS_URING_BATCH];
+static int batch_n;
+static struct {
+    char path[32];
+    char buf[512];
+    // Bytes read or -errno
+    ssize_t res;
+    // Already handed out by procfs_uring_lookup()
+    bool used;
+} slots[SLOTS];
+
+static int uring_enter(unsigned to_submit, unsigned min_complete)
+{
+    long ret = syscall(SYS_io_uring_enter, ring.fd, to_submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+        return -errno;
+    }
+    return (int)ret;
+}
+
+/* Set up the ring and its fixed file table.
+ * Returns 0 on success or -errno, in which case procfs_read_pid_file()
+ * keeps reading synchronously.
+ */
+int procfs_uring_open(void)
+{
+    if (ring.fd >= 0) {
+        return 0;
+    }
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    long fd = syscall(SYS_io_uring_setup, SQ_ENTRIES, &p);
+    if (fd < 0) {
+        return -errno;
+    }
+    ring.fd = (int)fd;
+    int err = 0;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_SUBMIT_STABLE)) {
+        err = -ENOSYS;
+        goto fail;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.rings_len = sq_len > cq_len ? sq_len : cq_len;
+    ring.rings = mmap(NULL, ring.rings_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.rings == MAP_FAILED) {
+        ring.rings = NULL;
+        err = -errno;
+        goto fail;
+    }
+    ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        err = -errno;
+        goto fail;
+    }
+    char* rings = ring.rings;
+    ring.sq_tail = (unsigned*)(rings + p.sq_off.tail);
+    ring.sq_mask = (unsigned*)(rings + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(rings + p.sq_off.array);
+    ring.cq_head = (unsigned*)(rings + p.cq_off.head);
+    ring.cq_tail = (unsigned*)(rings + p.cq_off.tail);
+    ring.cq_mask = (unsigned*)(rings + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(rings + p.cq_off.cqes);
+
+    // An empty fixed file table for the direct descriptors
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = SLOTS;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(SYS_io_uring_register, ring.fd, IORING_REGISTER_FILES2, &reg, sizeof(reg)) < 0) {
+        err = -errno;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    procfs_uring_close();
+    return err;
+}
+
+// Tear down the ring. Requests still in flight are cancelled by the kernel.
+void procfs_uring_close(void)
+{
+    batch_n = 0;
+    if (ring.sqes) {
+        munmap(ring.sqes, ring.sqes_len);
+    }
+    if (ring.rings) {
+        munmap(ring.rings, ring.rings_len);
+    }
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+bool procfs_uring_active(void)
+{
+    return ring.fd >= 0;
+}
+
+// Queue one SQE. The caller makes sure there is room.
+static struct io_uring_sqe* next_sqe(unsigned* tail)
+{
+    unsigned idx = *tail & *ring.sq_mask;
+    struct io_uring_sqe* sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    (*tail)++;
+    return sqe;
+}
+
+/* Read the files we need for the `n` pids (at most PROCFS_URING_BATCH)
+ * in one go. They are handed out by procfs_read_pid_file() until the next
+ * call or procfs_uring_forget().
+ * Returns 0 on success or -errno. On error, nothing is prefetched.
+ */
+int procfs_uring_prefetch(const int* pids, int n)
+{
+    batch_n = 0;
+    if (ring.fd < 0) {
+        return -ENOSYS;
+    }
+    int dirfd = procfs_dirfd();
+    if (dirfd < 0) {
+        return dirfd;
+    }
+    if (n > PROCFS_URING_BATCH) {
+        n = PROCFS_URING_BATCH;
+    }
+
+    unsigned tail = *ring.sq_tail;
+    for (int i = 0; i < n * N_FILES; i++) {
+        int file = i % N_FILES;
+        snprintf(slots[i].path, sizeof(slots[i].path), "%d/%s", pids[i / N_FILES], files[file].name);
+        slots[i].res = -ECANCELED;
+        slots[i].used = false;
+
+        struct io_uring_sqe* sqe = next_sqe(&tail);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = dirfd;
+        sqe->addr = (uint64_t)(uintptr_t)slots[i].path;
+        // Direct descriptors are no fds, and O_CLOEXEC is refused for them
+        sqe->open_flags = O_RDONLY;
+        sqe->file_index = (uint32_t)i + 1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = (uint64_t)i << 2 | OP_OPEN;
+
+        sqe = next_sqe(&tail);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = i;
+        sqe->addr = (uint64_t)(uintptr_t)slots[i].buf;
+        sqe->len = (uint32_t)files[file].len - 1;
+        sqe->off = 0;
+        // Reads are always short, which would break a normal link and
+        // leave the file open
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        sqe->user_data = (uint64_t)i << 2 | OP_READ;
+
+        sqe = next_sqe(&tail);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = (uint32_t)i + 1;
+        sqe->user_data = (uint64_t)i << 2 | OP_CLOSE;
+    }
+    unsigned to_submit = (unsigned)(n * N_FILES * 3);
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+    // Submit everything and wait for all completions
+    unsigned submitted = 0, completed = 0;
+    while (completed < to_submit) {
+        int ret = uring_enter(to_submit - submitted, to_submit - completed);
+        if (ret < 0 && ret != -EINTR) {
+            // Closing the ring cancels whatever is still in flight and
+            // frees the file table. From now on, we read synchronously.
+            warn("%s: io_uring_enter: %s. Disabling io_uring\n", __func__, strerror(-ret));
+            procfs_uring_close();
+            return ret;
+        }
+        if (ret > 0) {
+            submitted += (unsigned)ret;
+        }
+        unsigned head = *ring.cq_head;
+        unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            int i = (int)(cqe->user_data >> 2);
+            switch (cqe->user_data & 3) {
+            case OP_OPEN:
+                if (cqe->res < 0) {
+                    // The process is gone. The read reports -ECANCELED.
+                    slots[i].res = cqe->res;
+                }
+                break;
+            case OP_READ:
+                if (cqe->res != -ECANCELED) {
+                    slots[i].res = cqe->res;
+                }
+                break;
+            default:
+                break;
+            }
+            completed++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    for (int i = 0; i < n * N_FILES; i++) {
+        if (slots[i].res >= 0) {
+            slots[i].buf[slots[i].res] = 0;
+        }
+    }
+    memcpy(batch_pids, pids, (size_t)n * sizeof(*pids));
+    batch_n = n;
+    return 0;
+}
+
+/* Hand out a prefetched /proc/[pid]/[name], like procfs_read_pid_file().
+ * Each file is handed out only once, so later reads see fresh data.
+ * Returns false if it has not been prefetched.
+ */
+bool procfs_uring_lookup(int pid, const char* name, char* buf, size_t len, ssize_t* res)
+{
+    if (batch_n == 0) {
+        return false;
+    }
+    int file = 0;
+    while (file < N_FILES && strcmp(files[file].name, name) != 0) {
+        file++;
+    }
+    if (file == N_FILES) {
+        return false;
+    }
+    // The pids come from procfs_list_pids() and are sorted
+    int lo = 0, hi = batch_n - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (batch_pids[mid] < pid) {
+            lo = mid + 1;
+        } else if (batch_pids[mid] > pid) {
+            hi = mid - 1;
+        } else {
+            int i = mid * N_FILES + file;
+            if (slots[i].used) {
+                return false;
+            }
+            slots[i].used = true;
+            if (slots[i].res < 0) {
+                buf[0] = 0;
+                *res = slots[i].res;
+                return true;
+            }
+            size_t n = (size_t)slots[i].res;
+            if (n > len - 1) {
+                n = len - 1;
+            }
+            memcpy(buf, slots[i].buf, n);
+            buf[n] = 0;
+            *res = (ssize_t)n;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Drop the prefetched files
+void procfs_uring_forget(void)
+{
+    batch_n = 0;
+}
+
+#else
+
+#warning "Your kernel headers are too old for io_uring direct descriptors. --io-uring will not work."
+
+int procfs_uring_open(void)
+{
+    return -ENOSYS;
+}
+
+bool procfs_uring_active(void)
+{
+    return false;
+}
+
+int procfs_uring_prefetch(const int* pids, int n)
+{
+    (void)pids;
+    (void)n;
+    return -ENOSYS;
+}
+
+bool procfs_uring_lookup(int pid, const char* name, char* buf, size_t len, ssize_t* res)
+{
+    (void)pid;
+    (void)name;
+    (void)buf;
+    (void)len;
+    (void)res;
+    return false;
+}
+
+void procfs_uring_forget(void)
+{
+}
+
+void procfs_uring_close(void)
+{
+}
+
+#endif
@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef PROCFS_URING_H
+#define PROCFS_URING_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Number of pids procfs_uring_prefetch() reads at once
+#define PROCFS_URING_BATCH 64
+
+int procfs_uring_open(void);
+bool procfs_uring_active(void);
+int procfs_uring_prefetch(const int* pids, int n);
+bool procfs_uring_lookup(int pid, const char* name, char* buf, size_t len, ssize_t* res);
+void procfs_uring_forget(void);
+void procfs_uring_close(void);
+
+#endif
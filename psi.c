@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: MIT
+
+/* Memory pressure stall information (PSI) triggers.
+ *
+ * Writing a trigger like "some 150000 1000000" to /proc/pressure/memory
+ * makes the kernel wake up poll() on that fd with POLLPRI when tasks have
+ * been stalled on memory for at least 150 ms within a 1 s window.
+ * See https://docs.kernel.org/accounting/psi.html . */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "meminfo.h"
+#include "psi.h"
+
+// Register `trigger` on procdir_path/pressure/memory.
+// Returns the fd to poll on, or -errno.
+// ENOENT means that the kernel has no PSI support (or it is disabled).
+int psi_trigger_open(const char* trigger)
+{
+    char path[PATH_LEN] = { 0 };
+    snprintf(path, sizeof(path), "%s/pressure/memory", procdir_path);
+    int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    // The kernel wants the trailing null byte
+    if (write(fd, trigger, strlen(trigger) + 1) < 0) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    return fd;
+}
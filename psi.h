@@ -0,0 +1,7 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef PSI_H
+#define PSI_H
+
+int psi_trigger_open(const char* trigger);
+
+#endif
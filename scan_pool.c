@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: MIT
+
+/* A small, fixed pool of worker threads for the victim scan.
+ *
+ * The threads are created once at startup (after mlockall(), so their
+ * stacks are locked as well) and then sleep until scan_pool_run() hands
+ * them work. The calling thread works along, so a pool of N threads has
+ * N-1 helper threads.
+ *
+ * Items are handed out in chunks from a shared counter, so a thread that
+ * got slow /proc files does not hold up the others. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "msg.h"
+#include "scan_pool.h"
+
+// Number of items a thread claims at once. Small enough to balance
+// the load, large enough that the shared counter is not contended.
+#define SCAN_POOL_CHUNK 64
+// The workers only read small /proc files into stack buffers
+#define SCAN_POOL_STACK_SIZE (256 * 1024)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a new job is posted
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+// Signalled when the last helper has finished the job
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+// Number of helper threads (not counting the caller of scan_pool_run)
+static int n_helpers;
+// Incremented for every job, so helpers can tell a new job from a spurious wakeup
+static unsigned long job_seq;
+// Number of helpers still working on the current job
+static int busy;
+
+// The current job
+static scan_pool_fn_t job_fn;
+static void* job_arg;
+static int job_n;
+static int job_next;
+
+// Claim and process chunks of the current job until none are left.
+static void run_chunks(void)
+{
+    while (1) {
+        int begin = __atomic_fetch_add(&job_next, SCAN_POOL_CHUNK, __ATOMIC_RELAXED);
+        if (begin >= job_n) {
+            return;
+        }
+        int end = begin + SCAN_POOL_CHUNK;
+        if (end > job_n) {
+            end = job_n;
+        }
+        job_fn(job_arg, begin, end);
+    }
+}
+
+static void* helper_main(void* unused)
+{
+    (void)unused;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (job_seq == seen) {
+            pthread_cond_wait(&work_cond, &lock);
+        }
+        seen = job_seq;
+        pthread_mutex_unlock(&lock);
+
+        run_chunks();
+
+        pthread_mutex_lock(&lock);
+        busy--;
+        if (busy == 0) {
+            pthread_cond_signal(&done_cond);
+        }
+    }
+    return NULL;
+}
+
+// Start the pool with `nthreads` threads in total, including the caller.
+// Calling it again after the pool has been started does nothing.
+// Returns 0 on success or -errno.
+int scan_pool_init(int nthreads)
+{
+    if (n_helpers > 0 || nthreads <= 1) {
+        return 0;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, SCAN_POOL_STACK_SIZE);
+
+    // Signals (SIGCHLD for reaping the notification helpers) must keep
+    // going to the main thread. New threads inherit our signal mask,
+    // so block everything while creating them.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    int ret = 0;
+    for (int i = 0; i < nthreads - 1; i++) {
+        pthread_t t;
+        int err = pthread_create(&t, &attr, helper_main, NULL);
+        if (err != 0) {
+            warn("%s: could not create thread %d: %s\n", __func__, i + 1, strerror(err));
+            ret = -err;
+            break;
+        }
+        pthread_mutex_lock(&lock);
+        n_helpers++;
+        pthread_mutex_unlock(&lock);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    return ret;
+}
+
+// Number of threads scan_pool_run() uses, including the caller.
+int scan_pool_threads(void)
+{
+    return n_helpers + 1;
+}
+
+// Call `fn` on all items in [0, n), split into chunks, using all threads of
+// the pool. Returns when all items have been processed.
+// Without a pool, this just calls fn(arg, 0, n).
+void scan_pool_run(scan_pool_fn_t fn, void* arg, int n)
+{
+    if (n_helpers == 0 || n <= SCAN_POOL_CHUNK) {
+        fn(arg, 0, n);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    job_fn = fn;
+    job_arg = arg;
+    job_n = n;
+    job_next = 0;
+    busy = n_helpers;
+    job_seq++;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&lock);
+
+    run_chunks();
+
+    pthread_mutex_lock(&lock);
+    while (busy > 0) {
+        pthread_cond_wait(&done_cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef SCAN_POOL_H
+#define SCAN_POOL_H
+
+// Upper limit for --scan-threads. Reading /proc does not scale much further.
+#define SCAN_THREADS_MAX 64
+
+// Work function for scan_pool_run(). Processes the items [begin, end).
+typedef void (*scan_pool_fn_t)(void* arg, int begin, int end);
+
+int scan_pool_init(int nthreads);
+int scan_pool_threads(void);
+void scan_pool_run(scan_pool_fn_t fn, void* arg, int n);
+
+#endif
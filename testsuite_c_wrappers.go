@@ -3,14 +3,57 @@ package earlyoom_testsuite
 import (
 	"fmt"
 	"strings"
+	"unsafe"
 )
 
 // #cgo CFLAGS: -std=gnu99 -DCGO
+// #cgo LDFLAGS: -pthread
+// #include "cgroup.h"
+// #include "cgroup_watch.h"
 // #include "meminfo.h"
 // #include "kill.h"
+// #include "monitor.h"
 // #include "msg.h"
+// #include "oom_score.h"
 // #include "globals.h"
+// #include "fill_rate.h"
 // #include "proc_pid.h"
+// #include "proc_cache.h"
+// #include "proc_events.h"
+// #include "procfs.h"
+// #include "procfs_uring.h"
+// #include "psi.h"
+// #include "scan_pool.h"
+//
+// #include <ctype.h>
+// #include <dirent.h>
+// #include <signal.h>
+// #include <stdlib.h>
+//
+// // The opendir()/readdir() loop that find_largest_process() used before
+// // procfs_list_pids(). Only used as a baseline in benchmarks.
+// static int readdir_count_pids(void) {
+//     DIR* procdir = opendir(procdir_path);
+//     if (procdir == NULL) {
+//         return -1;
+//     }
+//     int n = 0;
+//     struct dirent* d;
+//     while ((d = readdir(procdir)) != NULL) {
+//         int numeric = d->d_name[0] != 0;
+//         for (char* c = d->d_name; *c; c++) {
+//             if (!isdigit(*c)) {
+//                 numeric = 0;
+//                 break;
+//             }
+//         }
+//         if (numeric && strtol(d->d_name, NULL, 10) > 0) {
+//             n++;
+//         }
+//     }
+//     closedir(procdir);
+//     return n;
+// }
 import "C"
 
 func init() {
@@ -54,6 +97,12 @@ func parse_meminfo() C.meminfo_t {
 	return C.parse_meminfo()
 }
 
+func parse_meminfo_buf(buf string) C.meminfo_t {
+	cbuf := C.CString(buf)
+	defer C.free(unsafe.Pointer(cbuf))
+	return C.parse_meminfo_buf(cbuf, C.size_t(len(buf)))
+}
+
 // Wrapper so _test.go code can create a poll_loop_args_t
 // struct. _test.go code cannot use C.
 func poll_loop_args_t(sort_by_rss bool) (args C.poll_loop_args_t) {
@@ -73,6 +122,13 @@ func procinfo_t() C.procinfo_t {
 	return C.procinfo_t{}
 }
 
+// procinfo_close_zero calls procinfo_close() on a zero-initialized
+// procinfo_t.
+func procinfo_close_zero() {
+	var p C.procinfo_t
+	C.procinfo_close(&p)
+}
+
 func is_larger(args *C.poll_loop_args_t, victim mockProcProcess, cur mockProcProcess) bool {
 	cVictim := victim.toProcinfo_t()
 	cCur := cur.toProcinfo_t()
@@ -81,20 +137,509 @@ func is_larger(args *C.poll_loop_args_t, victim mockProcProcess, cur mockProcPro
 
 func find_largest_process() {
 	var args C.poll_loop_args_t
-	C.find_largest_process(&args)
+	victim := C.find_largest_process(&args)
+	C.procinfo_close(&victim)
 }
 
-func kill_process() {
+func find_largest_process_ignore_root() {
+	var args C.poll_loop_args_t
+	args.ignore_root_user = true
+	victim := C.find_largest_process(&args)
+	C.procinfo_close(&victim)
+}
+
+// find_largest_process_pid returns the pid of the victim, using
+// `scan_threads` threads (see scan_pool_init).
+func find_largest_process_pid(sort_by_rss bool, scan_threads int) int {
+	var args C.poll_loop_args_t
+	args.sort_by_rss = C.bool(sort_by_rss)
+	args.scan_threads = C.int(scan_threads)
+	victim := C.find_largest_process(&args)
+	C.procinfo_close(&victim)
+	return int(victim.pid)
+}
+
+// find_largest_process_candidates returns the pid of the victim, and
+// remembers `candidates` processes for next_candidate().
+func find_largest_process_candidates(candidates int, scan_threads int) int {
+	var args C.poll_loop_args_t
+	args.candidates = C.int(candidates)
+	args.scan_threads = C.int(scan_threads)
+	victim := C.find_largest_process(&args)
+	C.procinfo_close(&victim)
+	return int(victim.pid)
+}
+
+// find_largest_process_estimated returns the pid of the victim, found
+// with --estimate-oom-score.
+func find_largest_process_estimated(candidates int) int {
+	var args C.poll_loop_args_t
+	args.candidates = C.int(candidates)
+	args.estimate_oom_score = true
+	victim := C.find_largest_process(&args)
+	C.procinfo_close(&victim)
+	return int(victim.pid)
+}
+
+// Like find_largest_process_candidates, but with --sort-by-rss
+func find_largest_process_rss_candidates(candidates int, scan_threads int) int {
+	var args C.poll_loop_args_t
+	args.sort_by_rss = true
+	args.candidates = C.int(candidates)
+	args.scan_threads = C.int(scan_threads)
+	victim := C.find_largest_process(&args)
+	C.procinfo_close(&victim)
+	return int(victim.pid)
+}
+
+// find_largest_process_budget returns the pid of the victim found within
+// `budget_ms` (--scan-budget).
+func find_largest_process_budget(budget_ms int, sort_by_rss bool, scan_threads int) int {
+	var args C.poll_loop_args_t
+	args.scan_budget_ms = C.int(budget_ms)
+	args.sort_by_rss = C.bool(sort_by_rss)
+	args.scan_threads = C.int(scan_threads)
+	victim := C.find_largest_process(&args)
+	C.procinfo_close(&victim)
+	return int(victim.pid)
+}
+
+func scan_budget_hits() int {
+	return int(C.scan_budget_hits())
+}
+
+// next_candidate returns the pid of the next candidate, or 0.
+func next_candidate() int {
+	var args C.poll_loop_args_t
+	var victim C.procinfo_t
+	if !C.next_candidate(&args, &victim) {
+		return 0
+	}
+	C.procinfo_close(&victim)
+	return int(victim.pid)
+}
+
+// find_preferred selects a victim with --prefer `regex`. Returns the
+// victim, its pid, and if it has been pinned with a pidfd.
+// The caller must call kill_victim() or procinfo_close() on it.
+func find_preferred(regex string) (victim C.procinfo_t, pid int, pinned bool) {
+	var args C.poll_loop_args_t
+	// args is passed to C, so it must not point to Go memory
+	re := (*C.regex_t)(C.malloc(C.sizeof_regex_t))
+	defer C.free(unsafe.Pointer(re))
+	cregex := C.CString(regex)
+	defer C.free(unsafe.Pointer(cregex))
+	if C.regcomp(re, cregex, C.REG_EXTENDED|C.REG_NOSUB) != 0 {
+		panic("regcomp failed")
+	}
+	defer C.regfree(re)
+	args.prefer_regex = re
+	victim = C.find_largest_process(&args)
+	return victim, int(victim.pid), bool(victim.has_pidfd)
+}
+
+// kill_victim kills `victim` with SIGKILL (or SIGTERM if sigterm is set)
+// and waits for it to exit
+func kill_victim(victim C.procinfo_t, sigterm bool) {
+	var args C.poll_loop_args_t
+	var sig C.int = C.SIGKILL
+	if sigterm {
+		sig = C.SIGTERM
+	}
+	C.kill_process(&args, sig, &victim)
+	C.procinfo_close(&victim)
+}
+
+func procinfo_close(victim C.procinfo_t) {
+	C.procinfo_close(&victim)
+}
+
+func scan_pool_init(nthreads int) int {
+	return int(C.scan_pool_init(C.int(nthreads)))
+}
+
+func procfs_uring_open() int {
+	return int(C.procfs_uring_open())
+}
+
+func procfs_uring_close() {
+	C.procfs_uring_close()
+}
+
+func prerank_reset() {
+	C.prerank_reset()
+}
+
+func prerank_step(budget_us int) {
+	var args C.poll_loop_args_t
+	C.prerank_step(&args, C.longlong(budget_us))
+}
+
+// prerank_victim returns the pid of the pre-ranked victim, or 0.
+func prerank_victim() int {
 	var args C.poll_loop_args_t
 	var victim C.procinfo_t
+	if !C.prerank_victim(&args, &victim) {
+		return 0
+	}
+	C.procinfo_close(&victim)
+	return int(victim.pid)
+}
+
+func kill_process() {
+	var args C.poll_loop_args_t
+	victim := procinfo_t()
 	victim.pid = 1
 	C.kill_process(&args, 0, &victim)
 }
 
+func monitor_open() int {
+	return int(C.monitor_open())
+}
+
+func monitor_close() {
+	C.monitor_close()
+}
+
+// monitor_publish publishes a sample of the real /proc/meminfo that calls
+// for signal `sig`
+func monitor_publish(sig int) {
+	s := C.monitor_sample_t{m: C.parse_meminfo(), sig: C.int(sig)}
+	C.monitor_publish(&s)
+}
+
+func monitor_sample_sig() int {
+	return int(C.monitor_sample().sig)
+}
+
+func monitor_request_kill() {
+	C.monitor_request_kill()
+}
+
+func monitor_kill_pending() bool {
+	return bool(C.monitor_kill_pending())
+}
+
+func monitor_take_request() {
+	C.monitor_take_request()
+}
+
+func monitor_wait(timeout_ms int) int {
+	return int(C.monitor_wait(C.int(timeout_ms), -1))
+}
+
+func monitor_wake() {
+	C.monitor_wake()
+}
+
+// monitor_victim returns the pid and signal of the victim kill_wait()
+// is waiting for
+func monitor_victim() (pid int, sig int) {
+	v := C.monitor_victim()
+	return int(v.pid), int(v.sig)
+}
+
+// kill_process_sigterm sends SIGTERM to `pid`, waits for it to exit and
+// returns the result of kill_process()
+func kill_process_sigterm(pid int, pipeline bool) int {
+	var args C.poll_loop_args_t
+	args.pipeline = C.bool(pipeline)
+	victim := procinfo_t()
+	victim.pid = C.int(pid)
+	C.parse_proc_pid_stat(&victim.stat, C.int(pid))
+	return int(C.kill_process(&args, C.SIGTERM, &victim))
+}
+
+// batch_args returns the arguments for --batch-kill with the SIGTERM limits
+// at 10 %
+func batch_args(margin_percent int) (args C.poll_loop_args_t) {
+	args.mem_term_percent = 10
+	args.swap_term_percent = 10
+	args.candidates = C.BATCH_KILL_CANDIDATES_DEFAULT
+	args.batch_kill_percent = C.int(margin_percent)
+	return
+}
+
+// batch_meminfo returns a memory situation with `avail_kib` of `total_kib`
+// available, and no swap
+func batch_meminfo(avail_kib int64, total_kib int64) (m C.meminfo_t) {
+	m.MemTotalKiB = C.longlong(total_kib)
+	m.UserMemTotalKiB = C.longlong(total_kib)
+	m.MemAvailableKiB = C.longlong(avail_kib)
+	m.MemAvailablePercent = C.double(100 * float64(avail_kib) / float64(total_kib))
+	return
+}
+
+// batch_select_pids returns the pids kill_batch() would kill
+func batch_select_pids(margin_percent int, avail_kib int64, total_kib int64) (pids []int) {
+	args := batch_args(margin_percent)
+	m := batch_meminfo(avail_kib, total_kib)
+	victim := C.find_largest_process(&args)
+	defer C.procinfo_close(&victim)
+	var batch [C.CANDIDATES_MAX]C.procinfo_t
+	n := int(C.batch_select(&args, &m, &victim, &batch[0]))
+	for i := 0; i < n; i++ {
+		pids = append(pids, int(batch[i].pid))
+		if i > 0 {
+			C.procinfo_close(&batch[i])
+		}
+	}
+	return
+}
+
+func kill_batch(margin_percent int, avail_kib int64, total_kib int64) int {
+	args := batch_args(margin_percent)
+	m := batch_meminfo(avail_kib, total_kib)
+	victim := C.find_largest_process(&args)
+	defer C.procinfo_close(&victim)
+	return int(C.kill_batch(&args, C.SIGKILL, &m, &victim))
+}
+
+// kill_process_group kills the process group of `pid` with SIGKILL (-g)
+// and returns the result of kill_process()
+func kill_process_group(pid int) int {
+	var args C.poll_loop_args_t
+	args.kill_process_group = true
+	victim := procinfo_t()
+	victim.pid = C.int(pid)
+	return int(C.kill_process(&args, C.SIGKILL, &victim))
+}
+
+// cgroup_find_largest returns the cgroup below `root` that --cgroup-kill
+// would kill, and the result of cgroup_find_largest(). With `hints`, call
+// cgroup_hints_init(root) first.
+func cgroup_find_largest(root string, hints bool) (name string, mem_kib int64, swap_kib int64, res int) {
+	croot := C.CString(root)
+	defer C.free(unsafe.Pointer(croot))
+	var cg C.cgroup_info_t
+	res = int(C.cgroup_find_largest(croot, C.bool(hints), &cg))
+	if res < 0 {
+		return
+	}
+	return C.GoString(C.cgroup_name(&cg)), int64(cg.mem_kib), int64(cg.swap_kib), res
+}
+
+// kill_cgroup kills all processes in the cgroup directory `dir` with
+// SIGKILL and returns the result of kill_cgroup()
+func kill_cgroup(dir string) int {
+	var cg C.cgroup_info_t
+	cdir := C.CString(dir)
+	defer C.free(unsafe.Pointer(cdir))
+	for i := 0; i < len(dir) && i < len(cg.dir)-1; i++ {
+		cg.dir[i] = C.char(dir[i])
+	}
+	var cpids *C.int
+	cg.nprocs = C.cgroup_read_procs(cdir, &cpids)
+	if cg.nprocs > 0 {
+		cg.pid = *cpids
+	}
+	C.free(unsafe.Pointer(cpids))
+	var args C.poll_loop_args_t
+	return int(C.kill_cgroup(&args, C.SIGKILL, &cg))
+}
+
+func cgroup_hints_init(mount string) {
+	cmount := C.CString(mount)
+	defer C.free(unsafe.Pointer(cmount))
+	C.cgroup_hints_init(cmount)
+}
+
+// find_largest_process_hints returns the pid of the victim with or
+// without --cgroup-hints
+func find_largest_process_hints(cgroup_hints bool) int {
+	var args C.poll_loop_args_t
+	args.cgroup_hints = C.bool(cgroup_hints)
+	victim := C.find_largest_process(&args)
+	C.procinfo_close(&victim)
+	return int(victim.pid)
+}
+
+func cgroup_read_procs_below(dir string) []int {
+	cdir := C.CString(dir)
+	defer C.free(unsafe.Pointer(cdir))
+	var cpids *C.int
+	n := int(C.cgroup_read_procs_below(cdir, &cpids))
+	if n <= 0 {
+		return nil
+	}
+	defer C.free(unsafe.Pointer(cpids))
+	pids := make([]int, n)
+	for i, v := range (*[1 << 28]C.int)(unsafe.Pointer(cpids))[:n:n] {
+		pids[i] = int(v)
+	}
+	return pids
+}
+
+func cgroup_watch_add(dir string, term_percent float64, kill_percent float64) int {
+	cdir := C.CString(dir)
+	defer C.free(unsafe.Pointer(cdir))
+	return int(C.cgroup_watch_add(cdir, C.double(term_percent), C.double(kill_percent)))
+}
+
+// cgroup_watch_sample reads watched cgroup `idx` and returns the signal
+// its usage calls for
+func cgroup_watch_sample(idx int) (sig int, avail_percent float64, res int) {
+	var u C.cgroup_usage_t
+	res = int(C.cgroup_watch_sample(C.int(idx), &u))
+	if res < 0 {
+		return 0, 0, res
+	}
+	return int(C.cgroup_watch_sig(C.int(idx), &u)), float64(u.avail_percent), res
+}
+
+// cgroup_watch_next returns the directory and signal of the next due
+// cgroup that is at or below its limits, or "" if there is none
+func cgroup_watch_next(now_ms int64) (dir string, sig int) {
+	var hit C.cgroup_watch_hit_t
+	if !C.cgroup_watch_next(C.longlong(now_ms), &hit) {
+		return "", 0
+	}
+	return C.GoString(hit.dir), int(hit.sig)
+}
+
+func cgroup_watch_drain(now_ms int64) int {
+	return int(C.cgroup_watch_drain(C.longlong(now_ms)))
+}
+
+func cgroup_watch_timeout_ms(now_ms int64) int {
+	return int(C.cgroup_watch_timeout_ms(C.longlong(now_ms)))
+}
+
+func cgroup_watch_reset() {
+	C.cgroup_watch_reset()
+}
+
+func monitor_now_ms() int64 {
+	return int64(C.monitor_now_ms())
+}
+
+func get_cgroup(pid int) (string, int) {
+	var buf [C.PATH_LEN]C.char
+	res := int(C.get_cgroup(C.int(pid), &buf[0], C.PATH_LEN))
+	return C.GoString(&buf[0]), res
+}
+
+func procfs_list_pids() []int {
+	var cpids *C.int
+	n := int(C.procfs_list_pids(&cpids))
+	if n < 0 {
+		return nil
+	}
+	pids := make([]int, n)
+	// unsafe.Slice needs Go 1.17
+	for i, v := range (*[1 << 28]C.int)(unsafe.Pointer(cpids))[:n:n] {
+		pids[i] = int(v)
+	}
+	return pids
+}
+
+func procfs_calls() uint64 {
+	return uint64(C.procfs_calls())
+}
+
+func proc_events_open() int {
+	return int(C.proc_events_open())
+}
+
+func proc_events_list_pids() []int {
+	var cpids *C.int
+	n := int(C.proc_events_list_pids(&cpids))
+	pids := make([]int, n)
+	if n == 0 {
+		return pids
+	}
+	for i, v := range (*[1 << 28]C.int)(unsafe.Pointer(cpids))[:n:n] {
+		pids[i] = int(v)
+	}
+	return pids
+}
+
+func psi_trigger_open(trigger string) int {
+	ctrigger := C.CString(trigger)
+	defer C.free(unsafe.Pointer(ctrigger))
+	return int(C.psi_trigger_open(ctrigger))
+}
+
+const (
+	FILL_RATE_MIN          = C.FILL_RATE_MIN
+	FILL_RATE_HISTORY      = C.FILL_RATE_HISTORY
+	FILL_RATE_PREDICT_HITS = C.FILL_RATE_PREDICT_HITS
+)
+
+type fillRateEstimate struct {
+	memRate, memEwma, memMax    float64
+	swapRate, swapEwma, swapMax float64
+}
+
+// fill_rate_series feeds the samples {time_ms, MemAvailableKiB, SwapFreeKiB}
+// to a fresh fill_rate_t and returns the estimate.
+func fill_rate_series(samples [][3]int64, margin_percent int) (est fillRateEstimate, ok bool) {
+	var fr C.fill_rate_t
+	for _, s := range samples {
+		C.fill_rate_sample(&fr, C.longlong(s[0]), C.longlong(s[1]), C.longlong(s[2]))
+	}
+	var e C.fill_rate_estimate_t
+	ok = bool(C.fill_rate_estimate(&fr, C.int(margin_percent), &e))
+	est = fillRateEstimate{
+		memRate: float64(e.mem_rate), memEwma: float64(e.mem_ewma), memMax: float64(e.mem_max),
+		swapRate: float64(e.swap_rate), swapEwma: float64(e.swap_ewma), swapMax: float64(e.swap_max),
+	}
+	return
+}
+
+// fill_rate_predict_series feeds the samples {time_ms, MemAvailableKiB, SwapFreeKiB}
+// to a fresh fill_rate_t and runs fill_rate_predict() after each of them.
+// The SIGTERM limits are at floor_kib of MemAvailable + SwapFree.
+func fill_rate_predict_series(samples [][3]int64, floor_kib int64, limit_ms int) (fired []bool, etas []int64) {
+	var fr C.fill_rate_t
+	for _, s := range samples {
+		C.fill_rate_sample(&fr, C.longlong(s[0]), C.longlong(s[1]), C.longlong(s[2]))
+		headroom := s[1] + s[2] - floor_kib
+		if headroom < 0 {
+			headroom = 0
+		}
+		var eta C.longlong
+		fired = append(fired, bool(C.fill_rate_predict(&fr, C.longlong(headroom), C.int(limit_ms), &eta)))
+		etas = append(etas, int64(eta))
+	}
+	return
+}
+
+func readdir_count_pids() int {
+	return int(C.readdir_count_pids())
+}
+
+func proc_cache_flush() {
+	C.proc_cache_flush()
+}
+
 func get_oom_score(pid int) int {
 	return int(C.get_oom_score(C.int(pid)))
 }
 
+// oom_score_compute returns the oom_score of `pid` computed in userspace,
+// or -errno.
+func oom_score_compute(pid int) int {
+	m := C.parse_meminfo()
+	var out C.int
+	res := C.oom_score_compute(C.int(pid), C.oom_score_total_pages(&m), &out)
+	if res < 0 {
+		return int(res)
+	}
+	return int(out)
+}
+
+// oom_score_points returns the oom_score of a process using `pages` pages,
+// for the memory and swap sizes of this machine.
+func oom_score_points(pages int64, oom_score_adj int) int {
+	m := C.parse_meminfo()
+	return int(C.oom_score_points(C.oom_score_total_pages(&m), C.longlong(pages), C.int(oom_score_adj)))
+}
+
+func oom_score_selftest() int {
+	return int(C.oom_score_selftest())
+}
+
 func get_oom_score_adj(pid int, out *int) int {
 	var out2 C.int
 	res := C.get_oom_score_adj(C.int(pid), &out2)
@@ -128,6 +673,16 @@ func parse_proc_pid_stat_buf(buf string) (res bool, out C.pid_stat_t) {
 	return res, out
 }
 
+// parse_proc_pid_stat_buf_n parses buf n times, for benchmarking
+func parse_proc_pid_stat_buf_n(buf string, n int) (res bool, out C.pid_stat_t) {
+	cbuf := C.CString(buf)
+	defer C.free(unsafe.Pointer(cbuf))
+	for i := 0; i < n; i++ {
+		res = bool(C.parse_proc_pid_stat_buf(&out, cbuf))
+	}
+	return res, out
+}
+
 func parse_proc_pid_stat(pid int) (res bool, out C.pid_stat_t) {
 	res = bool(C.parse_proc_pid_stat(&out, C.int(pid)))
 	return res, out
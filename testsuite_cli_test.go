@@ -23,6 +23,13 @@ type cliTestCase struct {
 	stderrContains string
 	// stderr must be empty?
 	stderrEmpty bool
+	// stderr must not contain
+	stderrNotContains string
+	// stderr must contain one of these, if set. For options that fall
+	// back to the default behavior without privileges.
+	stderrContainsAny []string
+	// open file descriptors allowed on top of openFdsMax
+	fdsExtra int
 }
 
 func parseMeminfoLine(l string) int64 {
@@ -72,6 +79,8 @@ func TestCli(t *testing.T) {
 	swap2percent := fmt.Sprintf("%d", swapTotal*2/100)
 	tooBigInt32 := fmt.Sprintf("%d", uint64(math.MaxInt32+1))
 	tooBigUint32 := fmt.Sprintf("%d", uint64(math.MaxUint32+1))
+	cgroupRoot := mockCgroups(t, nil)
+	defer os.RemoveAll(cgroupRoot)
 	// earlyoom startup looks like this:
 	//   earlyoom v1.1-5-g74a364b-dirty
 	//   mem total: 7836 MiB, min: 783 MiB (10 %)
@@ -82,7 +91,7 @@ func TestCli(t *testing.T) {
 		// Both -h and --help should show the help text
 		{args: []string{"-h"}, code: 0, stderrContains: "this help text", stdoutEmpty: true},
 		{args: []string{"--help"}, code: 0, stderrContains: "this help text", stdoutEmpty: true},
-		{args: nil, code: -1, stderrContains: startupMsg, stdoutContains: memReport},
+		{args: nil, code: -1, stderrContains: startupMsg, stderrNotContains: "failed", stdoutContains: memReport},
 		{args: []string{"-p"}, code: -1, stdoutContains: memReport},
 		{args: []string{"-v"}, code: 0, stderrContains: "earlyoom v", stdoutEmpty: true},
 		{args: []string{"-d"}, code: -1, stdoutContains: "new victim"},
@@ -143,6 +152,46 @@ func TestCli(t *testing.T) {
 		// Test --use-kernel-oom option
 		{args: []string{"--kernel-oom"}, code: -1, stderrContains: "Using kernel OOM killer", stdoutContains: memReport},
 		{args: []string{"--kernel-oom", "--dryrun"}, code: -1, stderrContains: "dryrun", stdoutContains: memReport},
+		// Test --scan-threads
+		{args: []string{"--scan-threads", "4"}, code: -1, stderrContains: "using 4 threads", stdoutContains: memReport},
+		{args: []string{"--scan-threads", "1"}, code: -1, stderrContains: startupMsg, stdoutContains: memReport},
+		{args: []string{"--scan-threads", "0"}, code: 14, stderrContains: "--scan-threads", stdoutEmpty: true},
+		{args: []string{"--scan-threads", "65"}, code: 14, stderrContains: "--scan-threads", stdoutEmpty: true},
+		{args: []string{"--scan-threads", "2x"}, code: 14, stderrContains: "--scan-threads", stdoutEmpty: true},
+		{args: []string{"--candidates", "5"}, code: -1, stderrContains: startupMsg, stdoutContains: memReport},
+		{args: []string{"--candidates", "33"}, code: 14, stderrContains: "--candidates", stdoutEmpty: true},
+		{args: []string{"--scan-budget", "50"}, code: -1, stderrContains: "found within 50 ms", stdoutContains: memReport},
+		{args: []string{"--scan-budget", "0"}, code: 14, stderrContains: "--scan-budget", stdoutEmpty: true},
+		{args: []string{"--kill-check-interval", "20"}, code: -1, stderrContains: startupMsg, stdoutContains: memReport},
+		{args: []string{"--kill-check-interval", "0"}, code: 14, stderrContains: "--kill-check-interval", stdoutEmpty: true},
+		{args: []string{"--fill-rate-margin", "200"}, code: -1, stderrContains: "200% of the measured memory fill rate", stdoutContains: memReport},
+		{args: []string{"--fill-rate-margin", "50"}, code: 14, stderrContains: "--fill-rate-margin", stdoutEmpty: true},
+		{args: []string{"--predict", "2000"}, code: -1, stderrContains: "projected to reach the SIGTERM limits within 2000 ms", stdoutContains: memReport},
+		{args: []string{"--predict", "10"}, code: 14, stderrContains: "--predict", stdoutEmpty: true},
+		{args: []string{"--psi-trigger", "bogus"}, code: -1, stderrContains: "Could not set up PSI trigger", stdoutContains: memReport},
+		{args: []string{"--prerank"}, code: -1, stderrContains: "Pre-ranking processes", stdoutContains: memReport},
+		{args: []string{"--estimate-oom-score"}, code: -1, stderrContains: "Estimating oom_score", stdoutContains: memReport},
+		{args: []string{"--estimate-oom-score", "--sort-by-rss"}, code: -1, stderrContains: "has no effect", stdoutContains: memReport},
+		// Needs CAP_NET_ADMIN. One more fd for the netlink socket.
+		{args: []string{"--proc-events"}, code: -1, stdoutContains: memReport, fdsExtra: 1,
+			stderrContainsAny: []string{"Tracking processes using the proc connector", "Listing /proc instead"}},
+		// io_uring may be disabled (kernel.io_uring_disabled). One more fd for the ring.
+		{args: []string{"--io-uring"}, code: -1, stdoutContains: memReport, fdsExtra: 1,
+			stderrContainsAny: []string{"Reading /proc using io_uring", "Reading /proc synchronously"}},
+		// One more fd for the eventfd that wakes up the main thread
+		{args: []string{"--monitor-thread"}, code: -1, stderrContains: "Checking memory on a separate thread", stdoutContains: memReport, fdsExtra: 1},
+		{args: []string{"--monitor-thread", "--proc-events"}, code: -1, stderrContains: "Checking memory on a separate thread", stdoutContains: memReport, fdsExtra: 2},
+		{args: []string{"--pipeline"}, code: -1, stderrContains: "while the last one exits", stdoutContains: memReport},
+		{args: []string{"--batch-kill", "5"}, code: -1, stderrContains: "Killing up to 8 processes at once", stdoutContains: memReport},
+		{args: []string{"--batch-kill", "0"}, code: 14, stderrContains: "--batch-kill", stdoutEmpty: true},
+		{args: []string{"--cgroup-kill", cgroupRoot}, code: -1, stderrContains: "Killing whole cgroups below", stdoutContains: memReport},
+		{args: []string{"--cgroup-kill", cgroupRoot, "--cgroup-hints"}, code: -1, stderrContains: "Honoring the oomd xattrs", stdoutContains: memReport},
+		{args: []string{"--cgroup-kill", "/nonexistent"}, code: 14, stderrContains: "not a cgroup v2 directory", stdoutEmpty: true},
+		{args: []string{"--cgroup-limit", cgroupRoot}, code: 14, stderrContains: "expected DIR=PERCENT", stdoutEmpty: true},
+		{args: []string{"--cgroup-limit", cgroupRoot + "=101"}, code: 14, stderrContains: "exceeds limit", stdoutEmpty: true},
+		{args: []string{"--cgroup-limit", "/nonexistent=10"}, code: 14, stderrContains: "not a cgroup v2 directory", stdoutEmpty: true},
+		// No memory controller
+		{args: []string{"--cgroup-limit", cgroupRoot + "=10"}, code: 14, stderrContains: "cannot watch", stdoutEmpty: true},
 	}
 	if swapTotal > 0 {
 		// Tests that cannot work when there is no swap enabled
@@ -179,15 +228,23 @@ func TestCli(t *testing.T) {
 				t.Errorf("stderr should contain %q, but does not", tc.stderrContains)
 				pass = false
 			}
+			if tc.stderrNotContains != "" && strings.Contains(res.stderr, tc.stderrNotContains) {
+				t.Errorf("stderr should not contain %q, but does", tc.stderrNotContains)
+				pass = false
+			}
+			if tc.stderrContainsAny != nil && !containsAny(res.stderr, tc.stderrContainsAny) {
+				t.Errorf("stderr should contain one of %q, but does not", tc.stderrContainsAny)
+				pass = false
+			}
 			if res.rss > rssMaxKiB {
 				t.Errorf("Memory usage too high! actual rss: %d, rssMax: %d", res.rss, rssMaxKiB)
 				pass = false
 			}
-			if res.fds > openFdsMax {
+			if res.fds > openFdsMax+tc.fdsExtra {
 				if os.Getenv("GITHUB_ACTIONS") == "true" {
 					t.Log("Ignoring fd leak. Github Actions bug? See https://github.com/actions/runner/issues/1188")
 				} else {
-					t.Fatalf("High number of open file descriptors: %d", res.fds)
+					t.Fatalf("High number of open file descriptors: %d\n%s", res.fds, strings.Join(res.fdTargets, "\n"))
 				}
 			}
 			if !pass {
@@ -205,6 +262,15 @@ func TestCli(t *testing.T) {
 	}
 }
 
+func containsAny(s string, substrs []string) bool {
+	for _, sub := range substrs {
+		if strings.Contains(s, sub) {
+			return true
+		}
+	}
+	return false
+}
+
 func TestRss(t *testing.T) {
 	res := runEarlyoom(t)
 	if res.rss == 0 {
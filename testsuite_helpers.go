@@ -8,6 +8,7 @@ import (
 	"log"
 	"os"
 	"os/exec"
+	"strings"
 	"syscall"
 	"testing"
 	"time"
@@ -25,8 +26,9 @@ type exitVals struct {
 	code int
 	// RSS in kiB
 	rss int
-	// Number of file descriptors
-	fds int
+	// Number of file descriptors, and what they point to
+	fds       int
+	fdTargets []string
 }
 
 const earlyoomBinary = "./earlyoom"
@@ -92,16 +94,17 @@ func runEarlyoom(t *testing.T, args ...string) exitVals {
 		panic(err)
 	}
 	rss := int(stat.Rss)
-	fds := countFds(cmd.Process.Pid)
+	fdTargets := listFds(cmd.Process.Pid)
 	cmd.Process.Kill()
 	err = cmd.Wait()
 
 	return exitVals{
-		code:   extractCmdExitCode(err),
-		stdout: string(stdoutBuf.Bytes()),
-		stderr: string(stderrBuf.Bytes()),
-		rss:    rss,
-		fds:    fds,
+		code:      extractCmdExitCode(err),
+		stdout:    string(stdoutBuf.Bytes()),
+		stderr:    string(stderrBuf.Bytes()),
+		rss:       rss,
+		fds:       len(fdTargets),
+		fdTargets: fdTargets,
 	}
 }
 
@@ -112,32 +115,36 @@ lrwx------. 1 jakob jakob 64 Feb 22 14:36 0 -> /dev/pts/2
 lrwx------. 1 jakob jakob 64 Feb 22 14:36 1 -> /dev/pts/2
 lrwx------. 1 jakob jakob 64 Feb 22 14:36 2 -> /dev/pts/2
 lr-x------. 1 jakob jakob 64 Feb 22 14:36 3 -> /proc/meminfo
+lr-x------. 1 jakob jakob 64 Feb 22 14:36 4 -> /proc
 
-Plus one for /proc/[pid]/stat which may possibly be open as well
+Plus one for /proc/[pid]/stat or the pidfd of a victim, which may possibly
+be open as well
 */
-const openFdsMax = 5
+const openFdsMax = 6
 
-func countFds(pid int) int {
+// listFds returns the targets of the open file descriptors of `pid`,
+// like "/proc/meminfo" or "anon_inode:[eventfd]".
+func listFds(pid int) []string {
 	dir := fmt.Sprintf("/proc/%d/fd", pid)
 	f, err := os.Open(dir)
 	if err != nil {
-		return -1
+		return nil
 	}
 	defer f.Close()
 	// Note: Readdirnames filters "." and ".."
 	names, err := f.Readdirnames(0)
 	if err != nil {
-		return -1
+		return nil
 	}
-	if len(names) > openFdsMax {
-		fmt.Printf("countFds: earlyoom has too many open fds:\n")
-		for _, n := range names {
-			linkName := fmt.Sprintf("%s/%s", dir, n)
-			linkTarget, err := os.Readlink(linkName)
-			fmt.Printf("%s -> %s, err=%v\n", linkName, linkTarget, err)
+	var targets []string
+	for _, n := range names {
+		linkTarget, err := os.Readlink(fmt.Sprintf("%s/%s", dir, n))
+		if err != nil {
+			linkTarget = err.Error()
 		}
+		targets = append(targets, fmt.Sprintf("%s -> %s", n, linkTarget))
 	}
-	return len(names)
+	return targets
 }
 
 // extractCmdExitCode extracts the exit code from an error value that was
@@ -158,12 +165,15 @@ func extractCmdExitCode(err error) int {
 }
 
 type mockProcProcess struct {
-	pid         int
-	state       string // set to "R" when empty
-	oom_score   int
-	VmRSSkiB    int
-	comm        string
-	num_threads int // set to 1 when zero
+	pid           int
+	state         string // set to "R" when empty
+	oom_score     int
+	oom_score_adj int
+	VmRSSkiB      int
+	comm          string
+	num_threads   int    // set to 1 when zero
+	starttime     int    // set to 4816953 when zero
+	cgroup        string // cgroup v2 path, no /proc/[pid]/cgroup when empty
 }
 
 func (m *mockProcProcess) toProcinfo_t() (p C.procinfo_t) {
@@ -176,6 +186,27 @@ func (m *mockProcProcess) toProcinfo_t() (p C.procinfo_t) {
 	return p
 }
 
+// statString returns the content of /proc/[pid]/stat for `m`.
+// Defaults are applied like in mockProc().
+func (m *mockProcProcess) statString() string {
+	comm := m.comm
+	if comm == "" {
+		comm = "foo"
+	}
+	num_threads := m.num_threads
+	if num_threads == 0 {
+		num_threads = 1
+	}
+	starttime := m.starttime
+	if starttime == 0 {
+		starttime = 4816953
+	}
+	rss := m.VmRSSkiB * 1024 / os.Getpagesize()
+	// Real /proc/pid/stat string for gnome-shell
+	template := "549077 (%s) S 547891 549077 549077 0 -1 4194560 245592 104 342 5 108521 28953 0 1 20 0 %d 0 %d 5260238848 %d 18446744073709551615 94179647238144 94179647245825 140730757359824 0 0 0 0 16781312 17656 0 0 0 17 1 0 0 0 0 0 94179647252976 94179647254904 94179672109056 140730757367876 140730757367897 140730757367897 140730757369827 0\n"
+	return fmt.Sprintf(template, comm, num_threads, starttime, rss)
+}
+
 func mockProc(t *testing.T, procs []mockProcProcess) {
 	mockProcdir, err := ioutil.TempDir("", t.Name())
 	if err != nil {
@@ -207,11 +238,7 @@ func mockProc(t *testing.T, procs []mockProcProcess) {
 			t.Fatal(err)
 		}
 		// stat
-		//
-		// Real /proc/pid/stat string for gnome-shell
-		template := "549077 (%s) S 547891 549077 549077 0 -1 4194560 245592 104 342 5 108521 28953 0 1 20 0 %d 0 4816953 5260238848 %d 18446744073709551615 94179647238144 94179647245825 140730757359824 0 0 0 0 16781312 17656 0 0 0 17 1 0 0 0 0 0 94179647252976 94179647254904 94179672109056 140730757367876 140730757367897 140730757367897 140730757369827 0\n"
-		content = []byte(fmt.Sprintf(template, p.comm, p.num_threads, rss))
-		if err := ioutil.WriteFile(pidDir+"/stat", content, 0444); err != nil {
+		if err := ioutil.WriteFile(pidDir+"/stat", []byte(p.statString()), 0644); err != nil {
 			t.Fatal(err)
 		}
 		// oom_score
@@ -220,7 +247,8 @@ func mockProc(t *testing.T, procs []mockProcProcess) {
 			t.Fatal(err)
 		}
 		// oom_score_adj
-		if err := ioutil.WriteFile(pidDir+"/oom_score_adj", []byte("0\n"), 0444); err != nil {
+		content = []byte(fmt.Sprintf("%d\n", p.oom_score_adj))
+		if err := ioutil.WriteFile(pidDir+"/oom_score_adj", content, 0644); err != nil {
 			t.Fatal(err)
 		}
 		// comm
@@ -231,5 +259,90 @@ func mockProc(t *testing.T, procs []mockProcProcess) {
 		if err := ioutil.WriteFile(pidDir+"/cmdline", []byte("foo\000-bar\000-baz"), 0444); err != nil {
 			t.Fatal(err)
 		}
+		// cgroup
+		if p.cgroup != "" {
+			content = []byte("1:name=systemd:/\n0::" + p.cgroup + "\n")
+			if err := ioutil.WriteFile(pidDir+"/cgroup", content, 0444); err != nil {
+				t.Fatal(err)
+			}
+		}
+	}
+}
+
+// A leaf cgroup for mockCgroups()
+type mockCgroup struct {
+	// Path below the root, like "/a/b"
+	path string
+	// memory.current and memory.swap.current in bytes. -1 = no such file.
+	current     int64
+	swapCurrent int64
+	// cgroup.procs
+	procs []int
+	// memory.min and memory.low in bytes. 0 = no such file.
+	min int64
+	low int64
+	// User xattrs that are set to "1", like "user.oomd_avoid"
+	xattrs []string
+}
+
+// mockCgroups creates a cgroup v2 hierarchy with the leaves `cgroups` in a
+// temporary directory and returns it
+func mockCgroups(t *testing.T, cgroups []mockCgroup) string {
+	root, err := ioutil.TempDir("", t.Name())
+	if err != nil {
+		t.Fatal(err)
+	}
+	write := func(path string, content string) {
+		if err := ioutil.WriteFile(path, []byte(content), 0644); err != nil {
+			t.Fatal(err)
+		}
+	}
+	write(root+"/cgroup.procs", "")
+	for _, cg := range cgroups {
+		dir := root + cg.path
+		if err := os.MkdirAll(dir, 0755); err != nil {
+			t.Fatal(err)
+		}
+		if cg.current >= 0 {
+			write(dir+"/memory.current", fmt.Sprintf("%d\n", cg.current))
+		}
+		if cg.swapCurrent >= 0 {
+			write(dir+"/memory.swap.current", fmt.Sprintf("%d\n", cg.swapCurrent))
+		}
+		procs := ""
+		for _, pid := range cg.procs {
+			procs += fmt.Sprintf("%d\n", pid)
+		}
+		write(dir+"/cgroup.procs", procs)
+		if cg.min > 0 {
+			write(dir+"/memory.min", fmt.Sprintf("%d\n", cg.min))
+		}
+		if cg.low > 0 {
+			write(dir+"/memory.low", fmt.Sprintf("%d\n", cg.low))
+		}
+		for _, name := range cg.xattrs {
+			if err := syscall.Setxattr(dir, name, []byte("1"), 0); err != nil {
+				os.RemoveAll(root)
+				t.Skipf("cannot set xattr %s: %v", name, err)
+			}
+		}
+	}
+	return root
+}
+
+// cgroup2Mount returns where the cgroup v2 hierarchy is mounted, or ""
+func cgroup2Mount() string {
+	f, err := os.Open("/proc/self/mounts")
+	if err != nil {
+		return ""
+	}
+	defer f.Close()
+	scanner := bufio.NewScanner(f)
+	for scanner.Scan() {
+		fields := strings.Fields(scanner.Text())
+		if len(fields) >= 3 && fields[2] == "cgroup2" {
+			return fields[1]
+		}
 	}
+	return ""
 }
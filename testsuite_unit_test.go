@@ -3,10 +3,15 @@ package earlyoom_testsuite
 import (
 	"fmt"
 	"io/ioutil"
+	"math"
+	"math/rand"
 	"os"
+	"os/exec"
+	"reflect"
 	"strings"
 	"syscall"
 	"testing"
+	"time"
 	"unicode/utf8"
 
 	linuxproc "github.com/c9s/goprocinfo/linux"
@@ -207,6 +212,12 @@ func Test_parse_proc_pid_stat_buf(t *testing.T) {
 		"x",
 		"\000\000\000",
 		")",
+		") ",
+		"1 (x) S",
+		"1 (x) S 1 2 3 4 5 6 7",
+		"1 (x) SS 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21",
+		"1 (x) S 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20",
+		"1 (x) S 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 x 18 19 20 21",
 	}
 	for _, v := range should_error_out {
 		res, _ := parse_proc_pid_stat_buf(v)
@@ -216,6 +227,63 @@ func Test_parse_proc_pid_stat_buf(t *testing.T) {
 	}
 }
 
+func Test_parse_meminfo_buf(t *testing.T) {
+	meminfo := func(memTotal string, memAvailable string) string {
+		return "MemTotal:       " + memTotal + " kB\n" +
+			"MemFree:          123456 kB\n" +
+			"MemAvailable:   " + memAvailable + " kB\n" +
+			"Buffers:            1234 kB\n" +
+			"Cached:          2345678 kB\n" +
+			"SwapCached:          999 kB\n" +
+			"Mlocked:              16 kB\n" +
+			"SwapTotal:       8388604 kB\n" +
+			"SwapFree:        8388000 kB\n" +
+			"AnonPages:       3456789 kB\n" +
+			"Shmem:            567890 kB\n" +
+			"KReclaimable:     111111 kB\n" +
+			"SReclaimable:     222222 kB\n"
+	}
+	check := func(buf string, memTotal int64, memAvailable int64) {
+		t.Helper()
+		m := parse_meminfo_buf(buf)
+		have := []int64{int64(m.MemTotalKiB), int64(m.MemAvailableKiB), int64(m.SwapTotalKiB), int64(m.SwapFreeKiB),
+			int64(m.AnonPagesKiB), int64(m.ShmemKiB), int64(m.SReclaimableKiB), int64(m.MlockedKiB)}
+		want := []int64{memTotal, memAvailable, 8388604, 8388000, 3456789, 567890, 222222, 16}
+		if !reflect.DeepEqual(have, want) {
+			t.Errorf("have %v, want %v", have, want)
+		}
+	}
+	check(meminfo(" 16000000", " 12000000"), 16000000, 12000000)
+	// Same layout, read from the remembered offsets
+	check(meminfo(" 16000000", "  9000000"), 16000000, 9000000)
+	// MemTotal outgrows its column and shifts all other lines
+	check(meminfo("1100000000", "900000000"), 1100000000, 900000000)
+	check(meminfo(" 16000000", " 12000000"), 16000000, 12000000)
+	// No Mlocked, Shmem, SReclaimable (or MemAvailable, with the
+	// guesstimate using Shmem)
+	m := parse_meminfo_buf("MemTotal: 100 kB\nMemAvailable: 50 kB\nSwapTotal: 0 kB\nSwapFree: 0 kB\nAnonPages: 10 kB\n")
+	if m.MemAvailableKiB != 50 || m.ShmemKiB != -1 || m.SReclaimableKiB != -1 || m.MlockedKiB != -1 {
+		t.Errorf("missing optional fields: %+v", m)
+	}
+	// "Cached:" must not match "SwapCached:"
+	m = parse_meminfo_buf("MemTotal: 100 kB\nMemFree: 10 kB\nBuffers: 1 kB\nSwapCached: 7 kB\nCached: 20 kB\n" +
+		"SwapTotal: 0 kB\nSwapFree: 0 kB\nAnonPages: 10 kB\nShmem: 5 kB\n")
+	if m.MemAvailableKiB != 10+20+1-5 {
+		t.Errorf("guesstimate: have %d, want 26", m.MemAvailableKiB)
+	}
+}
+
+func Test_parse_meminfo(t *testing.T) {
+	memTotal, swapTotal := parseMeminfo()
+	m := parse_meminfo()
+	if int64(m.MemTotalKiB) != memTotal || int64(m.SwapTotalKiB) != swapTotal {
+		t.Errorf("have MemTotal=%d SwapTotal=%d, want %d %d", m.MemTotalKiB, m.SwapTotalKiB, memTotal, swapTotal)
+	}
+	if m.ShmemKiB < 0 || m.SReclaimableKiB < 0 || m.MlockedKiB < 0 || m.PageTablesKiB < 0 {
+		t.Errorf("extra fields missing: %+v", m)
+	}
+}
+
 func Test_parse_proc_pid_stat_1(t *testing.T) {
 	stat, err := linuxproc.ReadProcessStat("/proc/1/stat")
 	if err != nil {
@@ -230,8 +298,18 @@ func Test_parse_proc_pid_stat_1(t *testing.T) {
 	want := have
 	want.state = _Ctype_char(stat.State[0])
 	want.ppid = _Ctype_int(stat.Ppid)
+	want.pgrp = _Ctype_int(stat.Pgrp)
 	want.num_threads = _Ctype_long(stat.NumThreads)
+	want.flags = _Ctype_uint(stat.Flags)
+	want.maj_flt = _Ctype_ulong(stat.Majflt)
+	want.starttime = _Ctype_ulonglong(stat.Starttime)
+	want.vsize = _Ctype_ulong(stat.Vsize)
 	want.rss = _Ctype_long(stat.Rss)
+	// pid 1 may use a bit of CPU between the two reads
+	if have.utime < _Ctype_ulong(stat.Utime) || have.stime < _Ctype_ulong(stat.Stime) ||
+		have.utime+have.stime > _Ctype_ulong(stat.Utime+stat.Stime)+100 {
+		t.Errorf("utime/stime: have %d/%d, want %d/%d", have.utime, have.stime, stat.Utime, stat.Stime)
+	}
 
 	if have != want {
 		t.Errorf("\nhave=%#v\nwant=%#v", have, want)
@@ -264,7 +342,14 @@ func Test_parse_proc_pid_stat_Mock(t *testing.T) {
 	_, want := parse_proc_pid_stat(1)
 	want.state = 'S'
 	want.ppid = 547891
+	want.pgrp = 549077
 	want.num_threads = 23
+	want.flags = 4194560
+	want.maj_flt = 342
+	want.utime = 108521
+	want.stime = 28953
+	want.starttime = 4816953
+	want.vsize = 5260238848
 	want.rss = 65528
 
 	for _, c := range content {
@@ -333,6 +418,1174 @@ func Test_is_larger_by_rss(t *testing.T) {
 	permute_is_larger(t, true, procs)
 }
 
+// Cached values must be reused as long as the process stays the same,
+// and must be discarded when the pid is reused or the process calls exec().
+func Test_is_larger_proc_cache(t *testing.T) {
+	victim := mockProcProcess{pid: 100, oom_score: 100, VmRSSkiB: 1234}
+	cur := mockProcProcess{pid: 101, oom_score: 200, VmRSSkiB: 1234, oom_score_adj: -1000}
+	mockProc(t, []mockProcProcess{victim, cur})
+	defer procdir_path("/proc")
+	pidDir := fmt.Sprintf("%s/%d", procdir_path(""), cur.pid)
+	args := poll_loop_args_t(false)
+	writeAdj := func(adj string) {
+		if err := ioutil.WriteFile(pidDir+"/oom_score_adj", []byte(adj+"\n"), 0644); err != nil {
+			t.Fatal(err)
+		}
+	}
+	writeStat := func() {
+		if err := ioutil.WriteFile(pidDir+"/stat", []byte(cur.statString()), 0644); err != nil {
+			t.Fatal(err)
+		}
+	}
+
+	if is_larger(&args, victim, cur) {
+		t.Fatal("oom_score_adj=-1000 should never be larger")
+	}
+	// -1000 is not cached: the process is a candidate as soon as it
+	// lowers its protection
+	writeAdj("0")
+	if !is_larger(&args, victim, cur) {
+		t.Error("oom_score_adj=-1000 was cached")
+	}
+	// Same process, changed oom_score_adj: the cached value is used
+	writeAdj("-1000")
+	if !is_larger(&args, victim, cur) {
+		t.Error("cached oom_score_adj was not used")
+	}
+	// pid reuse: different starttime
+	cur.starttime = 5000000
+	writeStat()
+	if is_larger(&args, victim, cur) {
+		t.Error("pid reuse was not detected")
+	}
+	// exec: different comm
+	writeAdj("0")
+	if !is_larger(&args, victim, cur) {
+		t.Error("oom_score_adj=0 after pid reuse was not read")
+	}
+	writeAdj("-1000")
+	cur.comm = "bar"
+	writeStat()
+	if is_larger(&args, victim, cur) {
+		t.Error("exec was not detected")
+	}
+}
+
+// With --ignore-root-user, a scan with a warm proc cache must look up fewer
+// /proc files than one with a cold cache: the uids are not stat()ed again.
+func Test_find_largest_process_ignore_root_calls(t *testing.T) {
+	defer enable_debug(enable_debug(false))
+	var procs []mockProcProcess
+	for pid := 100; pid < 200; pid++ {
+		procs = append(procs, mockProcProcess{pid: pid, oom_score: pid, VmRSSkiB: 4})
+	}
+	mockProc(t, procs)
+	defer procdir_path("/proc")
+	defer os.RemoveAll(procdir_path(""))
+	if os.Getuid() == 0 {
+		// uid 0 is never cached
+		for _, p := range procs {
+			if err := os.Chown(fmt.Sprintf("%s/%d", procdir_path(""), p.pid), 1000, 1000); err != nil {
+				t.Fatal(err)
+			}
+		}
+	}
+
+	proc_cache_flush()
+	c0 := procfs_calls()
+	find_largest_process_ignore_root()
+	cold := procfs_calls() - c0
+	c0 = procfs_calls()
+	find_largest_process_ignore_root()
+	warm := procfs_calls() - c0
+	if warm >= cold {
+		t.Errorf("warm cache: %d calls, cold cache: %d calls", warm, cold)
+	}
+	t.Logf("/proc calls per scan: warm %d, cold %d", warm, cold)
+}
+
+// The threaded scan must select exactly the same victim as the serial scan,
+// including ties and zombie main threads (rss=0).
+func Test_find_largest_process_scan_threads(t *testing.T) {
+	if res := scan_pool_init(4); res != 0 {
+		t.Fatalf("scan_pool_init: %d", res)
+	}
+	defer enable_debug(enable_debug(false))
+	rnd := rand.New(rand.NewSource(1))
+	for round := 0; round < 10; round++ {
+		var procs []mockProcProcess
+		// More processes than one chunk per thread, so all threads get work
+		for pid := 100; pid < 400; pid++ {
+			// Few distinct values, so there are lots of ties
+			p := mockProcProcess{
+				pid:       pid,
+				oom_score: rnd.Intn(20),
+				VmRSSkiB:  (1 + rnd.Intn(4)) * 4,
+			}
+			if rnd.Intn(20) == 0 {
+				// zombie main thread
+				p.VmRSSkiB = 0
+				p.num_threads = 2
+			}
+			if rnd.Intn(50) == 0 {
+				p.oom_score_adj = -1000
+			}
+			procs = append(procs, p)
+		}
+		mockProc(t, procs)
+		for _, sort_by_rss := range []bool{false, true} {
+			want := find_largest_process_pid(sort_by_rss, 1)
+			have := find_largest_process_pid(sort_by_rss, 4)
+			if have != want {
+				t.Errorf("round %d sort_by_rss=%v: serial=%d threaded=%d", round, sort_by_rss, want, have)
+			}
+		}
+		os.RemoveAll(procdir_path(""))
+	}
+	procdir_path("/proc")
+}
+
+func Test_procfs_uring(t *testing.T) {
+	if res := procfs_uring_open(); res < 0 {
+		t.Skipf("io_uring not available: %v", syscall.Errno(-res))
+	}
+	defer procfs_uring_close()
+	defer enable_debug(enable_debug(false))
+	rnd := rand.New(rand.NewSource(2))
+	var procs []mockProcProcess
+	// Several batches, and a last one that is not full
+	for pid := 100; pid < 100+3*64+10; pid++ {
+		procs = append(procs, mockProcProcess{
+			pid:       pid,
+			oom_score: rnd.Intn(1000),
+			VmRSSkiB:  4 * (1 + rnd.Intn(1000)),
+		})
+	}
+	mockProc(t, procs)
+	defer procdir_path("/proc")
+	defer os.RemoveAll(procdir_path(""))
+	for _, sort_by_rss := range []bool{false, true} {
+		// The threaded scan does not use io_uring
+		want := find_largest_process_pid(sort_by_rss, 4)
+		have := find_largest_process_pid(sort_by_rss, 1)
+		if have != want {
+			t.Errorf("sort_by_rss=%v: io_uring=%d threaded=%d", sort_by_rss, have, want)
+		}
+	}
+	// Processes that are gone are skipped
+	largest := find_largest_process_pid(false, 4)
+	os.RemoveAll(fmt.Sprintf("%s/%d", procdir_path(""), largest))
+	have, want := find_largest_process_pid(false, 1), find_largest_process_pid(false, 4)
+	if have != want || have == largest {
+		t.Errorf("after removing %d: io_uring=%d threaded=%d", largest, have, want)
+	}
+}
+
+// The oom_score we compute must match what the kernel says, for every
+// process on this machine.
+func Test_oom_score_compute(t *testing.T) {
+	if res := oom_score_selftest(); res != 0 {
+		t.Fatalf("oom_score_selftest: %v", syscall.Errno(-res))
+	}
+	pids := procfs_list_pids()
+	compared := 0
+	for _, pid := range pids {
+		if pid == 1 {
+			// The kernel never kills init and reports oom_score 0
+			continue
+		}
+		res, stat := parse_proc_pid_stat(pid)
+		if !res || stat.state == 'Z' {
+			// Gone, or the zombie main thread of a process that still has
+			// other threads. The kernel then uses the memory of those.
+			continue
+		}
+		computed := oom_score_compute(pid)
+		kernel := get_oom_score(pid)
+		if computed < 0 || kernel < 0 {
+			continue
+		}
+		// rss may change in between
+		if computed < kernel-1 || computed > kernel+1 {
+			t.Errorf("pid %d: computed oom_score %d, kernel says %d", pid, computed, kernel)
+		}
+		compared++
+	}
+	if compared == 0 {
+		t.Fatal("no processes compared")
+	}
+}
+
+// --estimate-oom-score must select the same victim and candidates as
+// reading oom_score for every process.
+func Test_find_largest_process_estimated(t *testing.T) {
+	defer enable_debug(enable_debug(false))
+	// The mock processes are ranked with the real /proc/meminfo, like the
+	// kernel would. Part of their score comes from swap and page tables,
+	// which we can only bound using the page tables of this machine.
+	m := parse_meminfo()
+	extraMax := int64(m.PageTablesKiB) * 1024 / int64(os.Getpagesize()) / 2
+	if extraMax < 2 {
+		t.Skipf("PageTables=%d kiB is too small", m.PageTablesKiB)
+	}
+	rnd := rand.New(rand.NewSource(3))
+	for round := 0; round < 5; round++ {
+		var procs []mockProcProcess
+		for pid := 100; pid < 400; pid++ {
+			rss := int64(rnd.Intn(int(extraMax) * 20))
+			extra := rnd.Int63n(extraMax)
+			p := mockProcProcess{
+				pid:      pid,
+				VmRSSkiB: int(rss) * os.Getpagesize() / 1024,
+			}
+			if rnd.Intn(20) == 0 {
+				p.oom_score_adj = rnd.Intn(2001) - 1000
+			}
+			p.oom_score = oom_score_points(rss+extra, p.oom_score_adj)
+			if rnd.Intn(20) == 0 {
+				// zombie main thread
+				p.VmRSSkiB = 0
+				p.num_threads = 2
+			}
+			procs = append(procs, p)
+		}
+		mockProc(t, procs)
+		for _, k := range []int{1, 5} {
+			want := []int{find_largest_process_candidates(k, 1)}
+			for pid := next_candidate(); pid != 0; pid = next_candidate() {
+				want = append(want, pid)
+			}
+			have := []int{find_largest_process_estimated(k)}
+			for pid := next_candidate(); pid != 0; pid = next_candidate() {
+				have = append(have, pid)
+			}
+			if !reflect.DeepEqual(have, want) {
+				t.Errorf("round %d k=%d: estimated=%v exact=%v", round, k, have, want)
+			}
+		}
+		os.RemoveAll(procdir_path(""))
+	}
+	procdir_path("/proc")
+}
+
+// A process that has raised its oom_score_adj since the last scan must not
+// be pruned because of the cached value.
+func Test_find_largest_process_estimated_adj(t *testing.T) {
+	defer enable_debug(enable_debug(false))
+	m := parse_meminfo()
+	pageKiB := os.Getpagesize() / 1024
+	bigPages := int64(m.MemTotalKiB) / 4 / int64(pageKiB)
+	big := mockProcProcess{pid: 100, VmRSSkiB: int(bigPages) * pageKiB, oom_score: oom_score_points(bigPages, 0)}
+	small := mockProcProcess{pid: 101, VmRSSkiB: pageKiB, oom_score: oom_score_points(1, 0)}
+	mockProc(t, []mockProcProcess{big, small})
+	defer procdir_path("/proc")
+	defer os.RemoveAll(procdir_path(""))
+
+	if have := find_largest_process_estimated(1); have != big.pid {
+		t.Fatalf("have=%d want=%d", have, big.pid)
+	}
+	// oom_score_adj=0 of the small one is cached now
+	pidDir := fmt.Sprintf("%s/%d", procdir_path(""), small.pid)
+	if err := ioutil.WriteFile(pidDir+"/oom_score_adj", []byte("1000\n"), 0644); err != nil {
+		t.Fatal(err)
+	}
+	score := fmt.Sprintf("%d\n", oom_score_points(1, 1000))
+	if err := ioutil.WriteFile(pidDir+"/oom_score", []byte(score), 0644); err != nil {
+		t.Fatal(err)
+	}
+	if have := find_largest_process_estimated(1); have != small.pid {
+		t.Errorf("have=%d want=%d", have, small.pid)
+	}
+}
+
+// With --sort-by-rss, the serial scan only reads the largest processes
+// completely. It must rank them exactly like the threaded scan, which reads
+// everything.
+func Test_find_largest_process_two_phase(t *testing.T) {
+	if res := scan_pool_init(4); res != 0 {
+		t.Fatalf("scan_pool_init: %d", res)
+	}
+	defer enable_debug(enable_debug(false))
+	rnd := rand.New(rand.NewSource(4))
+	for round := 0; round < 5; round++ {
+		var procs []mockProcProcess
+		for pid := 100; pid < 400; pid++ {
+			// Few distinct values, so there are lots of ties
+			procs = append(procs, mockProcProcess{
+				pid:       pid,
+				oom_score: rnd.Intn(20),
+				VmRSSkiB:  (1 + rnd.Intn(50)) * 4,
+			})
+			if rnd.Intn(50) == 0 {
+				procs[len(procs)-1].oom_score_adj = -1000
+			}
+		}
+		if round%2 == 1 {
+			// A zombie main thread makes the serial scan read everything
+			procs[rnd.Intn(len(procs))].VmRSSkiB = 0
+		}
+		mockProc(t, procs)
+		for _, k := range []int{1, 5} {
+			want := []int{find_largest_process_rss_candidates(k, 4)}
+			for pid := next_candidate(); pid != 0; pid = next_candidate() {
+				want = append(want, pid)
+			}
+			have := []int{find_largest_process_rss_candidates(k, 1)}
+			for pid := next_candidate(); pid != 0; pid = next_candidate() {
+				have = append(have, pid)
+			}
+			if !reflect.DeepEqual(have, want) {
+				t.Errorf("round %d k=%d: two-phase=%v threaded=%v", round, k, have, want)
+			}
+		}
+		os.RemoveAll(procdir_path(""))
+	}
+	procdir_path("/proc")
+}
+
+// With a scan budget that is far too small, we still get a victim, and it
+// is the largest process of the last scan, because that one is looked at
+// first.
+func Test_find_largest_process_budget(t *testing.T) {
+	if res := scan_pool_init(4); res != 0 {
+		t.Fatalf("scan_pool_init: %d", res)
+	}
+	defer enable_debug(enable_debug(false))
+	var procs []mockProcProcess
+	// oom_score and rss are distinct, and don't grow with the pid
+	for pid := 100; pid < 1100; pid++ {
+		procs = append(procs, mockProcProcess{
+			pid:       pid,
+			oom_score: (pid * 37) % 1000,
+			VmRSSkiB:  4 * (1 + (pid*53)%1000),
+		})
+	}
+	mockProc(t, procs)
+	defer procdir_path("/proc")
+	defer os.RemoveAll(procdir_path(""))
+
+	for _, sort_by_rss := range []bool{false, true} {
+		for _, threads := range []int{1, 4} {
+			want := find_largest_process_pid(sort_by_rss, threads)
+			hits := scan_budget_hits()
+			have := find_largest_process_budget(1, sort_by_rss, threads)
+			if have != want {
+				t.Errorf("sort_by_rss=%v threads=%d: have=%d want=%d", sort_by_rss, threads, have, want)
+			}
+			if scan_budget_hits() != hits+1 {
+				t.Errorf("sort_by_rss=%v threads=%d: budget hits %d -> %d", sort_by_rss, threads, hits, scan_budget_hits())
+			}
+		}
+	}
+	// Without hints, we still get a victim
+	os.RemoveAll(fmt.Sprintf("%s/%d", procdir_path(""), find_largest_process_pid(false, 1)))
+	if pid := find_largest_process_budget(1, false, 1); pid <= 0 {
+		t.Errorf("no victim: %d", pid)
+	}
+}
+
+func Test_next_candidate(t *testing.T) {
+	defer enable_debug(enable_debug(false))
+	if res := scan_pool_init(4); res != 0 {
+		t.Fatalf("scan_pool_init: %d", res)
+	}
+	var procs []mockProcProcess
+	// oom_score = (pid * 37) % 300 is distinct for pids 100...399
+	for pid := 100; pid < 400; pid++ {
+		procs = append(procs, mockProcProcess{pid: pid, oom_score: (pid * 37) % 300, VmRSSkiB: 4})
+	}
+	mockProc(t, procs)
+	defer procdir_path("/proc")
+	// The largest oom_scores, in order
+	var want []int
+	for score := 299; score > 299-5; score-- {
+		for _, p := range procs {
+			if p.oom_score == score {
+				want = append(want, p.pid)
+			}
+		}
+	}
+
+	for _, threads := range []int{1, 4} {
+		if have := find_largest_process_candidates(5, threads); have != want[0] {
+			t.Fatalf("threads=%d: victim: have=%d want=%d", threads, have, want[0])
+		}
+		for i := 1; i < 5; i++ {
+			if have := next_candidate(); have != want[i] {
+				t.Errorf("threads=%d: candidate #%d: have=%d want=%d", threads, i+1, have, want[i])
+			}
+		}
+		if have := next_candidate(); have != 0 {
+			t.Errorf("threads=%d: ranking should be used up, have=%d", threads, have)
+		}
+	}
+
+	// A candidate that is no longer eligible is skipped
+	find_largest_process_candidates(5, 1)
+	pidDir := fmt.Sprintf("%s/%d", procdir_path(""), want[1])
+	if err := ioutil.WriteFile(pidDir+"/oom_score_adj", []byte("-1000\n"), 0644); err != nil {
+		t.Fatal(err)
+	}
+	if have := next_candidate(); have != want[2] {
+		t.Errorf("have=%d want=%d", have, want[2])
+	}
+}
+
+func Test_prerank(t *testing.T) {
+	defer enable_debug(enable_debug(false))
+	var procs []mockProcProcess
+	for pid := 100; pid < 200; pid++ {
+		procs = append(procs, mockProcProcess{pid: pid, oom_score: pid % 37, VmRSSkiB: 4})
+	}
+	mockProc(t, procs)
+	defer procdir_path("/proc")
+	want := find_largest_process_pid(false, 1)
+	pidDir := fmt.Sprintf("%s/%d", procdir_path(""), want)
+
+	// With a zero budget, every step only looks at a few processes
+	prerank_reset()
+	steps := 0
+	for ; steps < 100; steps++ {
+		prerank_step(0)
+		// Returns 0 until the pass is complete
+		if have := prerank_victim(); have != 0 {
+			if have != want {
+				t.Fatalf("have=%d want=%d", have, want)
+			}
+			break
+		}
+	}
+	if steps < 1 || steps >= 100 {
+		t.Errorf("first pass took %d steps", steps)
+	}
+
+	// A victim that is no longer eligible is rejected
+	prerank_reset()
+	prerank_step(1000000)
+	if err := ioutil.WriteFile(pidDir+"/oom_score_adj", []byte("-1000\n"), 0644); err != nil {
+		t.Fatal(err)
+	}
+	if have := prerank_victim(); have != 0 {
+		t.Errorf("oom_score_adj=-1000: have=%d", have)
+	}
+
+	// So is a different process with the same pid
+	if err := ioutil.WriteFile(pidDir+"/oom_score_adj", []byte("0\n"), 0644); err != nil {
+		t.Fatal(err)
+	}
+	prerank_reset()
+	prerank_step(1000000)
+	p := procs[want-100]
+	p.starttime = 5000000
+	if err := ioutil.WriteFile(pidDir+"/stat", []byte(p.statString()), 0644); err != nil {
+		t.Fatal(err)
+	}
+	if have := prerank_victim(); have != 0 {
+		t.Errorf("pid reuse: have=%d", have)
+	}
+	prerank_reset()
+}
+
+func Test_procfs_list_pids(t *testing.T) {
+	mockProcdir, err := ioutil.TempDir("", t.Name())
+	if err != nil {
+		t.Fatal(err)
+	}
+	procdir_path(mockProcdir)
+	defer procdir_path("/proc")
+
+	// Mock directories are not sorted, unlike /proc
+	for _, d := range []string{"300", "5", "self", "42", "1x", "100000", "sys"} {
+		if err := os.Mkdir(mockProcdir+"/"+d, 0700); err != nil {
+			t.Fatal(err)
+		}
+	}
+	// Files are skipped
+	if err := ioutil.WriteFile(mockProcdir+"/7", nil, 0600); err != nil {
+		t.Fatal(err)
+	}
+	have := procfs_list_pids()
+	want := []int{5, 42, 300, 100000}
+	if fmt.Sprint(have) != fmt.Sprint(want) {
+		t.Errorf("have=%v want=%v", have, want)
+	}
+
+	// Real /proc must contain ourselves
+	procdir_path("/proc")
+	found := false
+	pids := procfs_list_pids()
+	for i, pid := range pids {
+		if pid == os.Getpid() {
+			found = true
+		}
+		if i > 0 && pids[i-1] >= pid {
+			t.Errorf("not sorted at index %d: %v", i, pids[i-1:i+1])
+		}
+	}
+	if !found {
+		t.Errorf("own pid %d not found in %v", os.Getpid(), pids)
+	}
+}
+
+func containsInt(list []int, x int) bool {
+	for _, v := range list {
+		if v == x {
+			return true
+		}
+	}
+	return false
+}
+
+// A zero-initialized procinfo_t has no pidfd. Closing it must not close
+// fd 0.
+func Test_procinfo_close_zero(t *testing.T) {
+	var st syscall.Stat_t
+	if err := syscall.Fstat(0, &st); err != nil {
+		t.Skipf("fd 0 is not open: %v", err)
+	}
+	procinfo_close_zero()
+	if err := syscall.Fstat(0, &st); err != nil {
+		t.Errorf("fd 0 was closed: %v", err)
+	}
+}
+
+// The victim is pinned with a pidfd during the scan and killed through it
+func Test_kill_pidfd(t *testing.T) {
+	defer enable_debug(enable_debug(false))
+	cmd := exec.Command("sleep", "100")
+	if err := cmd.Start(); err != nil {
+		t.Fatal(err)
+	}
+	defer cmd.Process.Kill()
+	done := make(chan error)
+	go func() { done <- cmd.Wait() }()
+	// The child is only called "sleep" after exec()
+	for i := 0; i < 100; i++ {
+		if _, comm := get_comm(cmd.Process.Pid); comm == "sleep" {
+			break
+		}
+		time.Sleep(10 * time.Millisecond)
+	}
+
+	victim, pid, pinned := find_preferred("^sleep$")
+	if pid != cmd.Process.Pid {
+		// Don't kill a random process
+		procinfo_close(victim)
+		t.Fatalf("victim: have=%d want=%d", pid, cmd.Process.Pid)
+	}
+	if !pinned {
+		t.Log("no pidfd for the victim. Kernel older than 5.3?")
+	}
+	t0 := time.Now()
+	kill_victim(victim, true)
+	// With a pidfd, kill_wait() returns as soon as the process has exited,
+	// not at the next 100 ms memory check.
+	if d := time.Since(t0); pinned && d > 90*time.Millisecond {
+		t.Errorf("kill_wait took %v", d)
+	}
+	select {
+	case <-done:
+	case <-time.After(5 * time.Second):
+		t.Error("victim was not killed")
+	}
+}
+
+func Test_monitor_handoff(t *testing.T) {
+	if res := monitor_open(); res != 0 {
+		t.Fatal(syscall.Errno(-res))
+	}
+	defer monitor_close()
+
+	monitor_publish(int(syscall.SIGKILL))
+	if have := monitor_sample_sig(); have != int(syscall.SIGKILL) {
+		t.Errorf("sample sig: have=%d want=%d", have, syscall.SIGKILL)
+	}
+	if monitor_kill_pending() {
+		t.Fatal("kill pending before any request")
+	}
+	monitor_request_kill()
+	if !monitor_kill_pending() {
+		t.Error("request is not pending")
+	}
+	if res := monitor_wait(1000); res != 1 {
+		t.Errorf("monitor_wait: have=%d want=1", res)
+	}
+	monitor_take_request()
+	if monitor_kill_pending() {
+		t.Error("request still pending after taking it")
+	}
+	if res := monitor_wait(0); res != 0 {
+		t.Errorf("monitor_wait without wakeup: have=%d want=0", res)
+	}
+	monitor_publish(0)
+}
+
+// With --monitor-thread, kill_wait() escalates and moves on when the monitor
+// thread says so, instead of checking memory itself
+func Test_kill_wait_monitor(t *testing.T) {
+	defer enable_debug(enable_debug(false))
+	if res := monitor_open(); res != 0 {
+		t.Fatal(syscall.Errno(-res))
+	}
+	defer monitor_close()
+	monitor_publish(0)
+
+	// Ignores SIGTERM
+	cmd := exec.Command("sh", "-c", "trap '' TERM; exec sleep 100")
+	if err := cmd.Start(); err != nil {
+		t.Fatal(err)
+	}
+	defer cmd.Process.Kill()
+	done := make(chan error)
+	go func() { done <- cmd.Wait() }()
+	pid := cmd.Process.Pid
+	// Let the shell set up the trap
+	time.Sleep(100 * time.Millisecond)
+
+	killed := make(chan int)
+	waitVictim := func(wantSig syscall.Signal) {
+		for i := 0; i < 100; i++ {
+			if p, sig := monitor_victim(); p == pid && sig == int(wantSig) {
+				return
+			}
+			time.Sleep(10 * time.Millisecond)
+		}
+		t.Fatalf("kill_wait is not waiting for pid %d with signal %d", pid, wantSig)
+	}
+
+	// A new kill request while we wait: move on
+	go func() { killed <- kill_process_sigterm(pid, false) }()
+	waitVictim(syscall.SIGTERM)
+	monitor_request_kill()
+	select {
+	case res := <-killed:
+		if res != int(syscall.EINPROGRESS) {
+			t.Errorf("kill_process: have=%d want EINPROGRESS", res)
+		}
+	case <-time.After(2 * time.Second):
+		t.Fatal("kill_wait did not move on")
+	}
+	monitor_take_request()
+	if p, _ := monitor_victim(); p != 0 {
+		t.Errorf("victim still set to %d", p)
+	}
+	if !is_alive(pid) {
+		t.Fatal("SIGTERM should have been ignored")
+	}
+
+	// At the SIGKILL limits: escalate
+	go func() { killed <- kill_process_sigterm(pid, false) }()
+	waitVictim(syscall.SIGTERM)
+	monitor_publish(int(syscall.SIGKILL))
+	monitor_wake()
+	select {
+	case res := <-killed:
+		if res != 0 {
+			t.Errorf("kill_process: have=%d want=0", res)
+		}
+	case <-time.After(2 * time.Second):
+		t.Fatal("kill_wait did not escalate")
+	}
+	monitor_publish(0)
+	select {
+	case <-done:
+	case <-time.After(5 * time.Second):
+		t.Error("victim was not killed")
+	}
+}
+
+// With --pipeline, kill_wait() looks for the next victim while the last one
+// exits, and skips the last one
+func Test_kill_wait_pipeline(t *testing.T) {
+	defer enable_debug(enable_debug(false))
+	// Ignores SIGTERM
+	cmd := exec.Command("sh", "-c", "trap '' TERM; exec sleep 100")
+	if err := cmd.Start(); err != nil {
+		t.Fatal(err)
+	}
+	defer cmd.Process.Kill()
+	done := make(chan error)
+	go func() { done <- cmd.Wait() }()
+	pid := cmd.Process.Pid
+	// Let the shell set up the trap
+	time.Sleep(100 * time.Millisecond)
+
+	// kill_wait() checks the memory situation. Open /proc/meminfo before
+	// switching to the mock procdir.
+	parse_meminfo()
+	// The child would be the victim, 199 the runner-up
+	procs := []mockProcProcess{{pid: pid, oom_score: 1000, VmRSSkiB: 4}}
+	for p := 100; p < 200; p++ {
+		procs = append(procs, mockProcProcess{pid: p, oom_score: p - 100, VmRSSkiB: 4})
+	}
+	mockProc(t, procs)
+	defer procdir_path("/proc")
+	prerank_reset()
+	defer prerank_reset()
+
+	killed := make(chan int)
+	go func() { killed <- kill_process_sigterm(pid, true) }()
+	time.Sleep(300 * time.Millisecond)
+	cmd.Process.Kill()
+	select {
+	case res := <-killed:
+		if res != 0 {
+			t.Errorf("kill_process: have=%d want=0", res)
+		}
+	case <-time.After(2 * time.Second):
+		t.Fatal("kill_wait did not return")
+	}
+	<-done
+	// Ready without another scan
+	if have := prerank_victim(); have != 199 {
+		t.Errorf("next victim: have=%d want=199", have)
+	}
+}
+
+func Test_batch_select(t *testing.T) {
+	defer enable_debug(enable_debug(false))
+	// 10 processes with 100 MiB each, largest first
+	var procs []mockProcProcess
+	for i := 0; i < 10; i++ {
+		procs = append(procs, mockProcProcess{pid: 100 + i, oom_score: 900 - i, VmRSSkiB: 100 * 1024})
+	}
+	mockProc(t, procs)
+	defer procdir_path("/proc")
+
+	const total = 10 * 1024 * 1024 // 10 GiB, SIGTERM limit at 1 GiB
+	testCases := []struct {
+		margin int
+		avail  int64
+		want   int
+	}{
+		// 1126 MiB - 512 MiB: 7 processes
+		{margin: 1, avail: 512 * 1024, want: 7},
+		// 1536 MiB - 512 MiB: 11 processes, but only 8 candidates
+		{margin: 5, avail: 512 * 1024, want: 8},
+		// 1126 MiB - 1100 MiB: one is enough
+		{margin: 1, avail: 1100 * 1024, want: 1},
+	}
+	for _, tc := range testCases {
+		have := batch_select_pids(tc.margin, tc.avail, total)
+		if len(have) != tc.want {
+			t.Errorf("margin=%d avail=%d: have %v, want %d processes", tc.margin, tc.avail, have, tc.want)
+			continue
+		}
+		for i, pid := range have {
+			if pid != 100+i {
+				t.Errorf("margin=%d avail=%d: have %v, want the largest first", tc.margin, tc.avail, have)
+				break
+			}
+		}
+	}
+}
+
+// kill_batch() kills all processes of the batch at once and waits for them
+// together
+func Test_kill_batch(t *testing.T) {
+	defer enable_debug(enable_debug(false))
+	var procs []mockProcProcess
+	var done []chan error
+	for i := 0; i < 3; i++ {
+		cmd := exec.Command("sleep", "100")
+		if err := cmd.Start(); err != nil {
+			t.Fatal(err)
+		}
+		defer cmd.Process.Kill()
+		c := make(chan error, 1)
+		go func() { c <- cmd.Wait() }()
+		done = append(done, c)
+		procs = append(procs, mockProcProcess{pid: cmd.Process.Pid, oom_score: 900 - i, VmRSSkiB: 100 * 1024})
+	}
+	// kill_batch() may check the memory situation. Open /proc/meminfo
+	// before switching to the mock procdir.
+	parse_meminfo()
+	mockProc(t, procs)
+	defer procdir_path("/proc")
+
+	// 1126 MiB - 900 MiB: 3 processes
+	if res := kill_batch(1, 900*1024, 10*1024*1024); res != 0 {
+		t.Errorf("kill_batch: have=%d want=0", res)
+	}
+	for i, c := range done {
+		select {
+		case <-c:
+		case <-time.After(5 * time.Second):
+			t.Errorf("process #%d was not killed", i)
+		}
+	}
+}
+
+// With -g, all members of the process group are killed and waited for
+func Test_kill_process_group(t *testing.T) {
+	defer enable_debug(enable_debug(false))
+	cmd := exec.Command("sh", "-c", "for i in 1 2 3 4 5 6 7 8 9 10; do sleep 100 & done; wait")
+	cmd.SysProcAttr = &syscall.SysProcAttr{Setpgid: true}
+	if err := cmd.Start(); err != nil {
+		t.Fatal(err)
+	}
+	defer syscall.Kill(-cmd.Process.Pid, syscall.SIGKILL)
+	go cmd.Wait()
+	pgid := cmd.Process.Pid
+	var members []int
+	for i := 0; i < 100 && len(members) < 11; i++ {
+		time.Sleep(10 * time.Millisecond)
+		members = nil
+		for _, pid := range procfs_list_pids() {
+			if res, stat := parse_proc_pid_stat(pid); res && int(stat.pgrp) == pgid {
+				members = append(members, pid)
+			}
+		}
+	}
+	if len(members) != 11 {
+		t.Fatalf("process group has %d members, want 11", len(members))
+	}
+
+	if res := kill_process_group(pgid); res != 0 {
+		t.Errorf("kill_process: have=%d want=0", res)
+	}
+	for _, pid := range members {
+		if is_alive(pid) {
+			t.Errorf("pid %d is still alive", pid)
+		}
+	}
+}
+
+func Test_cgroup_find_largest(t *testing.T) {
+	defer enable_debug(enable_debug(false))
+	const MiB = 1024 * 1024
+	mockProc(t, []mockProcProcess{
+		{pid: 100, oom_score: 100},
+		{pid: 101, oom_score: 100},
+		{pid: 102, oom_score: 100, oom_score_adj: -1000},
+	})
+	defer procdir_path("/proc")
+	root := mockCgroups(t, []mockCgroup{
+		// Not a leaf
+		{path: "/a", current: 10000 * MiB, swapCurrent: 0, procs: []int{100}},
+		{path: "/a/x", current: 100 * MiB, swapCurrent: 0, procs: []int{100}},
+		// Contains us
+		{path: "/a/y", current: 300 * MiB, swapCurrent: 0, procs: []int{os.Getpid()}},
+		// Largest, counting swap
+		{path: "/b", current: 150 * MiB, swapCurrent: 100 * MiB, procs: []int{101}},
+		// Empty
+		{path: "/c", current: 500 * MiB, swapCurrent: -1},
+		// Protected by oom_score_adj -1000
+		{path: "/d", current: 400 * MiB, swapCurrent: 0, procs: []int{100, 102}},
+		// No memory controller
+		{path: "/e", current: -1, swapCurrent: -1, procs: []int{100}},
+	})
+	defer os.RemoveAll(root)
+
+	testCases := []struct {
+		root     string
+		name     string
+		mem_kib  int64
+		swap_kib int64
+	}{
+		{root, "/b", 150 * 1024, 100 * 1024},
+		{root + "/", "/b", 150 * 1024, 100 * 1024},
+		{root + "/a", "/x", 100 * 1024, 0},
+	}
+	for _, tc := range testCases {
+		name, mem_kib, swap_kib, res := cgroup_find_largest(tc.root, false)
+		if res != 0 || name != tc.name || mem_kib != tc.mem_kib || swap_kib != tc.swap_kib {
+			t.Errorf("%s: have=%q %d %d res=%d, want=%q %d %d", tc.root, name, mem_kib, swap_kib, res, tc.name, tc.mem_kib, tc.swap_kib)
+		}
+	}
+	if _, _, _, res := cgroup_find_largest(root+"/c", false); res != -int(syscall.ESRCH) {
+		t.Errorf("empty cgroup: have res=%d, want=%d", res, -int(syscall.ESRCH))
+	}
+}
+
+func Test_cgroup_hints(t *testing.T) {
+	defer enable_debug(enable_debug(false))
+	const MiB = 1024 * 1024
+	root := mockCgroups(t, []mockCgroup{
+		{path: "/omit", current: -1, swapCurrent: -1, xattrs: []string{"user.oomd_omit"}},
+		// Inherits user.oomd_omit
+		{path: "/omit/svc", current: 1000 * MiB, swapCurrent: 0, procs: []int{100}},
+		// Within memory.min
+		{path: "/min", current: 100 * MiB, swapCurrent: 0, procs: []int{101}, min: 200 * MiB},
+		{path: "/avoid", current: 900 * MiB, swapCurrent: 0, procs: []int{102}, xattrs: []string{"user.oomd_avoid"}},
+		// Within memory.low
+		{path: "/low", current: 100 * MiB, swapCurrent: 0, procs: []int{103}, low: 200 * MiB},
+		{path: "/plain/svc", current: 150 * MiB, swapCurrent: 0, procs: []int{104}},
+		// Above memory.min, so not protected
+		{path: "/big-min", current: 300 * MiB, swapCurrent: 0, procs: []int{105}, min: 200 * MiB},
+	})
+	defer os.RemoveAll(root)
+	mockProc(t, []mockProcProcess{
+		{pid: 100, oom_score: 500, cgroup: "/omit/svc"},
+		{pid: 101, oom_score: 450, cgroup: "/min"},
+		{pid: 102, oom_score: 400, cgroup: "/avoid"},
+		{pid: 103, oom_score: 350, cgroup: "/low"},
+		{pid: 104, oom_score: 200, cgroup: "/plain/svc"},
+		{pid: 105, oom_score: 150, cgroup: "/big-min"},
+	})
+	defer procdir_path("/proc")
+	cgroup_hints_init(root)
+
+	if have := find_largest_process_hints(false); have != 100 {
+		t.Errorf("without hints: have pid %d, want 100", have)
+	}
+	if have := find_largest_process_hints(true); have != 104 {
+		t.Errorf("with hints: have pid %d, want 104", have)
+	}
+	if name, _, _, _ := cgroup_find_largest(root, false); name != "/omit/svc" {
+		t.Errorf("cgroup without hints: have %q, want /omit/svc", name)
+	}
+	if name, _, _, _ := cgroup_find_largest(root, true); name != "/big-min" {
+		t.Errorf("cgroup with hints: have %q, want /big-min", name)
+	}
+	// The hints also hold for walks below the mount
+	if name, _, _, res := cgroup_find_largest(root+"/omit", true); res != -int(syscall.ESRCH) {
+		t.Errorf("below /omit with hints: have %q res=%d, want res=%d", name, res, -int(syscall.ESRCH))
+	}
+	// Only cgroups that want to be avoided are left
+	os.RemoveAll(root + "/plain")
+	os.RemoveAll(root + "/big-min")
+	if name, _, _, _ := cgroup_find_largest(root, true); name != "/avoid" {
+		t.Errorf("cgroup with hints: have %q, want /avoid", name)
+	}
+}
+
+func Test_kill_cgroup(t *testing.T) {
+	mnt := cgroup2Mount()
+	if mnt == "" {
+		t.Skip("no cgroup v2 hierarchy")
+	}
+	dir, err := ioutil.TempDir(mnt, "earlyoom-test-")
+	if err != nil {
+		t.Skipf("cannot create a cgroup: %v", err)
+	}
+	defer os.Remove(dir)
+	defer enable_debug(enable_debug(false))
+
+	// The shell waits for us to move it into the cgroup before it forks
+	cmd := exec.Command("sh", "-c", "read x; for i in 1 2 3 4 5; do sleep 100 & done; wait")
+	cmd.SysProcAttr = &syscall.SysProcAttr{Setpgid: true}
+	stdin, err := cmd.StdinPipe()
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := cmd.Start(); err != nil {
+		t.Fatal(err)
+	}
+	defer syscall.Kill(-cmd.Process.Pid, syscall.SIGKILL)
+	go cmd.Wait()
+	if err := ioutil.WriteFile(dir+"/cgroup.procs", []byte(fmt.Sprint(cmd.Process.Pid)), 0644); err != nil {
+		t.Skipf("cannot move a process into the cgroup: %v", err)
+	}
+	stdin.Write([]byte("go\n"))
+
+	var members []string
+	for i := 0; i < 100 && len(members) < 6; i++ {
+		time.Sleep(10 * time.Millisecond)
+		content, _ := ioutil.ReadFile(dir + "/cgroup.procs")
+		members = strings.Fields(string(content))
+	}
+	if len(members) != 6 {
+		t.Fatalf("cgroup has %d members, want 6", len(members))
+	}
+	if have, res := get_cgroup(cmd.Process.Pid); res != 0 || !strings.HasSuffix(dir, have) {
+		t.Errorf("get_cgroup: have=%q res=%d, want a suffix of %q", have, res, dir)
+	}
+
+	if res := kill_cgroup(dir); res != 0 {
+		t.Errorf("kill_cgroup: have=%d want=0", res)
+	}
+	if content, _ := ioutil.ReadFile(dir + "/cgroup.events"); !strings.Contains(string(content), "populated 0") {
+		t.Errorf("cgroup.events: %q", content)
+	}
+}
+
+func Test_proc_events(t *testing.T) {
+	if res := proc_events_open(); res != 0 {
+		t.Skipf("proc connector not available: %v", syscall.Errno(-res))
+	}
+	defer enable_debug(enable_debug(false))
+	if have := proc_events_list_pids(); !containsInt(have, os.Getpid()) {
+		t.Fatalf("own pid %d missing from %v", os.Getpid(), have)
+	}
+
+	cmd := exec.Command("sleep", "10")
+	if err := cmd.Start(); err != nil {
+		t.Fatal(err)
+	}
+	pid := cmd.Process.Pid
+	// Events are delivered asynchronously
+	waitFor := func(want bool) {
+		for i := 0; i < 100; i++ {
+			if containsInt(proc_events_list_pids(), pid) == want {
+				return
+			}
+			time.Sleep(10 * time.Millisecond)
+		}
+		t.Errorf("pid %d: in table should be %v", pid, want)
+	}
+	waitFor(true)
+	cmd.Process.Kill()
+	cmd.Wait()
+	waitFor(false)
+
+	// The table is only used for the real /proc
+	mockProc(t, []mockProcProcess{{pid: 100, oom_score: 100, VmRSSkiB: 4}})
+	defer procdir_path("/proc")
+	if have := find_largest_process_pid(false, 1); have != 100 {
+		t.Errorf("mock procdir: have=%d want=100", have)
+	}
+}
+
+func Test_fill_rate(t *testing.T) {
+	// 1 GiB of memory and swap, checked every 100 ms
+	series := func(n int, memRate int64, swapRate int64) (samples [][3]int64) {
+		for i := int64(0); i < int64(n); i++ {
+			samples = append(samples, [3]int64{1000 + i*100, 1<<20 - i*100*memRate, 1<<20 - i*100*swapRate})
+		}
+		return
+	}
+	if _, ok := fill_rate_series(series(3, 1000, 0), 100); ok {
+		t.Error("estimate available before warmup")
+	}
+	// Steady 1000 MiB/s, swap untouched
+	est, ok := fill_rate_series(series(10, 1000, 0), 100)
+	if !ok {
+		t.Fatal("no estimate")
+	}
+	if est.memRate != 1000 || est.memMax != 1000 || est.memEwma != 1000 {
+		t.Errorf("steady: %+v", est)
+	}
+	if est.swapRate != FILL_RATE_MIN {
+		t.Errorf("idle swap should be clamped to FILL_RATE_MIN: %+v", est)
+	}
+	// Margin
+	est, _ = fill_rate_series(series(10, 1000, 0), 250)
+	if est.memRate != 2500 {
+		t.Errorf("margin 250%%: have %v, want 2500", est.memRate)
+	}
+	// A single 100 ms burst of 3000 MiB/s is remembered by the recent maximum,
+	// although the average hardly moves
+	samples := series(10, 0, 0)
+	last := samples[len(samples)-1]
+	samples = append(samples, [3]int64{last[0] + 100, last[1] - 300000, last[2]})
+	est, _ = fill_rate_series(samples, 100)
+	if est.memMax != 3000 || est.memRate != 3000 || est.memEwma >= 100 {
+		t.Errorf("burst: %+v", est)
+	}
+	// ... until it drops out of the history
+	for i := 1; i <= FILL_RATE_HISTORY; i++ {
+		samples = append(samples, [3]int64{last[0] + 100 + int64(i)*100, last[1] - 300000, last[2]})
+	}
+	est, _ = fill_rate_series(samples, 100)
+	if est.memMax != 0 || est.memRate != FILL_RATE_MIN {
+		t.Errorf("burst should be forgotten: %+v", est)
+	}
+	// Freeing memory does not count as a negative fill rate
+	est, _ = fill_rate_series(series(10, -1000, 0), 100)
+	if est.memMax != 0 || est.memRate != FILL_RATE_MIN {
+		t.Errorf("freeing: %+v", est)
+	}
+}
+
+func Test_fill_rate_predict(t *testing.T) {
+	const floor = 1 << 20 // SIGTERM limits at 1 GiB
+	const limit = 2000
+	// Samples every 100 ms, starting at 3 GiB of memory and 1 GiB of swap
+	// that are used up at rate[i] MiB/s.
+	record := func(rate ...int64) (samples [][3]int64) {
+		mem, swap := int64(3<<20), int64(1<<20)
+		for i, r := range rate {
+			mem -= r * 100
+			samples = append(samples, [3]int64{int64(i) * 100, mem, swap})
+		}
+		return
+	}
+	firstFired := func(fired []bool) int {
+		for i, f := range fired {
+			if f {
+				return i
+			}
+		}
+		return -1
+	}
+
+	// Idle: no forecast
+	fired, etas := fill_rate_predict_series(record(0, 0, 0, 0, 0, 0), floor, limit)
+	if firstFired(fired) != -1 || etas[len(etas)-1] != -1 {
+		t.Errorf("idle: fired=%v etas=%v", fired, etas)
+	}
+	// 1000 MiB/s against 3 GiB of headroom: ~3 s left at the start, and
+	// less than 2 s after ~1 s. Must fire, but only after 3 forecasts in a row.
+	fired, etas = fill_rate_predict_series(record(1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000), floor, limit)
+	i := firstFired(fired)
+	if i < 0 {
+		t.Fatalf("steady fill did not fire: etas=%v", etas)
+	}
+	below := 0
+	for j := 0; j < i; j++ {
+		if etas[j] >= 0 && etas[j] < limit {
+			below++
+		}
+	}
+	if below != FILL_RATE_PREDICT_HITS-1 {
+		t.Errorf("fired after %d forecasts below the limit, want %d: etas=%v", below+1, FILL_RATE_PREDICT_HITS, etas)
+	}
+	// A single 100 ms spike of 10 GiB/s does not fire
+	fired, etas = fill_rate_predict_series(record(0, 0, 0, 10000, 0, 0, 0, 0, 0, 0), floor, limit)
+	if firstFired(fired) != -1 {
+		t.Errorf("spike fired: etas=%v", etas)
+	}
+	// Hysteresis: once firing, we keep firing until the forecast is 1.5
+	// times the limit. Fast fill, slowdown, stop.
+	var rates []int64
+	for j := 0; j < 60; j++ {
+		r := int64(1000)
+		if j >= 16 {
+			r = 300
+		}
+		if j >= 40 {
+			r = 0
+		}
+		rates = append(rates, r)
+	}
+	fired, etas = fill_rate_predict_series(record(rates...), floor, limit)
+	inBand := 0
+	for j := 1; j < len(fired); j++ {
+		if !fired[j-1] {
+			continue
+		}
+		if etas[j] >= 0 && etas[j] < limit*3/2 {
+			if !fired[j] {
+				t.Errorf("stopped firing at %d with eta %d ms", j, etas[j])
+			}
+			if etas[j] >= limit {
+				inBand++
+			}
+		} else if fired[j] {
+			t.Errorf("still firing at %d with eta %d ms", j, etas[j])
+		}
+	}
+	if inBand == 0 {
+		t.Errorf("series never entered the hysteresis band: fired=%v etas=%v", fired, etas)
+	}
+	if fired[len(fired)-1] {
+		t.Errorf("still firing after memory use stopped")
+	}
+}
+
+func Test_psi_trigger(t *testing.T) {
+	if res := psi_trigger_open("bogus"); res != -int(syscall.EINVAL) && res != -int(syscall.ENOENT) {
+		t.Errorf("invalid trigger: have %d", res)
+	}
+	// Unprivileged users need a window that is a multiple of 2 s
+	fd := psi_trigger_open("some 150000 2000000")
+	if fd < 0 {
+		t.Skipf("PSI not available: %v", syscall.Errno(-fd))
+	}
+	syscall.Close(fd)
+}
+
 func Benchmark_parse_meminfo(b *testing.B) {
 	enable_debug(false)
 
@@ -341,6 +1594,22 @@ func Benchmark_parse_meminfo(b *testing.B) {
 	}
 }
 
+// Like Benchmark_parse_meminfo, but without the cost of the kernel
+// generating /proc/meminfo
+func Benchmark_parse_meminfo_buf(b *testing.B) {
+	enable_debug(false)
+	content, err := ioutil.ReadFile("/proc/meminfo")
+	if err != nil {
+		b.Fatal(err)
+	}
+	buf := string(content)
+	b.ResetTimer()
+
+	for n := 0; n < b.N; n++ {
+		parse_meminfo_buf(buf)
+	}
+}
+
 func Benchmark_kill_process(b *testing.B) {
 	enable_debug(false)
 
@@ -357,6 +1626,91 @@ func Benchmark_find_largest_process(b *testing.B) {
 	}
 }
 
+// Like Benchmark_find_largest_process, but reading /proc with io_uring
+func Benchmark_find_largest_process_io_uring(b *testing.B) {
+	enable_debug(false)
+	if res := procfs_uring_open(); res < 0 {
+		b.Skipf("io_uring not available: %v", syscall.Errno(-res))
+	}
+	defer procfs_uring_close()
+
+	for n := 0; n < b.N; n++ {
+		find_largest_process()
+	}
+}
+
+// --sort-by-rss only needs /proc/[pid]/stat for most processes
+func Benchmark_find_largest_process_sort_by_rss(b *testing.B) {
+	enable_debug(false)
+
+	for n := 0; n < b.N; n++ {
+		find_largest_process_pid(true, 1)
+	}
+}
+
+// Like Benchmark_find_largest_process, but with --estimate-oom-score
+func Benchmark_find_largest_process_estimated(b *testing.B) {
+	enable_debug(false)
+
+	for n := 0; n < b.N; n++ {
+		find_largest_process_estimated(1)
+	}
+}
+
+// --ignore-root-user needs the uid of each process, which is cached
+// across scans (unless it is 0). calls/op is the number of /proc lookups
+// per scan, compare with Benchmark_find_largest_process_ignore_root_cold.
+func Benchmark_find_largest_process_ignore_root(b *testing.B) {
+	enable_debug(false)
+
+	c0 := procfs_calls()
+	for n := 0; n < b.N; n++ {
+		find_largest_process_ignore_root()
+	}
+	b.ReportMetric(float64(procfs_calls()-c0)/float64(b.N), "calls/op")
+}
+
+// Like Benchmark_find_largest_process_ignore_root, but without the benefit
+// of the proc cache
+func Benchmark_find_largest_process_ignore_root_cold(b *testing.B) {
+	enable_debug(false)
+
+	c0 := procfs_calls()
+	for n := 0; n < b.N; n++ {
+		proc_cache_flush()
+		find_largest_process_ignore_root()
+	}
+	b.ReportMetric(float64(procfs_calls()-c0)/float64(b.N), "calls/op")
+}
+
+func Benchmark_find_largest_process_scan_threads(b *testing.B) {
+	enable_debug(false)
+	if res := scan_pool_init(4); res != 0 {
+		b.Fatalf("scan_pool_init: %d", res)
+	}
+
+	for n := 0; n < b.N; n++ {
+		find_largest_process_pid(false, 4)
+	}
+}
+
+func Benchmark_procfs_list_pids(b *testing.B) {
+	for n := 0; n < b.N; n++ {
+		if len(procfs_list_pids()) == 0 {
+			b.Fatal("no pids")
+		}
+	}
+}
+
+// Baseline for Benchmark_procfs_list_pids
+func Benchmark_readdir_count_pids(b *testing.B) {
+	for n := 0; n < b.N; n++ {
+		if readdir_count_pids() <= 0 {
+			b.Fatal("no pids")
+		}
+	}
+}
+
 func Benchmark_get_oom_score(b *testing.B) {
 	enable_debug(false)
 
@@ -391,6 +1745,21 @@ func Benchmark_get_cmdline(b *testing.B) {
 	}
 }
 
+// Like Benchmark_parse_proc_pid_stat, but without reading the file
+func Benchmark_parse_proc_pid_stat_buf(b *testing.B) {
+	enable_debug(false)
+	content, err := ioutil.ReadFile("/proc/self/stat")
+	if err != nil {
+		b.Fatal(err)
+	}
+	b.ResetTimer()
+
+	res, out := parse_proc_pid_stat_buf_n(string(content), b.N)
+	if !res || out.num_threads == 0 {
+		b.Fatal("failed")
+	}
+}
+
 func Benchmark_parse_proc_pid_stat(b *testing.B) {
 	enable_debug(false)
 
@@ -439,3 +1808,84 @@ func TestTriggerKernelOomKiller_WithNoAccessToSysrq(t *testing.T) {
 		t.Errorf("Expected -1 for non-root user, got %d", res)
 	}
 }
+
+func Test_cgroup_watch(t *testing.T) {
+	defer enable_debug(enable_debug(false))
+	const MiB = 1024 * 1024
+	root := mockCgroups(t, []mockCgroup{
+		{path: "/app", current: 900 * MiB, swapCurrent: -1, procs: []int{100}},
+		{path: "/app/worker", current: 0, swapCurrent: -1, procs: []int{101, 102}},
+	})
+	defer os.RemoveAll(root)
+	defer cgroup_watch_reset()
+	dir := root + "/app"
+	write := func(name string, content string) {
+		if err := ioutil.WriteFile(dir+"/"+name, []byte(content), 0644); err != nil {
+			t.Fatal(err)
+		}
+	}
+	write("memory.max", "max\n")
+	write("memory.high", "max\n")
+	write("memory.stat", "anon 0\n")
+	write("memory.events", "high 0\nmax 0\n")
+
+	if pids := cgroup_read_procs_below(dir); len(pids) != 3 {
+		t.Errorf("cgroup_read_procs_below: have %v, want 3 processes", pids)
+	}
+	if res := cgroup_watch_add(root+"/nonexistent", 20, 10); res != -int(syscall.ENOENT) {
+		t.Errorf("cgroup_watch_add nonexistent: have %d, want %d", res, -int(syscall.ENOENT))
+	}
+	idx := cgroup_watch_add(dir, 20, 10)
+	if idx < 0 {
+		t.Fatalf("cgroup_watch_add: %d", idx)
+	}
+
+	// The files are kept open. pread() has to see the new contents.
+	testcases := []struct {
+		max, high, stat string
+		wantPercent     float64
+		wantSig         int
+	}{
+		// 1000 - 900 + 150 reclaimable
+		{fmt.Sprint(1000 * MiB), "max", fmt.Sprintf("anon 1\ninactive_file %d\nslab_reclaimable %d\n", 100*MiB, 50*MiB), 25, 0},
+		{fmt.Sprint(1000 * MiB), fmt.Sprint(1000 * MiB), fmt.Sprintf("inactive_file %d\n", 50*MiB), 15, int(syscall.SIGTERM)},
+		// memory.high is the lower limit
+		{"max", fmt.Sprint(950 * MiB), "anon 1\n", 50.0 * 100 / 950, int(syscall.SIGKILL)},
+		// No limit
+		{"max", "max", "anon 1\n", 100, 0},
+	}
+	for i, tc := range testcases {
+		write("memory.max", tc.max+"\n")
+		write("memory.high", tc.high+"\n")
+		write("memory.stat", tc.stat)
+		sig, percent, res := cgroup_watch_sample(idx)
+		if res != 0 || sig != tc.wantSig || math.Abs(percent-tc.wantPercent) > 0.01 {
+			t.Errorf("case %d: have sig=%d percent=%.2f res=%d, want sig=%d percent=%.2f", i, sig, percent, res, tc.wantSig, tc.wantPercent)
+		}
+	}
+
+	write("memory.max", fmt.Sprint(1000*MiB)+"\n")
+	write("memory.stat", fmt.Sprintf("inactive_file %d\n", 50*MiB))
+	now := monitor_now_ms()
+	if ms := cgroup_watch_timeout_ms(now); ms <= 0 {
+		t.Errorf("cgroup_watch_timeout_ms right after a check: have %d, want > 0", ms)
+	}
+	if have, _ := cgroup_watch_next(now); have != "" {
+		t.Errorf("cgroup_watch_next before it is due: have %q", have)
+	}
+	// The kernel touches memory.events when the cgroup runs into memory.high
+	write("memory.events", "high 1\nmax 0\n")
+	if n := cgroup_watch_drain(now); n != 1 {
+		t.Errorf("cgroup_watch_drain: have %d, want 1", n)
+	}
+	if ms := cgroup_watch_timeout_ms(now); ms != 0 {
+		t.Errorf("cgroup_watch_timeout_ms after the event: have %d, want 0", ms)
+	}
+	if have, sig := cgroup_watch_next(now); have != dir || sig != int(syscall.SIGTERM) {
+		t.Errorf("cgroup_watch_next: have %q sig=%d, want %q sig=%d", have, sig, dir, int(syscall.SIGTERM))
+	}
+	// Every cgroup is checked only once for the same time
+	if have, _ := cgroup_watch_next(now); have != "" {
+		t.Errorf("cgroup_watch_next again: have %q", have)
+	}
+}